@@ -0,0 +1,80 @@
+// ------------------------------------------------------------------------------------------------
+// Just enough of the Arduino core to build the 6410 interface and the tx20 emulator on a host.
+//
+// Time, the pins and the interrupts come from the simulated board in hostboard.cpp, and Print
+// writes to stdout. See hostboard.h.
+// ------------------------------------------------------------------------------------------------
+#pragma once
+
+#include <math.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <avr/interrupt.h>
+#include <avr/io.h>
+#include <avr/pgmspace.h>
+
+#define HIGH 1
+#define LOW 0
+
+#define INPUT 0
+#define OUTPUT 1
+#define INPUT_PULLUP 2
+
+#define LED_BUILTIN 13
+#define A0 14
+
+#define NOT_AN_INTERRUPT -1
+
+// Time.
+unsigned long millis();
+unsigned long micros();
+
+// The pins.
+void pinMode(uint8_t pin, uint8_t mode);
+void digitalWrite(uint8_t pin, uint8_t level);
+int digitalRead(uint8_t pin);
+int analogRead(uint8_t pin);
+
+inline void noInterrupts() {}
+inline void interrupts() {}
+
+// The pin mapping of an ATmega328 Arduino.
+int digitalPinToInterrupt(uint8_t pin);
+uint8_t digitalPinToPort(uint8_t pin);
+uint8_t digitalPinToBitMask(uint8_t pin);
+volatile uint8_t* portOutputRegister(uint8_t port);
+volatile uint8_t* portInputRegister(uint8_t port);
+volatile uint8_t* digitalPinToPCICR(uint8_t pin);
+uint8_t digitalPinToPCICRbit(uint8_t pin);
+volatile uint8_t* digitalPinToPCMSK(uint8_t pin);
+uint8_t digitalPinToPCMSKbit(uint8_t pin);
+
+// Strings in flash are ordinary strings.
+class __FlashStringHelper;
+#define F(s) (reinterpret_cast<const __FlashStringHelper*>(s))
+
+// Text output.
+class Print {
+
+public:
+  virtual ~Print() {}
+
+  virtual size_t write(uint8_t c) = 0;
+  size_t write(const char* s);
+
+  size_t print(const __FlashStringHelper* s) { return write(reinterpret_cast<const char*>(s)); }
+  size_t print(const char* s) { return write(s); }
+  size_t print(char c) { return write(static_cast<uint8_t>(c)); }
+  size_t print(int n) { return print(static_cast<long>(n)); }
+  size_t print(unsigned int n) { return print(static_cast<unsigned long>(n)); }
+  size_t print(long n);
+  size_t print(unsigned long n);
+  size_t print(double n, int digits = 2);
+
+  template <typename T>
+  size_t println(T value) { return print(value) + println(); }
+  size_t println() { return write("\r\n"); }
+};
@@ -0,0 +1,21 @@
+// ------------------------------------------------------------------------------------------------
+// Interrupt vectors for the host build.
+//
+// An isr is an ordinary function, which the simulated board calls when the interrupt is due.
+// ------------------------------------------------------------------------------------------------
+#pragma once
+
+#define ISR(vector, ...) extern "C" void vector(void)
+
+#define INT0_vect host_int0_vect
+#define INT1_vect host_int1_vect
+#define PCINT0_vect host_pcint0_vect
+#define PCINT1_vect host_pcint1_vect
+#define PCINT2_vect host_pcint2_vect
+#define TIMER1_COMPA_vect host_timer1_compa_vect
+#define TIMER1_COMPB_vect host_timer1_compb_vect
+
+// Interrupts only run when the board is driven, never in the middle of the main loop, so they
+// don't need to be turned off.
+inline void sei() {}
+inline void cli() {}
@@ -0,0 +1,43 @@
+// ------------------------------------------------------------------------------------------------
+// The ATmega328 registers used by the bridge, for the host build.
+//
+// The registers are plain variables, defined in hostboard.cpp. Only the ones the simulated board
+// knows about do anything, see hostboard.h.
+// ------------------------------------------------------------------------------------------------
+#pragma once
+
+#include <stdint.h>
+
+#ifndef F_CPU
+#define F_CPU 8000000UL
+#endif
+
+#define _BV(bit) (1 << (bit))
+
+// The ports.
+extern volatile uint8_t PINB, DDRB, PORTB;
+extern volatile uint8_t PINC, DDRC, PORTC;
+extern volatile uint8_t PIND, DDRD, PORTD;
+
+// Timer 1.
+extern volatile uint8_t TCCR1A, TCCR1B, TCCR1C, TIMSK1, TIFR1;
+extern volatile uint16_t TCNT1, OCR1A, OCR1B;
+
+#define CS10 0
+#define CS11 1
+#define CS12 2
+#define COM1B0 4
+#define COM1A0 6
+#define FOC1B 6
+#define FOC1A 7
+#define OCIE1A 1
+#define OCIE1B 2
+#define OCF1A 1
+#define OCF1B 2
+
+// The external and pin change interrupts.
+extern volatile uint8_t EICRA, EIMSK, EIFR;
+extern volatile uint8_t PCICR, PCIFR, PCMSK0, PCMSK1, PCMSK2;
+
+#define INT0 0
+#define INT1 1
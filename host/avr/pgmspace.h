@@ -0,0 +1,12 @@
+// ------------------------------------------------------------------------------------------------
+// Program memory for the host build, which is just ordinary memory.
+// ------------------------------------------------------------------------------------------------
+#pragma once
+
+#include <string.h>
+
+#define PROGMEM
+#define PSTR(s) (s)
+
+inline int strcmp_P(const char* a, const char* b) { return strcmp(a, b); }
+inline void* memcpy_P(void* dest, const void* src, size_t n) { return memcpy(dest, src, n); }
@@ -0,0 +1,505 @@
+// ------------------------------------------------------------------------------------------------
+// Sweep the Dtr timing through every state of the tx20 emulator on the host.
+//
+//    program [-p <period ms>] [-b <bit length us>] [-l <loop us>] [-v]
+//
+// Each run starts with the emulator disabled and Dtr high. Dtr goes low, then high again at a
+// point picked to land in one of the emulator's states: before the first pass of the main loop
+// has seen it (disabled), in start_sample, at 16 points across the sample and at the end of it
+// (sampling), in the last pass before the sample ends (sending), at 2 points in every bit of the
+// frame (transmitting), and in the start_sample and sampling that follow the frame. Dtr then
+// stays high, or goes low again half a pass, one and a half passes, 60 bits or a sample period
+// later. Every run is repeated with Dtr first going low at 5 points in a millisecond, so that
+// the edges fall on and between the passes of the main loop and at every phase of millis().
+//
+// Three things are measured from what happens on the pins and in the wind meter, not from the
+// emulator's own counters.
+//
+//    first frame   from Dtr going low (the last time, if it goes low twice) to the start of the
+//                  next frame
+//    abort         from Dtr going high to the emulator stopping, if it does
+//    wasted        the samples the 6410 finished or started counting that were never sent, not
+//                  counting one it started in the same pass it was aborted
+//
+// The worst of each is written to stdout for every state Dtr went high in and every gap before
+// it went low again, along with the bounds the emulator should keep to. A first frame must start
+// within a sample period plus a millisecond (millis() only counts whole ones) and 2 passes of the
+// loop, and the emulator must stop within 2 passes of Dtr going high, or 51 bits and 2 passes if
+// it was sending a frame. The exit status is 1 if any run breaks a bound. With -v every run is
+// written out as well.
+//
+// The sample period defaults to the 6410's, the bit length to legacy bits and the main loop runs
+// every 100 us. The wind is steady at 10 mph. The real 6410 interface, tx20 emulator and bit
+// scheduler are used, on the simulated board in hostboard.cpp.
+// ------------------------------------------------------------------------------------------------
+#ifndef PIO_UNIT_TESTING
+
+#include <Arduino.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <vector>
+
+#include "davis6410.h"
+#include "hostboard.h"
+#include "tx20emulator.h"
+#include "tx20frame.h"
+
+// The pins, as in main.cpp.
+constexpr int k_wind_sensor_pin = 2;
+constexpr int k_wind_direction_pin = A0;
+constexpr int k_dtr_pin = 3;
+constexpr int k_txd_pin = 4;
+
+// The default time between passes of the main loop in microseconds.
+constexpr uint64_t k_loop_us = 100;
+
+// The anemometer gives a pulse every 225 ms, 10 mph.
+constexpr uint64_t k_pulse_us = 225000;
+
+// The points in a millisecond Dtr first goes low at.
+constexpr uint64_t k_phases_us[] = { 0, 1, 250, 500, 999 };
+
+// The number of points across a sample and in each bit that Dtr goes high at.
+constexpr int k_sample_points = 16;
+constexpr int k_bit_points = 2;
+
+// The time to let everything settle between runs.
+constexpr uint64_t k_settle_us = 10000;
+
+// The gaps before Dtr goes low again, 0 for not at all.
+enum class regap : uint8_t {
+  none,
+  half_pass,
+  pass_and_half,
+  frame,
+  period,
+};
+
+static const char* const regap_names[] = { "-", "0.5 pass", "1.5 pass", "60 bits", "period" };
+constexpr int k_regaps = 5;
+
+// The emulator states, in the order of tx20state.
+static const char* const state_names[] = {
+  "nothing", "disabled", "start_sample", "sampling", "sending", "transmitting",
+};
+constexpr int k_states = 6;
+
+// The settings.
+static unsigned long period = k_wind_speed_sample_t;
+static uint64_t loop_us = k_loop_us;
+static uint64_t bit_us = 0;
+static bool verbose = false;
+
+static davis6410* wind_meter;
+static tx20emulator* emulator;
+
+// The next anemometer pulse and the starts of the frames.
+static uint64_t next_pulse = k_pulse_us;
+static std::vector<uint64_t> frame_starts;
+
+// What is seen in a run.
+struct runresult {
+  int state = 0;                // the state the emulator was in when it saw Dtr go high
+  bool framed = false;          // a frame started after Dtr last went low
+  uint64_t first_frame = 0;
+  bool aborted = false;         // the emulator stopped while Dtr was high
+  uint64_t abort = 0;
+  uint32_t wasted = 0;
+  bool timed_out = false;       // the run didn't finish
+};
+
+// The worst seen for each state and gap.
+struct worst {
+  uint32_t runs = 0;
+  bool framed = false;
+  uint64_t first_frame = 0;
+  bool aborted = false;
+  uint64_t abort = 0;
+  uint32_t wasted = 0;
+  bool broken = false;
+};
+
+static worst table[k_states][k_regaps];
+
+// The times of a run that just holds Dtr low, from when it went low.
+struct reference {
+  uint64_t enabled;             // the first pass that sees Dtr low
+  uint64_t sampling;            // the pass the emulator starts sampling
+  uint64_t frame;               // the start of the first frame
+  uint64_t frame_end;           // the pass the emulator finishes the frame
+  uint64_t next_frame;          // the start of the second frame
+};
+
+// ------------------------------------------------------------------------------------------------
+// Note the start of each frame. The event time is micros(), which is turned back into the
+// unwrapped time.
+// ------------------------------------------------------------------------------------------------
+static void tx20_event_handler(const tx20eventinfo& event) {
+  if (event.event != tx20event::start_data_frame) return;
+
+  uint32_t age = static_cast<uint32_t>(micros()) - event.t;
+  frame_starts.push_back(host_now() - age);
+}
+
+// ------------------------------------------------------------------------------------------------
+// Keep count of the samples the 6410 starts, finishes and throws away.
+// It is called after each service() call, and each one moves the 6410 on by one state at most.
+// ------------------------------------------------------------------------------------------------
+class samplewatch {
+public:
+  void update() {
+    davis6410state state = wind_meter->state();
+
+    if (last_ == davis6410state::new_sample && state == davis6410state::sampling_speed) {
+      counting_ = true;
+      window_start_ = host_now();
+    } else if (last_ == davis6410state::sampling_speed &&
+               state == davis6410state::sampling_direction) {
+      // The sample is finished and the next one starts from the same count.
+      finished_ = true;
+      window_start_ = host_now();
+    } else if (last_ == davis6410state::send_frame && state == davis6410state::sampling_speed) {
+      finished_ = false;
+    } else if (last_ != davis6410state::idle && state == davis6410state::idle) {
+      if (finished_) ++wasted_;
+      if (counting_ && window_start_ < host_now()) ++wasted_;
+      finished_ = false;
+      counting_ = false;
+    }
+
+    last_ = state;
+  }
+
+  uint32_t wasted() const { return wasted_; }
+
+private:
+  davis6410state last_ = davis6410state::idle;
+  uint64_t window_start_ = 0;
+  bool counting_ = false;
+  bool finished_ = false;
+  uint32_t wasted_ = 0;
+};
+
+// ------------------------------------------------------------------------------------------------
+// Move the clock on by one pass of the main loop, playing the anemometer pulses and the Dtr
+// edges on the way.
+// ------------------------------------------------------------------------------------------------
+static void advance(const std::vector<std::pair<uint64_t, bool>>& dtr) {
+  uint64_t next = host_now() + loop_us;
+  for (;;) {
+    uint64_t t = next;
+    for (const auto& edge : dtr) {
+      if (edge.first > host_now() && edge.first < t) t = edge.first;
+    }
+    if (next_pulse < t) t = next_pulse;
+
+    host_advance(t);
+    for (const auto& edge : dtr) {
+      if (edge.first == t) host_drive_pin(k_dtr_pin, edge.second);
+    }
+    if (t == next_pulse) {
+      host_drive_pin(k_wind_sensor_pin, LOW);
+      host_drive_pin(k_wind_sensor_pin, HIGH);
+      next_pulse += k_pulse_us;
+    }
+    if (t == next) return;
+  }
+}
+
+// ------------------------------------------------------------------------------------------------
+// Run one pass of the main loop and move on to the next.
+// ------------------------------------------------------------------------------------------------
+static void pass(samplewatch& watch, const std::vector<std::pair<uint64_t, bool>>& dtr) {
+  wind_meter->service();
+  watch.update();
+  emulator->service();
+  emulator->dispatch_events();
+  watch.update();
+  advance(dtr);
+}
+
+// ------------------------------------------------------------------------------------------------
+// Take Dtr high and run until the emulator and the wind meter have stopped and the last frame
+// has gone, then move on to a time that lines up with both the loop and a millisecond.
+// ------------------------------------------------------------------------------------------------
+static void settle(samplewatch& watch) {
+  std::vector<std::pair<uint64_t, bool>> none;
+  host_drive_pin(k_dtr_pin, HIGH);
+
+  while (emulator->state() != tx20state::disabled || wind_meter->state() != davis6410state::idle) {
+    pass(watch, none);
+  }
+
+  uint64_t grid = loop_us;
+  while (grid % 1000) grid += loop_us;
+  uint64_t end = (host_now() + k_settle_us + grid - 1) / grid * grid;
+  while (host_now() < end) pass(watch, none);
+
+  frame_starts.clear();
+}
+
+// ------------------------------------------------------------------------------------------------
+// Run with Dtr going low at t0, high at release and low again at reassert (if not 0).
+// The run ends when the emulator has stopped, or when the first frame after Dtr went low again
+// has started. If reference isn't null Dtr stays low for the first two frames instead, and
+// their times are kept.
+// ------------------------------------------------------------------------------------------------
+static runresult run(uint64_t t0, uint64_t release, uint64_t reassert, reference* times) {
+  samplewatch watch;
+  runresult result;
+
+  std::vector<std::pair<uint64_t, bool>> dtr = { { t0, LOW } };
+  if (!times) dtr.push_back({ release, HIGH });
+  if (!times && reassert) dtr.push_back({ reassert, LOW });
+
+  uint64_t last_low = reassert ? reassert : t0;
+  uint64_t timeout = std::max(t0, std::max(release, reassert)) + 2 * (period * 1000 + 60 * bit_us);
+  bool seen = false;
+  bool enabled = false;
+  tx20state last = emulator->state();
+
+  while (host_now() < t0) pass(watch, dtr);
+
+  while (host_now() < timeout) {
+    // The state the emulator is in when it first runs after Dtr goes high. The wind meter runs
+    // first, so this can be sending.
+    wind_meter->service();
+    watch.update();
+    if (!times && !seen && host_now() >= release) {
+      result.state = static_cast<int>(emulator->state());
+      seen = true;
+    }
+    emulator->service();
+    emulator->dispatch_events();
+    watch.update();
+
+    tx20state state = emulator->state();
+    if (state != tx20state::disabled) enabled = true;
+
+    if (times) {
+      if (state != last && state == tx20state::start_sample && frame_starts.empty()) {
+        times->enabled = host_now() - t0;
+      }
+      if (state != last && state == tx20state::sampling && frame_starts.empty()) {
+        times->sampling = host_now() - t0;
+      }
+      if (last == tx20state::transmitting && state != last && !times->frame_end) {
+        times->frame_end = host_now() - t0;
+      }
+      if (frame_starts.size() >= 2) {
+        times->frame = frame_starts[0] - t0;
+        times->next_frame = frame_starts[1] - t0;
+        break;
+      }
+    } else {
+      if (!result.aborted && enabled && state == tx20state::disabled && host_now() >= release &&
+          (!reassert || host_now() < reassert)) {
+        result.aborted = true;
+        result.abort = host_now() - release;
+      }
+
+      auto frame = std::lower_bound(frame_starts.begin(), frame_starts.end(), last_low);
+      if (reassert && frame != frame_starts.end()) {
+        result.framed = true;
+        result.first_frame = *frame - last_low;
+        break;
+      }
+      if (!reassert && !result.framed && frame != frame_starts.end()) {
+        result.framed = true;
+        result.first_frame = *frame - last_low;
+      }
+
+      // Without a second low the run is over once the emulator and the wind meter have stopped,
+      // or a few passes after Dtr went high if the emulator never saw it go low.
+      if (!reassert && host_now() >= release && state == tx20state::disabled &&
+          wind_meter->state() == davis6410state::idle &&
+          (result.aborted || !enabled) && host_now() >= release + 4 * loop_us) {
+        break;
+      }
+    }
+
+    last = state;
+
+    advance(dtr);
+  }
+
+  // The samples thrown away up to here. A run that ends on a frame leaves the next sample still
+  // being counted, which isn't wasted.
+  result.wasted = watch.wasted();
+  result.timed_out = host_now() >= timeout;
+  settle(watch);
+
+  return result;
+}
+
+// ------------------------------------------------------------------------------------------------
+// Write a time in milliseconds, or - if there isn't one.
+// ------------------------------------------------------------------------------------------------
+static void print_ms(const char* label, int width, bool valid, uint64_t t) {
+  if (valid) {
+    printf("%s%*.3f", label, width, t / 1000.);
+  } else {
+    printf("%s%*s", label, width, "-");
+  }
+}
+
+// ------------------------------------------------------------------------------------------------
+// Run with Dtr going high at release and low again after the gap, and keep the worst.
+// The times are from when Dtr first went low.
+// ------------------------------------------------------------------------------------------------
+static void sweep(uint64_t phase, uint64_t release, regap gap) {
+  uint64_t grid = loop_us;
+  while (grid % 1000) grid += loop_us;
+  uint64_t t0 = (host_now() / grid + 1) * grid + phase;
+
+  uint64_t reassert = 0;
+  switch (gap) {
+    case regap::none: break;
+    case regap::half_pass: reassert = loop_us / 2; break;
+    case regap::pass_and_half: reassert = loop_us * 3 / 2; break;
+    case regap::frame: reassert = 60 * bit_us; break;
+    case regap::period: reassert = period * 1000; break;
+  }
+  if (reassert) reassert += t0 + release;
+
+  runresult result = run(t0, t0 + release, reassert, nullptr);
+
+  // A frame that has started is always sent in full, so the emulator can take a whole frame to
+  // stop if it saw Dtr go high while it was sending one.
+  tx20state state = static_cast<tx20state>(result.state);
+  bool framing = state == tx20state::sending || state == tx20state::transmitting;
+  uint64_t first_bound = period * 1000 + 1000 + 2 * loop_us;
+  uint64_t abort_bound = (framing ? k_tx20_frame_length * bit_us : 0) + 2 * loop_us;
+
+  bool broken = result.timed_out || (reassert && !result.framed) ||
+                (result.framed && result.first_frame > first_bound) ||
+                (result.aborted && result.abort > abort_bound);
+
+  worst& w = table[result.state][static_cast<int>(gap)];
+  ++w.runs;
+  if (result.framed) w.first_frame = std::max(w.first_frame, result.first_frame);
+  if (result.aborted) w.abort = std::max(w.abort, result.abort);
+  w.framed |= result.framed;
+  w.aborted |= result.aborted;
+  w.wasted = std::max(w.wasted, result.wasted);
+  w.broken |= broken;
+
+  if (verbose || broken) {
+    printf("R %llu %llu %s %s", static_cast<unsigned long long>(phase),
+           static_cast<unsigned long long>(release), state_names[result.state],
+           regap_names[static_cast<int>(gap)]);
+    print_ms(" first=", 0, result.framed, result.first_frame);
+    print_ms(" abort=", 0, result.aborted, result.abort);
+    printf(" wasted=%u%s\n", result.wasted, broken ? " broken" : "");
+  }
+}
+
+int main(int argc, char* argv[]) {
+  long bit_length = k_frame_bit_length;
+
+  int option;
+  while ((option = getopt(argc, argv, "p:b:l:v")) != -1) {
+    switch (option) {
+      case 'p': period = atol(optarg); break;
+      case 'b': bit_length = atol(optarg); break;
+      case 'l': loop_us = atol(optarg); break;
+      case 'v': verbose = true; break;
+      default:
+        fprintf(stderr, "usage: %s [-p period] [-b bit length] [-l loop us] [-v]\n", argv[0]);
+        return 2;
+    }
+  }
+
+  if (period <= 0 || bit_length <= 0 || loop_us <= 0) {
+    fprintf(stderr, "the period, bit length and loop time must be more than 0\n");
+    return 2;
+  }
+
+  host_advance(1000);
+  host_drive_pin(k_dtr_pin, HIGH);
+  host_set_analog(k_wind_direction_pin, 512);
+
+  davis6410 davis(k_wind_sensor_pin, k_wind_direction_pin, period);
+  davis.initialise();
+  wind_meter = &davis;
+
+  tx20emulator tx20(k_dtr_pin, k_txd_pin);
+  tx20.set_bit_length(bit_length);
+  tx20.initialise(&davis, tx20_event_handler);
+  emulator = &tx20;
+
+  // The frames are timed by timer 1, so a bit is the length the timer counts.
+  bit_us = tx20_bit_ticks(bit_length, 0) * 1000000ULL / (F_CPU / 8);
+
+  samplewatch watch;
+  settle(watch);
+
+  uint32_t runs = 0;
+  bool broken = false;
+
+  for (uint64_t phase : k_phases_us) {
+    // Find out when each state starts by holding Dtr low for two frames.
+    reference times = {};
+    uint64_t grid = loop_us;
+    while (grid % 1000) grid += loop_us;
+    uint64_t t0 = (host_now() / grid + 1) * grid + phase;
+    runresult held = run(t0, 0, 0, &times);
+    if (held.timed_out) {
+      fprintf(stderr, "no frames were sent with Dtr held low\n");
+      return 1;
+    }
+
+    std::vector<uint64_t> releases;
+    if (times.enabled > 1) releases.push_back(times.enabled / 2);
+    releases.push_back(times.enabled + loop_us / 2);
+    for (int n = 0; n < k_sample_points; ++n) {
+      releases.push_back(times.sampling + (times.frame - times.sampling) * n / k_sample_points);
+    }
+    releases.push_back(times.frame - loop_us * 3 / 2);
+    releases.push_back(times.frame - loop_us / 2);
+    for (int n = 0; n < k_tx20_frame_length; ++n) {
+      for (int point = 0; point < k_bit_points; ++point) {
+        releases.push_back(times.frame + n * bit_us + bit_us * (2 * point + 1) / (2 * k_bit_points));
+      }
+    }
+    releases.push_back(times.frame_end - loop_us / 2);
+    releases.push_back(times.frame_end + loop_us / 2);
+    releases.push_back((times.frame_end + times.next_frame) / 2);
+
+    for (uint64_t release : releases) {
+      for (int gap = 0; gap < k_regaps; ++gap) {
+        sweep(phase, release, static_cast<regap>(gap));
+        ++runs;
+      }
+    }
+  }
+
+  printf("# %u runs, sample period %lu ms, bits %llu us, loop %llu us\n", runs, period,
+         static_cast<unsigned long long>(bit_us), static_cast<unsigned long long>(loop_us));
+  printf("# bounds: first frame %.3f ms, abort %.3f ms (%.3f ms sending a frame)\n",
+         (period * 1000 + 1000 + 2 * loop_us) / 1000.,
+         2 * loop_us / 1000., (k_tx20_frame_length * bit_us + 2 * loop_us) / 1000.);
+  printf("# %-13s %-9s %5s %15s %9s %7s\n", "state", "dtr low", "runs", "first frame ms",
+         "abort ms", "wasted");
+  for (int state = 0; state < k_states; ++state) {
+    for (int gap = 0; gap < k_regaps; ++gap) {
+      const worst& w = table[state][gap];
+      if (!w.runs) continue;
+      printf("  %-13s %-9s %5u", state_names[state], regap_names[gap], w.runs);
+      print_ms(" ", 15, w.framed, w.first_frame);
+      print_ms(" ", 9, w.aborted, w.abort);
+      printf(" %7u%s\n", w.wasted, w.broken ? " broken" : "");
+      broken |= w.broken;
+    }
+  }
+
+  const tx20stats& stats = tx20.stats();
+  printf("# the emulator's own counters: max first frame %.3f ms, max stop %.3f ms\n",
+         stats.max_first_frame / 1000., stats.max_abort / 1000.);
+
+  return broken ? 1 : 0;
+}
+
+#endif
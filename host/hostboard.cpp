@@ -0,0 +1,274 @@
+// ------------------------------------------------------------------------------------------------
+// A simulated board for building the 6410 interface and the tx20 emulator on a host.
+// ------------------------------------------------------------------------------------------------
+#include "hostboard.h"
+
+#include <Arduino.h>
+#include <stdio.h>
+
+volatile uint8_t PINB, DDRB, PORTB;
+volatile uint8_t PINC, DDRC, PORTC;
+volatile uint8_t PIND, DDRD, PORTD;
+
+volatile uint8_t TCCR1A, TCCR1B, TCCR1C, TIMSK1, TIFR1;
+volatile uint16_t TCNT1, OCR1A, OCR1B;
+
+volatile uint8_t EICRA, EIMSK, EIFR;
+volatile uint8_t PCICR, PCIFR, PCMSK0, PCMSK1, PCMSK2;
+
+// The vectors are weak, so the board works whichever isrs the build defines.
+extern "C" {
+void INT0_vect(void) __attribute__((weak));
+void INT1_vect(void) __attribute__((weak));
+void PCINT0_vect(void) __attribute__((weak));
+void PCINT1_vect(void) __attribute__((weak));
+void PCINT2_vect(void) __attribute__((weak));
+void TIMER1_COMPA_vect(void) __attribute__((weak));
+void TIMER1_COMPB_vect(void) __attribute__((weak));
+}
+
+// The ports, in the order used by digitalPinToPort().
+static volatile uint8_t* const output_registers[] = { &PORTD, &PORTB, &PORTC };
+static volatile uint8_t* const input_registers[] = { &PIND, &PINB, &PINC };
+static volatile uint8_t* const pcmsk_registers[] = { &PCMSK0, &PCMSK1, &PCMSK2 };
+
+// The pin change group for each port.
+static const uint8_t pcint_groups[] = { 2, 0, 1 };
+
+// The time in microseconds.
+static uint64_t now = 0;
+
+// The level each input pin is driven to.
+static bool driven_levels[k_host_pins];
+static bool driven[k_host_pins];
+
+// The analogue readings.
+static int analog_values[k_host_pins];
+
+// The output pins being watched, and the level each one was last seen at.
+static hostpinfn watchers[k_host_pins];
+static bool watched_levels[k_host_pins];
+
+static uint32_t interrupt_count = 0;
+
+// ------------------------------------------------------------------------------------------------
+// The pin mapping.
+// ------------------------------------------------------------------------------------------------
+uint8_t digitalPinToPort(uint8_t pin) {
+  return pin < 8 ? 0 : pin < 14 ? 1 : 2;
+}
+
+uint8_t digitalPinToBitMask(uint8_t pin) {
+  return _BV(pin < 8 ? pin : pin < 14 ? pin - 8 : pin - 14);
+}
+
+volatile uint8_t* portOutputRegister(uint8_t port) { return output_registers[port]; }
+
+volatile uint8_t* portInputRegister(uint8_t port) { return input_registers[port]; }
+
+int digitalPinToInterrupt(uint8_t pin) {
+  return pin == 2 ? 0 : pin == 3 ? 1 : NOT_AN_INTERRUPT;
+}
+
+volatile uint8_t* digitalPinToPCICR(uint8_t pin) {
+  return pin < k_host_pins ? &PCICR : nullptr;
+}
+
+uint8_t digitalPinToPCICRbit(uint8_t pin) { return pcint_groups[digitalPinToPort(pin)]; }
+
+volatile uint8_t* digitalPinToPCMSK(uint8_t pin) {
+  return pcmsk_registers[digitalPinToPCICRbit(pin)];
+}
+
+uint8_t digitalPinToPCMSKbit(uint8_t pin) {
+  uint8_t mask = digitalPinToBitMask(pin);
+  uint8_t bit = 0;
+  while (mask >>= 1) ++bit;
+  return bit;
+}
+
+// ------------------------------------------------------------------------------------------------
+// Return the level of an output pin.
+// ------------------------------------------------------------------------------------------------
+static bool output_level(int pin) {
+  return *output_registers[digitalPinToPort(pin)] & digitalPinToBitMask(pin);
+}
+
+// ------------------------------------------------------------------------------------------------
+// Tell the watchers about any output pins that have changed.
+// ------------------------------------------------------------------------------------------------
+static void check_pins() {
+  for (int pin = 0; pin < k_host_pins; ++pin) {
+    if (!watchers[pin]) continue;
+
+    bool level = output_level(pin);
+    if (level != watched_levels[pin]) {
+      watched_levels[pin] = level;
+      watchers[pin](pin, now, level);
+    }
+  }
+}
+
+// ------------------------------------------------------------------------------------------------
+// Run an isr, if the build has one.
+// ------------------------------------------------------------------------------------------------
+static void run_isr(void (*isr)(void)) {
+  if (!isr) return;
+
+  ++interrupt_count;
+  isr();
+  check_pins();
+}
+
+// ------------------------------------------------------------------------------------------------
+// Time.
+// The timer 1 count follows the clock, one tick per microsecond.
+// ------------------------------------------------------------------------------------------------
+uint64_t host_now() { return now; }
+
+unsigned long millis() { return static_cast<unsigned long>(now / 1000); }
+
+unsigned long micros() { return static_cast<unsigned long>(now); }
+
+static void set_now(uint64_t t) {
+  now = t;
+  TCNT1 = static_cast<uint16_t>(t);
+}
+
+// ------------------------------------------------------------------------------------------------
+// Return the time of the next match for a compare register, or 0 if its interrupt is off.
+// A match is always in the future, so a register that equals the count matches a whole timer
+// period later.
+// ------------------------------------------------------------------------------------------------
+static uint64_t next_match(uint16_t compare, uint8_t enable) {
+  if (!(TIMSK1 & enable)) return 0;
+
+  uint16_t ticks = compare - static_cast<uint16_t>(now);
+  return now + (ticks ? ticks : 0x10000);
+}
+
+// ------------------------------------------------------------------------------------------------
+// Move the clock on, running the timer 1 compare interrupts on the way.
+// ------------------------------------------------------------------------------------------------
+void host_advance(uint64_t t) {
+  check_pins();
+
+  while (t > now) {
+    uint64_t a = next_match(OCR1A, _BV(OCIE1A));
+    uint64_t b = next_match(OCR1B, _BV(OCIE1B));
+
+    uint64_t next = t;
+    if (a && a < next) next = a;
+    if (b && b < next) next = b;
+
+    set_now(next);
+
+    if (a == now) run_isr(TIMER1_COMPA_vect);
+    if (b == now) run_isr(TIMER1_COMPB_vect);
+  }
+}
+
+// ------------------------------------------------------------------------------------------------
+// Drive an input pin.
+// ------------------------------------------------------------------------------------------------
+void host_drive_pin(int pin, bool level) {
+  bool was = driven[pin] ? driven_levels[pin] : true;
+  driven[pin] = true;
+  driven_levels[pin] = level;
+
+  uint8_t port = digitalPinToPort(pin);
+  uint8_t mask = digitalPinToBitMask(pin);
+  if (level)
+    *input_registers[port] |= mask;
+  else
+    *input_registers[port] &= ~mask;
+
+  if (level == was) return;
+
+  // The external interrupts are only simulated for a falling edge, which is all the 6410 uses.
+  int interrupt = digitalPinToInterrupt(pin);
+  if (interrupt != NOT_AN_INTERRUPT && !level && (EIMSK & _BV(interrupt)) &&
+      ((EICRA >> (2 * interrupt)) & 0x03) == 0x02) {
+    run_isr(interrupt ? INT1_vect : INT0_vect);
+  }
+
+  uint8_t group = digitalPinToPCICRbit(pin);
+  if ((PCICR & _BV(group)) && (*digitalPinToPCMSK(pin) & mask)) {
+    run_isr(group == 0 ? PCINT0_vect : group == 1 ? PCINT1_vect : PCINT2_vect);
+  }
+}
+
+// ------------------------------------------------------------------------------------------------
+// Analogue readings.
+// ------------------------------------------------------------------------------------------------
+void host_set_analog(int pin, int value) { analog_values[pin] = value; }
+
+int analogRead(uint8_t pin) { return pin < k_host_pins ? analog_values[pin] : 0; }
+
+// ------------------------------------------------------------------------------------------------
+// Watch an output pin.
+// ------------------------------------------------------------------------------------------------
+void host_watch_pin(int pin, hostpinfn fn) {
+  watchers[pin] = fn;
+  watched_levels[pin] = output_level(pin);
+}
+
+uint32_t host_interrupts() { return interrupt_count; }
+
+// ------------------------------------------------------------------------------------------------
+// The digital pins.
+// An input that isn't driven reads high, as if it had a pull up.
+// ------------------------------------------------------------------------------------------------
+void pinMode(uint8_t pin, uint8_t mode) {
+  if (pin >= k_host_pins) return;
+
+  volatile uint8_t* ddr = pin < 8 ? &DDRD : pin < 14 ? &DDRB : &DDRC;
+  if (mode == OUTPUT)
+    *ddr |= digitalPinToBitMask(pin);
+  else
+    *ddr &= ~digitalPinToBitMask(pin);
+
+  if (!driven[pin]) host_drive_pin(pin, true);
+}
+
+void digitalWrite(uint8_t pin, uint8_t level) {
+  if (pin >= k_host_pins) return;
+
+  volatile uint8_t* port = output_registers[digitalPinToPort(pin)];
+  if (level)
+    *port |= digitalPinToBitMask(pin);
+  else
+    *port &= ~digitalPinToBitMask(pin);
+}
+
+int digitalRead(uint8_t pin) {
+  if (pin >= k_host_pins) return LOW;
+  return *input_registers[digitalPinToPort(pin)] & digitalPinToBitMask(pin) ? HIGH : LOW;
+}
+
+// ------------------------------------------------------------------------------------------------
+// Print writes a character at a time.
+// ------------------------------------------------------------------------------------------------
+size_t Print::write(const char* s) {
+  size_t n = 0;
+  while (*s) n += write(static_cast<uint8_t>(*s++));
+  return n;
+}
+
+size_t Print::print(long n) {
+  char text[24];
+  snprintf(text, sizeof(text), "%ld", n);
+  return write(text);
+}
+
+size_t Print::print(unsigned long n) {
+  char text[24];
+  snprintf(text, sizeof(text), "%lu", n);
+  return write(text);
+}
+
+size_t Print::print(double n, int digits) {
+  char text[48];
+  snprintf(text, sizeof(text), "%.*f", digits, n);
+  return write(text);
+}
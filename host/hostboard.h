@@ -0,0 +1,45 @@
+// ------------------------------------------------------------------------------------------------
+// A simulated board for building the 6410 interface and the tx20 emulator on a host.
+//
+// The board has a virtual clock, the digital and analogue pins, and timer 1. Nothing happens on
+// its own. The program driving the board moves the clock on with host_advance(), which runs the
+// timer 1 compare interrupts as they fall due, and drives the input pins with host_drive_pin(),
+// which runs the pin's external or pin change interrupt on a falling edge. Interrupts run in
+// no time at all, so a bit edge written by the bit scheduler is never late.
+//
+// The clock runs at 1 us per timer 1 tick, as it does on an 8 MHz board with a prescaler of 8.
+// The pins are numbered as on an ATmega328 Arduino, 0 to 7 on port D, 8 to 13 on port B and
+// 14 to 19 (A0 to A5) on port C.
+// ------------------------------------------------------------------------------------------------
+#pragma once
+
+#include <stdint.h>
+
+// The number of digital pins.
+constexpr int k_host_pins = 20;
+
+// Signature for the function called when an output pin changes.
+using hostpinfn = void (*)(int pin, uint64_t t, bool level);
+
+// Return the time in microseconds since the board started.
+uint64_t host_now();
+
+// Move the clock on to t, running any timer 1 compare interrupts that are due on the way.
+// The clock never goes backwards.
+void host_advance(uint64_t t);
+
+// Drive an input pin high or low.
+// A falling edge runs the pin's external interrupt, and any change runs its pin change
+// interrupt, if they are enabled. An input that isn't driven reads high.
+void host_drive_pin(int pin, bool level);
+
+// Set the reading of an analogue pin.
+void host_set_analog(int pin, int value);
+
+// Have fn called whenever an output pin changes level.
+// The pins are checked after every interrupt, and before the clock is moved on, so a change
+// made by the main loop is seen at the time it was made.
+void host_watch_pin(int pin, hostpinfn fn);
+
+// Return the number of interrupts that have been run.
+uint32_t host_interrupts();
@@ -0,0 +1,484 @@
+// ------------------------------------------------------------------------------------------------
+// Replay a pulse trace through the 6410 interface and the tx20 emulator on the host.
+//
+//    program [-p <period ms>] [-d <debounce ms>] [-b <bit length us>] [-l <loop us>]
+//            [-v <vcd file>] [-c] [trace]
+//    program -w <seconds> [-m <mean m/s>] [-a <direction>] [-g <gust factor>] [-s <spread>]
+//            [-x <bounce chance>] [-n <noise per second>] [-r <seed>] [other options]
+//
+// The trace is one recorded with the console command 'trace on', read from a file or stdin. The
+// anemometer edges (E lines) are played into pin 2 at the times they were recorded. Each wind
+// vane reading (V lines) is put on A0 from halfway between it and the reading before, so the
+// 6410 reads the same value when its sample ends at about the same time. The first sample is
+// started so that it ends at the first vane reading, which lines the samples up with the ones
+// the bridge took.
+//
+// Dtr is held low, so the emulator sends a frame at the end of every sample. Each frame is
+// decoded from the levels on TxD, the same way a TX20 reader would, and written to stdout as
+//
+//    F <micros> <speed> <direction>
+//
+// where the speed is in 0.1 m/s and the direction is 0=N, 4=E etc, or as F <micros> bad if the
+// frame doesn't decode. The sample period and debounce come from the trace header unless they
+// are given. The main loop runs every 100 us unless -l is given. With -v, TxD and Dtr are also
+// written to a VCD file, which scripts/txdcheck.py can check the same way as a capture from
+// simavr. The golden traces in test/golden are made this way. With -c, every sample the 6410
+// publishes is written to stdout as well, as
+//
+//    S <micros> <pulses>
+//
+// where the time is when the 6410 read its count, so the pulses are the ones counted since the
+// sample before. scripts/tune.py uses these to score the settings against the true pulses.
+//
+// With -w, the wind from windmodel.h is simulated for that many seconds instead of reading a
+// trace. The model is stepped every 100 ms, and the cups give one pulse per turn at 1 mph per
+// pulse every 2.25 s, so each pulse has an exact time. Each pulse is a falling edge on pin 2.
+// With the bounce chance (0 to 1) a pulse is followed by 1 to 3 extra edges from contact bounce,
+// 50 us to 2 ms later, and noise spikes picked up by the cable add edges at random at the given
+// rate. The direction is put on A0 as the wind vane reading for each step. The mean speed,
+// direction in degrees, gust factor and direction spread default to the model's, and the seed
+// (for the bounce and noise) to 1. Every sample the 6410 publishes is then checked against the
+// pulses that were simulated for it, and the total of the pulses that were missed or counted
+// twice is written to stderr along with the totals.
+//
+// The real 6410 interface, tx20 emulator and bit scheduler are used, on the simulated board in
+// hostboard.cpp.
+// ------------------------------------------------------------------------------------------------
+#ifndef PIO_UNIT_TESTING
+
+#include <Arduino.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <random>
+#include <vector>
+
+#include "davis6410.h"
+#include "hostboard.h"
+#include "tx20emulator.h"
+#include "tx20frame.h"
+#include "windmodel.h"
+
+// The pins, as in main.cpp.
+constexpr int k_wind_sensor_pin = 2;
+constexpr int k_wind_direction_pin = A0;
+constexpr int k_dtr_pin = 3;
+constexpr int k_txd_pin = 4;
+
+// The default time between passes of the main loop in microseconds.
+constexpr uint64_t k_loop_us = 100;
+
+// The micros() count wraps at 2^32.
+constexpr uint64_t k_micros_wrap = 1ULL << 32;
+
+// The simulated wind is stepped every 100 ms.
+constexpr uint64_t k_simulate_step_us = 100000;
+
+// A speed of 1 mph is 0.44704 m/s, and the cups turn once every 2.25 s at 1 mph.
+constexpr double k_mph_metres_per_second = 0.44704;
+constexpr double k_mph_pulse_seconds = 2.25;
+
+// Contact bounce follows a pulse by 50 us to 2 ms.
+constexpr int k_bounce_min_us = 50;
+constexpr int k_bounce_max_us = 2000;
+
+// A wind vane reading from the trace.
+struct vanereading {
+  uint64_t t;
+  int adc;
+};
+
+// The trace.
+static std::vector<uint64_t> edges;
+static std::vector<vanereading> vane_readings;
+static unsigned long trace_period = k_wind_speed_sample_t;
+static unsigned long trace_debounce = k_wind_pulse_debounce;
+
+// The times of the simulated pulses, without the bounce and noise.
+static std::vector<uint64_t> true_pulses;
+
+// The settings for a simulated wind.
+struct simulation {
+  double seconds = 0;
+  float mean_speed = k_windmodel_mean_speed;
+  float mean_direction = k_windmodel_mean_direction;
+  float gust_factor = k_windmodel_gust_factor;
+  float direction_spread = k_windmodel_direction_spread;
+  double bounce = 0;
+  double noise = 0;
+  unsigned long seed = 1;
+};
+
+// The levels on TxD and the frames waiting to be decoded.
+static std::vector<std::pair<uint64_t, bool>> txd_edges;
+static bool txd_initial_level = false;
+static std::vector<uint64_t> frame_starts;
+
+// The VCD file TxD and Dtr are written to, if there is one.
+static FILE* vcd_out = nullptr;
+
+// ------------------------------------------------------------------------------------------------
+// Read the trace.
+// The times are unwrapped, allowing for the lines being a little out of order. Anything that
+// means the trace is incomplete is reported.
+// ------------------------------------------------------------------------------------------------
+static bool read_trace(FILE* in) {
+  char line[128];
+  uint64_t offset = 0;
+  uint64_t last = 0;
+  bool first = true;
+  unsigned long lost = 0;
+
+  while (fgets(line, sizeof(line), in)) {
+    line[strcspn(line, "\r\n")] = '\0';
+
+    unsigned long t;
+    unsigned long value;
+    int adc;
+
+    if (sscanf(line, "# trace sample_period=%lu debounce=%lu", &t, &value) == 2) {
+      trace_period = t;
+      trace_debounce = value;
+      continue;
+    }
+
+    if (sscanf(line, "# lost %lu", &value) == 1) {
+      lost += value;
+      continue;
+    }
+
+    if (strstr(line, "no edges")) {
+      fprintf(stderr, "warning: the trace has no anemometer edges (%s)\n", line + 2);
+      continue;
+    }
+
+    bool edge = sscanf(line, "E %lu", &t) == 1;
+    bool vane = !edge && sscanf(line, "V %lu %d", &t, &adc) == 2;
+    if (!edge && !vane) continue;
+
+    uint64_t unwrapped = offset + t;
+    if (!first && unwrapped + k_micros_wrap / 2 < last) {
+      offset += k_micros_wrap;
+      unwrapped += k_micros_wrap;
+    }
+    if (first || unwrapped > last) last = unwrapped;
+    first = false;
+
+    if (edge)
+      edges.push_back(unwrapped);
+    else
+      vane_readings.push_back({ unwrapped, adc });
+  }
+
+  if (lost) fprintf(stderr, "warning: the trace lost %lu edges, so it is incomplete\n", lost);
+
+  std::sort(edges.begin(), edges.end());
+  std::sort(vane_readings.begin(), vane_readings.end(),
+            [](const vanereading& a, const vanereading& b) { return a.t < b.t; });
+
+  return !edges.empty() || !vane_readings.empty();
+}
+
+// ------------------------------------------------------------------------------------------------
+// Simulate the wind from time t0.
+// The pulse phase is carried from step to step, so the pulses follow the speed smoothly. The
+// noise spikes are spread by a Poisson process, with exponential gaps between them.
+// ------------------------------------------------------------------------------------------------
+static void simulate(const simulation& settings, uint64_t t0) {
+  windmodel model;
+  model.set_wind(settings.mean_speed, settings.mean_direction, settings.gust_factor,
+                 settings.direction_spread);
+  model.reset();
+
+  std::mt19937 random(settings.seed);
+  std::uniform_real_distribution<double> chance(0, 1);
+  std::uniform_int_distribution<int> bounces(1, 3);
+  std::uniform_int_distribution<int> bounce_gap(k_bounce_min_us, k_bounce_max_us);
+
+  uint64_t end = t0 + static_cast<uint64_t>(settings.seconds * 1e6);
+  double phase = 0;
+
+  for (uint64_t t = t0; t < end; t += k_simulate_step_us) {
+    model.step(k_simulate_step_us / 1e6);
+
+    int adc = static_cast<int>(model.direction() / 22.5f * 64 + 0.5f) & 1023;
+    vane_readings.push_back({ t, adc });
+
+    double hz = model.speed() / k_mph_metres_per_second / k_mph_pulse_seconds;
+    double next_phase = phase + hz * k_simulate_step_us / 1e6;
+    for (double turn = floor(phase) + 1; turn <= next_phase; ++turn) {
+      uint64_t pulse = t + static_cast<uint64_t>((turn - phase) / hz * 1e6);
+      true_pulses.push_back(pulse);
+      edges.push_back(pulse);
+
+      if (chance(random) < settings.bounce) {
+        for (int n = bounces(random); n > 0; --n) {
+          pulse += bounce_gap(random);
+          edges.push_back(pulse);
+        }
+      }
+    }
+    phase = next_phase;
+  }
+
+  if (settings.noise > 0) {
+    std::exponential_distribution<double> gap(settings.noise);
+    for (double t = t0 + gap(random) * 1e6; t < end; t += gap(random) * 1e6) {
+      edges.push_back(static_cast<uint64_t>(t));
+    }
+  }
+
+  std::sort(edges.begin(), edges.end());
+}
+
+// ------------------------------------------------------------------------------------------------
+// Keep the levels on TxD.
+// ------------------------------------------------------------------------------------------------
+static void txd_changed(int pin, uint64_t t, bool level) {
+  txd_edges.push_back({ t, level });
+  if (vcd_out) fprintf(vcd_out, "#%llu\n%d!\n", static_cast<unsigned long long>(t), level);
+}
+
+// ------------------------------------------------------------------------------------------------
+// Start the VCD file, with the time in microseconds. TxD is ! and Dtr is ".
+// ------------------------------------------------------------------------------------------------
+static void start_vcd(bool txd, bool dtr) {
+  fprintf(vcd_out, "$timescale 1us $end\n$scope module bridge $end\n");
+  fprintf(vcd_out, "$var wire 1 ! TxD $end\n$var wire 1 \" Dtr $end\n");
+  fprintf(vcd_out, "$upscope $end\n$enddefinitions $end\n");
+  fprintf(vcd_out, "#%llu\n$dumpvars\n%d!\n%d\"\n$end\n",
+          static_cast<unsigned long long>(host_now()), txd, dtr);
+}
+
+// ------------------------------------------------------------------------------------------------
+// Note the start of each frame. The event time is micros(), which is turned back into the
+// unwrapped time.
+// ------------------------------------------------------------------------------------------------
+static void tx20_event_handler(const tx20eventinfo& event) {
+  if (event.event != tx20event::start_data_frame) return;
+
+  uint32_t age = static_cast<uint32_t>(micros()) - event.t;
+  frame_starts.push_back(host_now() - age);
+}
+
+// ------------------------------------------------------------------------------------------------
+// Return the level on TxD at a time.
+// ------------------------------------------------------------------------------------------------
+static bool txd_level(uint64_t t) {
+  auto after = std::upper_bound(txd_edges.begin(), txd_edges.end(), std::make_pair(t, true));
+  return after == txd_edges.begin() ? txd_initial_level : (after - 1)->second;
+}
+
+// ------------------------------------------------------------------------------------------------
+// Decode the frames that have been sent in full.
+// Each bit is read in the middle. A 1 data bit is a low level.
+// ------------------------------------------------------------------------------------------------
+static void decode_frames(uint64_t bit_length, uint32_t& frames, uint32_t& bad) {
+  while (!frame_starts.empty()) {
+    uint64_t start = frame_starts.front();
+    if (host_now() < start + (k_tx20_frame_length + 1) * bit_length) return;
+
+    tx20frame frame = {};
+    for (int n = 0; n < k_tx20_frame_length; ++n) {
+      if (!txd_level(start + n * bit_length + bit_length / 2)) frame.bits[n >> 3] |= 1 << (n & 7);
+    }
+
+    int speed;
+    int direction;
+    ++frames;
+    if (tx20_decode(frame, speed, direction)) {
+      printf("F %llu %d %d\n", static_cast<unsigned long long>(start), speed, direction);
+    } else {
+      printf("F %llu bad\n", static_cast<unsigned long long>(start));
+      ++bad;
+    }
+
+    frame_starts.erase(frame_starts.begin());
+  }
+
+  // Only the last level is needed once every frame has been decoded.
+  if (txd_edges.size() > 1) {
+    txd_initial_level = txd_edges.back().second;
+    txd_edges.clear();
+  }
+}
+
+int main(int argc, char* argv[]) {
+  long period = -1;
+  long debounce = -1;
+  long bit_length = k_frame_bit_length;
+  long loop_us = k_loop_us;
+  simulation settings;
+
+  const char* vcd_path = nullptr;
+  bool print_counts = false;
+
+  int option;
+  while ((option = getopt(argc, argv, "p:d:b:l:v:cw:m:a:g:s:x:n:r:")) != -1) {
+    switch (option) {
+      case 'p': period = atol(optarg); break;
+      case 'd': debounce = atol(optarg); break;
+      case 'b': bit_length = atol(optarg); break;
+      case 'l': loop_us = atol(optarg); break;
+      case 'v': vcd_path = optarg; break;
+      case 'c': print_counts = true; break;
+      case 'w': settings.seconds = atof(optarg); break;
+      case 'm': settings.mean_speed = atof(optarg); break;
+      case 'a': settings.mean_direction = atof(optarg); break;
+      case 'g': settings.gust_factor = atof(optarg); break;
+      case 's': settings.direction_spread = atof(optarg); break;
+      case 'x': settings.bounce = atof(optarg); break;
+      case 'n': settings.noise = atof(optarg); break;
+      case 'r': settings.seed = strtoul(optarg, nullptr, 0); break;
+      default:
+        fprintf(stderr,
+                "usage: %s [-p period] [-d debounce] [-b bit length] [-l loop us] [-v vcd file]\n"
+                "          [-c] [trace]\n"
+                "       %s -w seconds [-m mean m/s] [-a direction] [-g gust factor] [-s spread]\n"
+                "          [-x bounce chance] [-n noise per second] [-r seed] [other options]\n",
+                argv[0], argv[0]);
+        return 2;
+    }
+  }
+
+  if (settings.seconds > 0) {
+    if (period < 0) period = trace_period;
+    if (settings.mean_speed < 0 || settings.gust_factor < 1 || settings.bounce < 0 ||
+        settings.noise < 0) {
+      fprintf(stderr, "the speed, bounce and noise must be 0 or more, the gust factor 1 or more\n");
+      return 2;
+    }
+
+    // Leave room for the first sample before the wind starts.
+    simulate(settings, (period + 1000) * 1000ULL);
+  } else {
+    FILE* in = optind < argc ? fopen(argv[optind], "r") : stdin;
+    if (!in) {
+      perror(argv[optind]);
+      return 1;
+    }
+
+    if (!read_trace(in)) {
+      fprintf(stderr, "the trace is empty\n");
+      return 1;
+    }
+  }
+
+  if (period < 0) period = trace_period;
+  if (debounce < 0) debounce = trace_debounce;
+  if (period <= 0 || loop_us <= 0 || bit_length <= 0) {
+    fprintf(stderr, "the period, bit length and loop time must be more than 0\n");
+    return 2;
+  }
+
+  // Start so that the first sample ends at the first vane reading, or just before the first edge.
+  uint64_t first = edges.empty() ? vane_readings.front().t : edges.front();
+  if (!vane_readings.empty()) first = std::min(first, vane_readings.front().t - period * 1000);
+  uint64_t start = first > 1000 ? first - 1000 : 1;
+
+  uint64_t last = std::max(edges.empty() ? 0 : edges.back(),
+                           vane_readings.empty() ? 0 : vane_readings.back().t);
+  uint64_t end = last + period * 1000 + (k_tx20_frame_length + 1) * bit_length;
+
+  host_advance(start);
+
+  davis6410 wind_meter(k_wind_sensor_pin, k_wind_direction_pin, period);
+  wind_meter.set_debounce(debounce);
+  wind_meter.initialise();
+
+  tx20emulator tx20_emulator(k_dtr_pin, k_txd_pin);
+  tx20_emulator.set_bit_length(bit_length);
+  tx20_emulator.initialise(&wind_meter, tx20_event_handler);
+
+  // The decoder samples TxD at the length of a bit as the timer counts it.
+  uint64_t bit_ticks = tx20_bit_ticks(bit_length, 0) * 1000000ULL / (F_CPU / 8);
+
+  txd_initial_level = digitalRead(k_txd_pin);
+  host_watch_pin(k_txd_pin, txd_changed);
+
+  if (vcd_path) {
+    vcd_out = fopen(vcd_path, "w");
+    if (!vcd_out) {
+      perror(vcd_path);
+      return 1;
+    }
+    // Dtr starts high and goes low straight away.
+    start_vcd(txd_initial_level, true);
+    fprintf(vcd_out, "0\"\n");
+  }
+  host_drive_pin(k_dtr_pin, LOW);
+
+  size_t edge = std::lower_bound(edges.begin(), edges.end(), start) - edges.begin();
+  size_t vane = 0;
+  uint32_t frames = 0;
+  uint32_t bad = 0;
+
+  // The simulated pulses are checked against each sample. The 6410 reads its count at the end of
+  // the sample and publishes it two passes of the loop later, after reading the wind vane, and
+  // the edges up to each pass have been played by then.
+  uint16_t sequence = wind_meter.get_sample().sequence;
+  uint64_t sample_end = 0;
+  size_t true_pulse = 0;
+  uint32_t samples = 0;
+  uint32_t counted = 0;
+  uint32_t expected = 0;
+  uint32_t miscounted = 0;
+
+  while (host_now() < end) {
+    while (vane + 1 < vane_readings.size() &&
+           host_now() >= (vane_readings[vane].t + vane_readings[vane + 1].t) / 2) {
+      ++vane;
+    }
+    if (!vane_readings.empty()) host_set_analog(k_wind_direction_pin, vane_readings[vane].adc);
+
+    wind_meter.service();
+    tx20_emulator.service();
+    tx20_emulator.dispatch_events();
+    decode_frames(bit_ticks, frames, bad);
+
+    const windsample& sample = wind_meter.get_sample();
+    if (sample.sequence != sequence) {
+      sequence = sample.sequence;
+      uint64_t end = host_now() - 2 * loop_us;
+      if (print_counts) printf("S %llu %u\n", static_cast<unsigned long long>(end), sample.pulses);
+
+      size_t first = true_pulse;
+      while (true_pulse < true_pulses.size() && true_pulses[true_pulse] <= end) ++true_pulse;
+
+      // The first sample started when Dtr went low, so only the ones after it are checked.
+      if (!true_pulses.empty() && sample_end) {
+        uint32_t pulses = true_pulse - first;
+        ++samples;
+        counted += sample.pulses;
+        expected += pulses;
+        miscounted += sample.pulses > pulses ? sample.pulses - pulses : pulses - sample.pulses;
+      }
+      sample_end = end;
+    }
+
+    uint64_t next = host_now() + loop_us;
+    for (; edge < edges.size() && edges[edge] <= next; ++edge) {
+      host_advance(edges[edge]);
+      host_drive_pin(k_wind_sensor_pin, LOW);
+      host_drive_pin(k_wind_sensor_pin, HIGH);
+    }
+    host_advance(next);
+  }
+
+  if (vcd_out) {
+    fprintf(vcd_out, "#%llu\n", static_cast<unsigned long long>(host_now()));
+    fclose(vcd_out);
+  }
+
+  fprintf(stderr, "# %u frames, %u bad, %zu edges, %zu vane readings, %u interrupts\n", frames,
+          bad, edges.size(), vane_readings.size(), host_interrupts());
+  if (!true_pulses.empty()) {
+    fprintf(stderr, "# %u samples, %u pulses, %u counted, %u miscounted\n", samples, expected,
+            counted, miscounted);
+  }
+
+  return bad ? 1 : 0;
+}
+
+#endif
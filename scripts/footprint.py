@@ -0,0 +1,341 @@
+# ------------------------------------------------------------------------------------------------
+# Flash and ram footprint report for the firmware.
+#
+# This is a PlatformIO extra script. It adds a "footprint" target which prints,
+#
+#    - the flash and static ram totals,
+#    - the size of every object file after linking (from the linker map),
+#    - the largest symbols in flash and ram,
+#    - an estimate of the stack high water mark.
+#
+# The stack estimate comes from the frame sizes gcc writes with -fstack-usage and a call graph
+# taken from the disassembly. The deepest path from main() is added to the deepest path from any
+# interrupt vector, as interrupts don't nest. Calls through function pointers and virtual
+# functions can't be followed, so they are assumed to reach the deepest function that is never
+# called directly. Functions using a dynamic amount of stack are flagged.
+#
+# The budgets are set in platformio.ini,
+#
+#    custom_flash_budget = 30720
+#    custom_ram_budget = 2048
+#
+# The ram budget covers static ram plus the stack estimate. Every build checks the budgets and
+# fails if either is exceeded. The full report is also written to footprint.txt in the build
+# directory.
+#
+#    pio run -t footprint
+# ------------------------------------------------------------------------------------------------
+Import("env")
+
+import os
+import re
+import subprocess
+
+# The number of symbols listed for flash and ram in the report.
+TOP_SYMBOLS = 15
+
+# Each call pushes a 2 byte return address on the 328.
+RETURN_ADDRESS_SIZE = 2
+
+# Sections that end up in flash, ram, or both.
+FLASH_SECTIONS = (".text", ".progmem", ".init", ".fini", ".vectors", ".trampolines", ".ctors", ".dtors", ".jumptables")
+DATA_SECTIONS = (".data", ".rodata")
+RAM_SECTIONS = (".bss", ".noinit")
+
+env.Append(CCFLAGS=["-fstack-usage"])
+env.Append(LINKFLAGS=["-Wl,-Map,${BUILD_DIR}/${PROGNAME}.map"])
+
+
+def tool(name):
+    # The binutils live next to the compiler, eg avr-gcc -> avr-nm.
+    cc = env.subst("$CC")
+    return cc[: -len("gcc")] + name if cc.endswith("gcc") else name
+
+
+def run(args):
+    return subprocess.check_output(args, universal_newlines=True)
+
+
+def option(name, default):
+    value = env.GetProjectOption(name, "")
+    return int(value, 0) if value else default
+
+
+def section_kind(section):
+    if section.startswith(DATA_SECTIONS):
+        return "data"
+    if section.startswith(RAM_SECTIONS):
+        return "ram"
+    if section.startswith(FLASH_SECTIONS):
+        return "flash"
+    return None
+
+
+# ------------------------------------------------------------------------------------------------
+# Totals from avr-size.
+# ------------------------------------------------------------------------------------------------
+def totals(elf):
+    flash = ram = 0
+    for line in run([tool("size"), "-A", elf]).splitlines():
+        fields = line.split()
+        if len(fields) < 2 or not fields[1].isdigit():
+            continue
+        kind = section_kind(fields[0])
+        size = int(fields[1])
+        if kind in ("flash", "data"):
+            flash += size
+        if kind in ("ram", "data"):
+            ram += size
+    return flash, ram
+
+
+# ------------------------------------------------------------------------------------------------
+# Per object file sizes from the linker map.
+# Only sections that were kept by the linker are counted. A long section name is printed on a
+# line of its own with the address, size and object file on the next line.
+# ------------------------------------------------------------------------------------------------
+def objects(map_path):
+    sizes = {}
+    if not os.path.isfile(map_path):
+        return sizes
+
+    entry = re.compile(r"^ (\.\S+)?\s+0x[0-9a-f]+\s+0x([0-9a-f]+)\s+(\S+\.o\)?)$")
+    in_map = False
+    section = None
+
+    with open(map_path) as f:
+        for line in f:
+            line = line.rstrip()
+            if line.startswith("Linker script and memory map"):
+                in_map = True
+                continue
+            if not in_map:
+                continue
+
+            if re.match(r"^ \.\S+$", line):
+                section = line.strip()
+                continue
+
+            m = entry.match(line)
+            if not m:
+                section = None
+                continue
+
+            name = m.group(1) or section
+            section = None
+            kind = section_kind(name or "")
+            if kind is None:
+                continue
+
+            size = int(m.group(2), 16)
+            obj = os.path.basename(m.group(3))
+            flash, ram = sizes.get(obj, (0, 0))
+            if kind in ("flash", "data"):
+                flash += size
+            if kind in ("ram", "data"):
+                ram += size
+            sizes[obj] = (flash, ram)
+
+    return sizes
+
+
+# ------------------------------------------------------------------------------------------------
+# The largest symbols in flash and ram from avr-nm.
+# ------------------------------------------------------------------------------------------------
+def symbols(elf):
+    flash = []
+    ram = []
+    for line in run([tool("nm"), "-C", "-S", "--size-sort", elf]).splitlines():
+        fields = line.split(None, 3)
+        if len(fields) < 4:
+            continue
+        size = int(fields[1], 16)
+        kind = fields[2].lower()
+        if kind in "tw":
+            flash.append((size, fields[3]))
+        elif kind in "dr":
+            flash.append((size, fields[3]))
+            ram.append((size, fields[3]))
+        elif kind == "b":
+            ram.append((size, fields[3]))
+    flash.sort(reverse=True)
+    ram.sort(reverse=True)
+    return flash[:TOP_SYMBOLS], ram[:TOP_SYMBOLS]
+
+
+# ------------------------------------------------------------------------------------------------
+# Stack frames from the .su files, keyed on the unqualified function name.
+# ------------------------------------------------------------------------------------------------
+def function_key(name):
+    # "void davis6410::service()" -> "davis6410::service"
+    words = name.split("(")[0].split()
+    return words[-1] if words else name
+
+
+# The location in front of the function in a .su line, "file:line:column:". The file can have
+# a drive letter and the function can have "::" in it, so the split is on the line and column.
+SU_LOCATION = re.compile(r":\d+:\d+:")
+
+
+def frames(build_dir):
+    sizes = {}
+    dynamic = set()
+    for root, _, files in os.walk(build_dir):
+        for name in files:
+            if not name.endswith(".su"):
+                continue
+            with open(os.path.join(root, name)) as f:
+                for line in f:
+                    fields = line.rstrip("\n").split("\t")
+                    if len(fields) != 3:
+                        continue
+                    location = SU_LOCATION.search(fields[0])
+                    if not location:
+                        continue
+                    key = function_key(fields[0][location.end():])
+                    sizes[key] = max(sizes.get(key, 0), int(fields[1]))
+                    if "dynamic" in fields[2]:
+                        dynamic.add(key)
+    return sizes, dynamic
+
+
+# ------------------------------------------------------------------------------------------------
+# The call graph from the disassembly.
+# Jumps to other functions are tail calls and are treated as calls.
+# ------------------------------------------------------------------------------------------------
+def call_graph(elf):
+    calls = {}
+    indirect = set()
+    function = None
+    start = re.compile(r"^[0-9a-f]+ <(.+)>:$")
+    call = re.compile(r"\b(r?call|r?jmp)\s.*<([^>+]+)>")
+
+    for line in run([tool("objdump"), "-d", "-C", elf]).splitlines():
+        m = start.match(line)
+        if m:
+            function = function_key(m.group(1))
+            calls.setdefault(function, set())
+            continue
+        if function is None:
+            continue
+        if re.search(r"\s(e?icall|e?ijmp)\b", line):
+            indirect.add(function)
+            continue
+        m = call.search(line)
+        if m:
+            target = function_key(m.group(2))
+            if target != function:
+                calls[function].add(target)
+
+    return calls, indirect
+
+
+def stack_estimate(calls, indirect, sizes):
+    called = set()
+    for targets in calls.values():
+        called |= targets
+    roots = [f for f in calls if f == "main" or f.startswith("__vector_")]
+    uncalled = [f for f in calls if f not in called and f not in roots and not f.startswith("__")]
+
+    depth = {}
+
+    def deepest(function, path):
+        if function in depth:
+            return depth[function]
+        if function in path:
+            # Recursion can't be bounded, so the cycle is just cut here.
+            return 0
+        path.add(function)
+        below = [deepest(target, path) for target in calls.get(function, ())]
+        if function in indirect:
+            below += [deepest(target, path) for target in uncalled]
+        path.discard(function)
+        result = sizes.get(function, 0) + (RETURN_ADDRESS_SIZE + max(below) if below else 0)
+        depth[function] = result
+        return result
+
+    main = deepest("main", set()) if "main" in calls else 0
+    vectors = [(deepest(v, set()), v) for v in roots if v != "main"]
+    isr, vector = max(vectors) if vectors else (0, None)
+    return main, isr, vector
+
+
+# ------------------------------------------------------------------------------------------------
+# Build the report and check the budgets.
+# Returns the report lines and whether the budgets were met.
+# ------------------------------------------------------------------------------------------------
+def report():
+    build_dir = env.subst("$BUILD_DIR")
+    elf = env.subst("$BUILD_DIR/${PROGNAME}.elf")
+
+    board = env.BoardConfig()
+    flash_budget = option("custom_flash_budget", int(board.get("upload.maximum_size", 32768)))
+    ram_budget = option("custom_ram_budget", int(board.get("upload.maximum_ram_size", 2048)))
+
+    flash, ram = totals(elf)
+    sizes, dynamic = frames(build_dir)
+    calls, indirect = call_graph(elf)
+    main_stack, isr_stack, vector = stack_estimate(calls, indirect, sizes)
+    stack = main_stack + isr_stack
+
+    lines = []
+    lines.append("Flash %6d of %6d bytes" % (flash, flash_budget))
+    lines.append("Ram   %6d static + %d stack (main %d, %s %d) of %d bytes"
+                 % (ram, stack, main_stack, vector or "isr", isr_stack, ram_budget))
+    lines.append("")
+
+    lines.append("%-32s %8s %8s" % ("object", "flash", "ram"))
+    for obj, (f, r) in sorted(objects(env.subst("$BUILD_DIR/${PROGNAME}.map")).items(),
+                              key=lambda item: -item[1][0]):
+        lines.append("%-32s %8d %8d" % (obj, f, r))
+    lines.append("")
+
+    top_flash, top_ram = symbols(elf)
+    lines.append("Largest symbols in flash")
+    lines += ["%8d  %s" % symbol for symbol in top_flash]
+    lines.append("")
+    lines.append("Largest symbols in ram")
+    lines += ["%8d  %s" % symbol for symbol in top_ram]
+
+    if dynamic:
+        lines.append("")
+        lines.append("Functions with a dynamic stack frame: " + ", ".join(sorted(dynamic)))
+
+    ok = True
+    if flash > flash_budget:
+        lines.append("FAIL: flash budget exceeded by %d bytes" % (flash - flash_budget))
+        ok = False
+    if ram + stack > ram_budget:
+        lines.append("FAIL: ram budget exceeded by %d bytes" % (ram + stack - ram_budget))
+        ok = False
+
+    with open(os.path.join(build_dir, "footprint.txt"), "w") as f:
+        f.write("\n".join(lines) + "\n")
+
+    return lines, ok
+
+
+def print_report(*args, **kwargs):
+    lines, _ = report()
+    print("\n".join(lines))
+
+
+def check_budgets(target, source, env):
+    lines, ok = report()
+    if not ok:
+        print("\n".join(lines))
+        return 1
+    print(lines[0])
+    print(lines[1])
+    return 0
+
+
+env.AddPostAction("$BUILD_DIR/${PROGNAME}.elf", check_budgets)
+
+env.AddCustomTarget(
+    name="footprint",
+    dependencies="$BUILD_DIR/${PROGNAME}.elf",
+    actions=print_report,
+    title="Footprint",
+    description="Print the flash and ram footprint of the firmware",
+)
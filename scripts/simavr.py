@@ -0,0 +1,138 @@
+# ------------------------------------------------------------------------------------------------
+# Run the bridge firmware on simavr and check what it sends on TxD.
+#
+# This builds the harness in scripts/simavr (it needs simavr and libelf, eg the simavr and
+# libsimavr-dev packages), runs the firmware on it with a steady wind on the anemometer pin and a
+# fixed wind vane voltage, takes Dtr low once the firmware has started, and then checks the TxD
+# capture with scripts/txdcheck.py. Every frame must carry the wind that was simulated, give or
+# take a pulse for where the samples fall, and match its ideal waveform edge for edge, with every
+# edge inside the tolerance band and the drift across each frame inside its band. The first
+# frame must start within a sample period (plus a little) of Dtr going low, and each frame within
+# the latency limit of its sample ending. With the default wind, vane and bit length, the whole
+# capture is also compared with the golden trace in test/golden, which was made by the host build
+# from the same wind. The exit status is 1 if anything fails, so this can run in CI after the
+# firmware is built.
+#
+#    pio run -e pro8MHzatmega328
+#    python scripts/simavr.py
+#    python scripts/simavr.py --mph 40 --vane 900 --seconds 20 --tolerance 10
+# ------------------------------------------------------------------------------------------------
+import argparse
+import os
+import shutil
+import subprocess
+import sys
+
+HERE = os.path.dirname(os.path.abspath(__file__))
+ROOT = os.path.dirname(HERE)
+HARNESS = os.path.join(HERE, "simavr", "txdsim.c")
+BUILD_DIR = os.path.join(ROOT, ".pio", "simavr")
+
+# The default firmware, as built by "pio run -e pro8MHzatmega328".
+FIRMWARE = os.path.join(ROOT, ".pio", "build", "pro8MHzatmega328", "firmware.elf")
+
+# A 6410 gives one pulse per turn, and a speed of 1 mph is 1 pulse every 2.25 seconds.
+MPH_PULSE_SECONDS = 2.25
+
+# The default sample period, one frame is sent per sample.
+SAMPLE_SECONDS = 2.25
+
+# When the harness takes Dtr low, well after the firmware has started.
+DTR_LOW_SECONDS = 0.5
+
+# The emulator starts the first sample on the first pass of the main loop that sees Dtr low, and
+# sends its frame as soon as it ends (see tx20emulator::service()), so the first frame starts one
+# sample period after Dtr goes low. This allows for the passes of the loop in between.
+FIRST_FRAME_SLACK_SECONDS = 0.05
+
+# The number of bits in a frame, including the trailer.
+FRAME_BITS = 51
+
+# The golden trace, and the run it matches. It holds 32 s of frames after Dtr goes low.
+GOLDEN = os.path.join(ROOT, "test", "golden", "txd_legacy_10mph.vcd")
+GOLDEN_RUN = {"mph": 10.0, "vane": 512, "bit_length": 2000.0}
+GOLDEN_SECONDS = 32.0
+
+
+def mph_to_tx20_units(mph):
+    # The same as mph_to_tx20_units() in tx20emulator.cpp.
+    return int(round(mph * 1.609344 * 1000.0 * 10.0 / 3600.0))
+
+
+def vane_direction(adc):
+    # The same as davis6410, 16 points from the 10 bit reading.
+    return ((adc + 31) >> 6) & 0x0f
+
+
+# ------------------------------------------------------------------------------------------------
+# Build the harness, if it has changed since it was last built.
+# ------------------------------------------------------------------------------------------------
+def build_harness():
+    program = os.path.join(BUILD_DIR, "txdsim")
+    if os.path.exists(program) and os.path.getmtime(program) >= os.path.getmtime(HARNESS):
+        return program
+
+    os.makedirs(BUILD_DIR, exist_ok=True)
+    flags = ["-I/usr/include/simavr", "-I/usr/local/include/simavr", "-lsimavr", "-lelf"]
+    if shutil.which("pkg-config"):
+        found = subprocess.run(["pkg-config", "--cflags", "--libs", "simavr"],
+                               capture_output=True, text=True)
+        if found.returncode == 0:
+            flags = found.stdout.split() + ["-lelf"]
+
+    compiler = os.environ.get("CC", "cc")
+    subprocess.run([compiler, "-O2", "-Wall", "-o", program, HARNESS] + flags, check=True)
+    return program
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Run the firmware on simavr and check TxD.")
+    parser.add_argument("--elf", default=FIRMWARE, help="the firmware to run")
+    parser.add_argument("--seconds", type=float, default=12.0, help="how long to run for")
+    parser.add_argument("--mph", type=float, default=10.0, help="the simulated wind speed")
+    parser.add_argument("--vane", type=int, default=512, help="the wind vane reading, 0 to 1023")
+    parser.add_argument("--bit-length", type=float, default=2000.0, help="the bit length in us")
+    parser.add_argument("--tolerance", type=float, default=20.0, help="how far an edge may be out in us")
+    parser.add_argument("--max-drift", type=float, default=1000.0, help="how far the bit clock may be out in ppm")
+    parser.add_argument("--max-frame-latency", type=float, default=10.0,
+                        help="the longest from the end of a sample to its frame in ms")
+    parser.add_argument("--edges", help="write the error of every edge to this CSV file")
+    parser.add_argument("--vcd", default=os.path.join(BUILD_DIR, "txd.vcd"), help="where to write the capture")
+    args = parser.parse_args()
+
+    if not os.path.exists(args.elf):
+        parser.error("%s doesn't exist, build the firmware first" % args.elf)
+    if args.mph <= 0:
+        parser.error("the wind speed must be more than 0")
+
+    program = build_harness()
+    pulse_period = int(MPH_PULSE_SECONDS * 1e6 / args.mph)
+    subprocess.run([program, "-s", str(args.seconds), "-p", str(pulse_period), "-a", str(args.vane),
+                    "-d", str(int(DTR_LOW_SECONDS * 1e6)), "-v", args.vcd, args.elf], check=True)
+
+    # A sample can catch one pulse more or less than the average, depending on where it falls.
+    speed = mph_to_tx20_units(args.mph)
+    slack = mph_to_tx20_units(args.mph + 1) - speed
+    first_frame = SAMPLE_SECONDS + FIRST_FRAME_SLACK_SECONDS
+    frame_seconds = FRAME_BITS * args.bit_length / 1e6
+    frames = max(1, int((args.seconds - DTR_LOW_SECONDS - first_frame - frame_seconds) /
+                        SAMPLE_SECONDS) + 1)
+
+    check = [sys.executable, os.path.join(HERE, "txdcheck.py"),
+             "--bit-length", str(args.bit_length), "--tolerance", str(args.tolerance),
+             "--max-drift", str(args.max_drift),
+             "--expect", "%d,%d" % (speed, vane_direction(args.vane)),
+             "--speed-tolerance", str(slack), "--min-frames", str(frames),
+             "--max-first-frame", str(first_frame * 1000),
+             "--max-frame-latency", str(args.max_frame_latency)]
+    if args.edges:
+        check += ["--edges", args.edges]
+    if (all(getattr(args, name) == value for name, value in GOLDEN_RUN.items()) and
+            args.seconds - DTR_LOW_SECONDS <= GOLDEN_SECONDS):
+        check += ["--golden", GOLDEN]
+    check.append(args.vcd)
+    return subprocess.run(check).returncode
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,200 @@
+// ------------------------------------------------------------------------------------------------
+// A simavr harness for the bridge firmware.
+//
+//    txdsim [-s <seconds>] [-p <pulse period us>] [-w <pulse width us>] [-a <vane adc>]
+//           [-d <dtr low us>] [-l <led pin>] [-v <vcd file>] <firmware.elf>
+//
+// The firmware is run on a simulated 8 MHz ATmega328 with anemometer pulses on pin 2 and a fixed
+// wind vane voltage on A0. Dtr (pin 3) starts high and is taken low after the given time, 0 to
+// hold it low from reset. TxD (pin 4), Dtr, the anemometer pin and the front panel led (pin 9, or
+// pin 6 for a BITSCHEDULER_OUTPUT_COMPARE build) are written to a VCD file, along with a Vane
+// signal that changes level every time the firmware starts reading the wind vane. The 6410 reads
+// it as each sample ends, so it marks the end of the samples. scripts/txdcheck.py decodes and
+// checks the capture. Whatever the firmware writes to the serial port goes to stderr.
+//
+// This is built and run by scripts/simavr.py, which is the easiest way to use it.
+// ------------------------------------------------------------------------------------------------
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "avr_adc.h"
+#include "avr_ioport.h"
+#include "avr_uart.h"
+#include "sim_avr.h"
+#include "sim_elf.h"
+#include "sim_time.h"
+#include "sim_vcd_file.h"
+
+// The board.
+#define MCU "atmega328p"
+#define FREQUENCY 8000000
+#define SUPPLY_MV 5000
+
+// The pins, all on port D apart from the led.
+#define WIND_SENSOR_PIN 2
+#define DTR_PIN 3
+#define TXD_PIN 4
+#define LED_PIN 9
+
+// How often the VCD file is flushed in microseconds.
+#define VCD_FLUSH_US 100000
+
+static avr_irq_t* wind_sensor_irq;
+static avr_irq_t* dtr_irq;
+static avr_irq_t* vane_irq;
+static uint32_t vane_level = 0;
+
+// The anemometer pulses, a low pulse of pulse_width every pulse_period microseconds.
+static uint32_t pulse_period = 225000;
+static uint32_t pulse_width = 2000;
+
+// ------------------------------------------------------------------------------------------------
+// Take the anemometer pin low for a pulse, and back high at the end of it.
+// The reed switch closes at the start of each period.
+// ------------------------------------------------------------------------------------------------
+static avr_cycle_count_t pulse_end(avr_t* avr, avr_cycle_count_t when, void* param) {
+  avr_raise_irq(wind_sensor_irq, 1);
+  return 0;
+}
+
+static avr_cycle_count_t pulse_start(avr_t* avr, avr_cycle_count_t when, void* param) {
+  avr_raise_irq(wind_sensor_irq, 0);
+  avr_cycle_timer_register_usec(avr, pulse_width, pulse_end, NULL);
+  return when + avr_usec_to_cycles(avr, pulse_period);
+}
+
+// ------------------------------------------------------------------------------------------------
+// Take Dtr low.
+// ------------------------------------------------------------------------------------------------
+static avr_cycle_count_t dtr_low(avr_t* avr, avr_cycle_count_t when, void* param) {
+  avr_raise_irq(dtr_irq, 0);
+  return 0;
+}
+
+// ------------------------------------------------------------------------------------------------
+// Mark the start of a wind vane reading by changing the level of the Vane signal.
+// ------------------------------------------------------------------------------------------------
+static void vane_read(avr_irq_t* irq, uint32_t value, void* param) {
+  vane_level = !vane_level;
+  avr_raise_irq(vane_irq, vane_level);
+}
+
+// ------------------------------------------------------------------------------------------------
+// Return the irq for an Arduino digital pin, 0 to 7 on port D and 8 to 13 on port B.
+// ------------------------------------------------------------------------------------------------
+static avr_irq_t* pin_irq(avr_t* avr, int pin) {
+  return pin < 8 ? avr_io_getirq(avr, AVR_IOCTL_IOPORT_GETIRQ('D'), pin)
+                 : avr_io_getirq(avr, AVR_IOCTL_IOPORT_GETIRQ('B'), pin - 8);
+}
+
+// ------------------------------------------------------------------------------------------------
+// Pass the serial port output to stderr.
+// ------------------------------------------------------------------------------------------------
+static void uart_output(avr_irq_t* irq, uint32_t value, void* param) {
+  fputc(value, stderr);
+}
+
+static void usage(const char* program) {
+  fprintf(stderr, "usage: %s [-s seconds] [-p pulse period us] [-w pulse width us] "
+          "[-a vane adc] [-d dtr low us] [-l led pin] [-v vcd file] firmware.elf\n", program);
+  exit(2);
+}
+
+int main(int argc, char* argv[]) {
+  double seconds = 12.0;
+  int vane_adc = 512;
+  uint32_t dtr_low_us = 0;
+  int led_pin = LED_PIN;
+  const char* vcd_path = "txd.vcd";
+
+  int option;
+  while ((option = getopt(argc, argv, "s:p:w:a:d:l:v:")) != -1) {
+    switch (option) {
+      case 's': seconds = atof(optarg); break;
+      case 'p': pulse_period = strtoul(optarg, NULL, 0); break;
+      case 'w': pulse_width = strtoul(optarg, NULL, 0); break;
+      case 'a': vane_adc = atoi(optarg); break;
+      case 'd': dtr_low_us = strtoul(optarg, NULL, 0); break;
+      case 'l': led_pin = atoi(optarg); break;
+      case 'v': vcd_path = optarg; break;
+      default: usage(argv[0]);
+    }
+  }
+  if (optind != argc - 1 || seconds <= 0 || vane_adc < 0 || vane_adc > 1023) usage(argv[0]);
+  if (pulse_period && pulse_width >= pulse_period) usage(argv[0]);
+  if (led_pin < 0 || led_pin > 13) usage(argv[0]);
+
+  elf_firmware_t firmware;
+  memset(&firmware, 0, sizeof(firmware));
+  if (elf_read_firmware(argv[optind], &firmware) != 0) {
+    fprintf(stderr, "can't read %s\n", argv[optind]);
+    return 1;
+  }
+  firmware.frequency = FREQUENCY;
+
+  avr_t* avr = avr_make_mcu_by_name(MCU);
+  if (!avr) {
+    fprintf(stderr, "simavr doesn't know the %s\n", MCU);
+    return 1;
+  }
+  avr_init(avr);
+  avr_load_firmware(avr, &firmware);
+  avr->frequency = FREQUENCY;
+  avr->vcc = avr->avcc = avr->aref = SUPPLY_MV;
+
+  // The serial port goes to stderr rather than simavr's own log.
+#ifdef AVR_UART_FLAG_STDIO
+  uint32_t flags = 0;
+  avr_ioctl(avr, AVR_IOCTL_UART_GET_FLAGS('0'), &flags);
+  flags &= ~AVR_UART_FLAG_STDIO;
+  avr_ioctl(avr, AVR_IOCTL_UART_SET_FLAGS('0'), &flags);
+#endif
+  avr_irq_register_notify(avr_io_getirq(avr, AVR_IOCTL_UART_GETIRQ('0'), UART_IRQ_OUTPUT),
+                          uart_output, NULL);
+
+  dtr_irq = pin_irq(avr, DTR_PIN);
+  avr_irq_t* txd_irq = pin_irq(avr, TXD_PIN);
+  avr_irq_t* led_irq = pin_irq(avr, led_pin);
+  wind_sensor_irq = pin_irq(avr, WIND_SENSOR_PIN);
+
+  // The Vane signal belongs to the harness. The adc raises its trigger irq when a conversion
+  // starts.
+  static const char* vane_names[] = { "vane" };
+  vane_irq = avr_alloc_irq(&avr->irq_pool, 0, 1, vane_names);
+  avr_irq_register_notify(avr_io_getirq(avr, AVR_IOCTL_ADC_GETIRQ, ADC_IRQ_OUT_TRIGGER),
+                          vane_read, NULL);
+
+  avr_vcd_t vcd;
+  avr_vcd_init(avr, vcd_path, &vcd, VCD_FLUSH_US);
+  avr_vcd_add_signal(&vcd, txd_irq, 1, "TxD");
+  avr_vcd_add_signal(&vcd, dtr_irq, 1, "Dtr");
+  avr_vcd_add_signal(&vcd, wind_sensor_irq, 1, "Wind");
+  avr_vcd_add_signal(&vcd, led_irq, 1, "Led");
+  avr_vcd_add_signal(&vcd, vane_irq, 1, "Vane");
+  avr_vcd_start(&vcd);
+
+  // The wind vane is a fixed voltage and the anemometer pin idles high. Dtr goes low at the
+  // given time, or is held low from reset.
+  avr_raise_irq(avr_io_getirq(avr, AVR_IOCTL_ADC_GETIRQ, ADC_IRQ_ADC0),
+                (vane_adc * SUPPLY_MV + SUPPLY_MV / 2) / 1024);
+  avr_raise_irq(vane_irq, vane_level);
+  avr_raise_irq(dtr_irq, dtr_low_us ? 1 : 0);
+  if (dtr_low_us) avr_cycle_timer_register_usec(avr, dtr_low_us, dtr_low, NULL);
+  avr_raise_irq(wind_sensor_irq, 1);
+  if (pulse_period) avr_cycle_timer_register_usec(avr, pulse_period, pulse_start, NULL);
+
+  avr_cycle_count_t end = avr_usec_to_cycles(avr, (uint32_t)(seconds * 1e6));
+  int state = cpu_Running;
+  while (avr->cycle < end && state != cpu_Done && state != cpu_Crashed) state = avr_run(avr);
+
+  avr_vcd_close(&vcd);
+
+  if (state == cpu_Crashed) {
+    fprintf(stderr, "\nthe firmware crashed at pc 0x%04x\n", avr->pc);
+    return 1;
+  }
+
+  return 0;
+}
@@ -0,0 +1,343 @@
+# ------------------------------------------------------------------------------------------------
+# Debounce and sample period tuner for the Davis 6410 interface.
+#
+# This replays pulse traces through the real davis6410 code, in the host build, for every
+# combination of debounce and sample period in a grid, and scores each combination on,
+#
+#    - count error, the pulses miscounted as a percentage of the true pulses,
+#    - latency, the delay from the middle of a sample to it being sent (half the period),
+#    - gust error, how far the strongest sample is from the strongest 3 second gust.
+#
+# The combinations that aren't beaten on all three scores by another combination are printed as
+# a table, best count error first.
+#
+# The traces are either recorded on the bridge with the console command "trace on" and saved to
+# a file, or simulated. A recorded trace has no ground truth, so the true pulses are taken to be
+# the edges that are no closer to the last true pulse than a third of the typical gap between
+# pulses around them, which throws out contact bounce and noise without using a fixed debounce.
+# A simulated trace knows its true pulses. It has a gusty wind driving the cups, with a chance of
+# contact bounce after each pulse and random noise spikes on the cable, which can be set to
+# match a site.
+#
+# Each replay runs the host build's replay program (host/replay.cpp) on the trace with -c, which
+# writes out the pulses the 6410 counted in every sample along with the time the sample ended,
+# so the counting, the debounce and the sample timing are the firmware's own. A simulated trace
+# is written to a temporary file first. The host build has to be built before tuning,
+#
+#    pio run -e native
+#
+# The replays are shared between worker threads, one per core by default, each of which runs
+# the program as a separate process. The program runs its main loop every 100 us like the bridge,
+# and --loop makes it run less often, which is quicker but times the samples less exactly.
+#
+# The debounce and the sample period are the only settings that change the counting. The other
+# filter on the pulses is the RC filter the DAVIS6410_HW_COUNTER build needs in front of the
+# pin, which is hardware, and a trace only records the falling edges, not how long each pulse
+# is, so there is nothing in it to tune the filter with. The DAVIS6410_LEAN_ISR build debounces
+# the same way, just from the main loop, and can't record a trace.
+#
+#    python scripts/tune.py trace1.txt trace2.txt
+#    python scripts/tune.py --simulate 8 --hours 2 --bounce 0.3 --noise 0.05
+#    python scripts/tune.py --debounce 1:30 --period 1000,2250,3000,5000 site.txt
+# ------------------------------------------------------------------------------------------------
+import argparse
+import bisect
+import math
+import multiprocessing
+import multiprocessing.pool
+import os
+import random
+import subprocess
+import sys
+import tempfile
+
+# A 6410 gives one pulse per turn, and a speed of 1 mph is 1 pulse every 2.25 seconds.
+MPH_PULSE_SECONDS = 2.25
+
+# The length of a gust in seconds, as used by weather services.
+GUST_SECONDS = 3.0
+
+# An edge closer than this fraction of the typical gap to the last true pulse is bounce or noise
+# in a recorded trace.
+REFERENCE_GAP_FRACTION = 1.0 / 3.0
+
+# The number of gaps either side of an edge used to find the typical gap in a recorded trace.
+REFERENCE_GAP_WINDOW = 8
+
+# The micros() count wraps at 2^32.
+MICROS_WRAP = 1 << 32
+
+# The host build's replay program.
+PROGRAM = os.path.join(os.path.dirname(os.path.abspath(__file__)), "..", ".pio", "build", "native",
+                       "program")
+
+
+# ------------------------------------------------------------------------------------------------
+# A trace is a file the replay program can read, a list of edge times and a list of true pulse
+# times, both in microseconds and unwrapped the same way the program does it.
+# ------------------------------------------------------------------------------------------------
+class Trace:
+    def __init__(self, name, path, edges, truth):
+        self.name = name
+        self.path = path
+        self.edges = edges
+        self.truth = truth
+        self.gust = true_gust(truth) if truth else 0.0
+
+
+class TraceError(Exception):
+    pass
+
+
+# ------------------------------------------------------------------------------------------------
+# Read the edges from a recorded trace.
+# Only the E lines are used. micros() wraps every 71 minutes, so the times are unwrapped, allowing
+# for the lines being a little out of order as host/replay.cpp does. A trace from a build that
+# can't record edges is rejected, and one that lost edges is warned about, since the true pulses
+# can't be picked out around the gaps.
+# ------------------------------------------------------------------------------------------------
+def read_trace(path):
+    edges = []
+    offset = 0
+    last = None
+    lost = 0
+
+    with open(path) as f:
+        for line in f:
+            if line.startswith("# lost "):
+                lost += int(line.split()[2])
+                continue
+            if line.startswith("#") and "no edges" in line:
+                raise TraceError("%s has no edges (%s)" % (path, line[1:].strip()))
+
+            fields = line.split()
+            if len(fields) != 2 or fields[0] != "E" or not fields[1].isdigit():
+                continue
+            t = offset + int(fields[1])
+            if last is not None and t + MICROS_WRAP // 2 < last:
+                offset += MICROS_WRAP
+                t += MICROS_WRAP
+            if last is None or t > last:
+                last = t
+            edges.append(t)
+
+    edges.sort()
+    if not edges:
+        raise TraceError("%s has no edges" % path)
+    if lost:
+        print("warning: %s lost %d edges, so its counts will be out" % (path, lost), file=sys.stderr)
+
+    return Trace(path, path, edges, reference_pulses(edges))
+
+
+# ------------------------------------------------------------------------------------------------
+# Pick out the true pulses in a recorded trace.
+# ------------------------------------------------------------------------------------------------
+def reference_pulses(edges):
+    gaps = [b - a for a, b in zip(edges, edges[1:])]
+    truth = []
+
+    for i, t in enumerate(edges):
+        if truth:
+            nearby = sorted(gaps[max(0, i - REFERENCE_GAP_WINDOW):i + REFERENCE_GAP_WINDOW])
+            typical = nearby[len(nearby) // 2] if nearby else 0
+            if t - truth[-1] < typical * REFERENCE_GAP_FRACTION:
+                continue
+        truth.append(t)
+
+    return truth
+
+
+# ------------------------------------------------------------------------------------------------
+# Simulate a trace.
+# The wind is a mean speed with first order autoregressive turbulence, sized from the gust
+# factor, and the cups follow it with a 3 m distance constant. Each pulse may bounce, and noise
+# spikes arrive at random. The trace is written to a file in the directory given, with the times
+# wrapped the way micros() wraps them.
+# ------------------------------------------------------------------------------------------------
+def simulate_trace(n, args, directory):
+    rng = random.Random(args.seed + n)
+    step = 0.1
+    decay = math.exp(-step / args.turbulence)
+    sigma = (args.gust_factor - 1.0) * args.mean / 3.0
+    mean = args.mean * 0.44704
+
+    edges = []
+    truth = []
+    turbulence = 0.0
+    rotor = mean
+    phase = 0.0
+    t = 0.0
+
+    while t < args.hours * 3600.0:
+        turbulence = decay * turbulence + math.sqrt(1.0 - decay * decay) * sigma * 0.44704 * rng.gauss(0, 1)
+        wind = max(0.0, mean + turbulence)
+        rotor += (wind - rotor) * (1.0 - math.exp(-max(wind, rotor, 0.01) * step / 3.0))
+
+        # The pulse rate in Hz is the speed in mph over 2.25.
+        rate = rotor / 0.44704 / MPH_PULSE_SECONDS
+        phase += rate * step
+        while phase >= 1.0:
+            phase -= 1.0
+            pulse = t + step * (1.0 - phase / (rate * step))
+            truth.append(int(pulse * 1e6))
+            edges.append(truth[-1])
+            if rng.random() < args.bounce:
+                for _ in range(rng.randint(1, 3)):
+                    edges.append(truth[-1] + rng.randint(50, 2000))
+
+        for _ in range(poisson(rng, args.noise * step)):
+            edges.append(int((t + rng.random() * step) * 1e6))
+
+        t += step
+
+    edges.sort()
+    path = os.path.join(directory, "simulated%d.txt" % n)
+    with open(path, "w") as f:
+        for t in edges:
+            f.write("E %d\n" % (t % MICROS_WRAP))
+
+    return Trace("simulated %d" % n, path, edges, truth)
+
+
+def poisson(rng, mean):
+    count = 0
+    limit = math.exp(-mean)
+    p = rng.random()
+    while p > limit:
+        count += 1
+        p *= rng.random()
+    return count
+
+
+def true_gust(truth):
+    # The most pulses in any 3 second stretch, as mph.
+    best = 0
+    span = int(GUST_SECONDS * 1e6)
+    j = 0
+    for i, t in enumerate(truth):
+        while truth[j] < t - span:
+            j += 1
+        best = max(best, i - j + 1)
+    return best * MPH_PULSE_SECONDS / GUST_SECONDS
+
+
+# ------------------------------------------------------------------------------------------------
+# Replay one trace with one debounce and sample period through the replay program.
+# Each sample is compared with the true pulses since the sample before. The first sample started
+# when the program took Dtr low, part way into the trace, so it is left out.
+# Returns (debounce, period, miscounted, true pulses, measured gust, true gust).
+# ------------------------------------------------------------------------------------------------
+def replay(job):
+    program, loop, trace, debounce, period = job
+    if not trace.truth:
+        return None
+
+    command = [program, "-c", "-d", str(debounce), "-p", str(period), "-l", str(loop), trace.path]
+    done = subprocess.run(command, stdout=subprocess.PIPE, stderr=subprocess.PIPE,
+                          universal_newlines=True)
+    if done.returncode != 0:
+        raise RuntimeError("%s failed on %s: %s" % (program, trace.name, done.stderr.strip()))
+
+    samples = []
+    for line in done.stdout.splitlines():
+        fields = line.split()
+        if len(fields) == 3 and fields[0] == "S":
+            samples.append((int(fields[1]), int(fields[2])))
+
+    miscounted = 0
+    pulses = 0
+    most = 0
+    for (start, _), (end, counted) in zip(samples, samples[1:]):
+        expected = bisect.bisect_right(trace.truth, end) - bisect.bisect_right(trace.truth, start)
+        miscounted += abs(counted - expected)
+        pulses += expected
+        most = max(most, counted)
+
+    measured_gust = most * MPH_PULSE_SECONDS * 1000.0 / period
+    return (debounce, period, miscounted, pulses, measured_gust, trace.gust)
+
+
+# ------------------------------------------------------------------------------------------------
+# Combine the replays into scores and keep the combinations nobody beats.
+# ------------------------------------------------------------------------------------------------
+def pareto(results):
+    totals = {}
+    for debounce, period, miscounted, pulses, measured_gust, gust in results:
+        total = totals.setdefault((debounce, period), [0, 0, 0.0, 0])
+        total[0] += miscounted
+        total[1] += pulses
+        total[2] += abs(measured_gust - gust) / gust if gust else 0.0
+        total[3] += 1
+
+    scores = []
+    for (debounce, period), (miscounted, pulses, gust_error, count) in totals.items():
+        count_error = 100.0 * miscounted / pulses if pulses else 0.0
+        scores.append((count_error, period / 2.0, 100.0 * gust_error / count, debounce, period))
+
+    def beaten(a):
+        return any(b[:3] != a[:3] and all(x <= y for x, y in zip(b[:3], a[:3])) for b in scores)
+
+    return sorted(s for s in scores if not beaten(s))
+
+
+def grid(text):
+    if ":" in text:
+        first, last = text.split(":")
+        return list(range(int(first), int(last) + 1))
+    return [int(value) for value in text.split(",")]
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Tune the debounce and sample period from pulse traces.")
+    parser.add_argument("traces", nargs="*", help="traces recorded with 'trace on'")
+    parser.add_argument("--debounce", default="1:20", help="debounce periods in ms, first:last or a list")
+    parser.add_argument("--period", default="1000,1500,2250,3000,4500,6000", help="sample periods in ms")
+    parser.add_argument("--jobs", type=int, default=multiprocessing.cpu_count(), help="worker threads")
+    parser.add_argument("--program", default=PROGRAM, help="the host build's replay program")
+    parser.add_argument("--loop", type=int, default=100, help="main loop time in us for the replays")
+    parser.add_argument("--simulate", type=int, default=0, help="number of traces to simulate")
+    parser.add_argument("--hours", type=float, default=1.0, help="length of each simulated trace")
+    parser.add_argument("--mean", type=float, default=12.0, help="simulated mean wind speed in mph")
+    parser.add_argument("--gust-factor", type=float, default=1.5, help="simulated gust factor")
+    parser.add_argument("--turbulence", type=float, default=10.0, help="turbulence correlation time in s")
+    parser.add_argument("--bounce", type=float, default=0.2, help="chance of a pulse bouncing")
+    parser.add_argument("--noise", type=float, default=0.02, help="noise spikes per second")
+    parser.add_argument("--seed", type=int, default=1, help="seed for the simulated traces")
+    args = parser.parse_args()
+
+    if not os.path.isfile(args.program):
+        parser.error("%s not found, build it with 'pio run -e native'" % args.program)
+
+    try:
+        loaded = [read_trace(path) for path in args.traces]
+    except (OSError, TraceError) as error:
+        parser.error(str(error))
+    if not loaded and not args.simulate:
+        parser.error("give some traces or --simulate")
+
+    with tempfile.TemporaryDirectory() as directory:
+        loaded += [simulate_trace(n, args, directory) for n in range(args.simulate)]
+
+        jobs = [(args.program, args.loop, trace, debounce, period) for trace in loaded
+                for debounce in grid(args.debounce) for period in grid(args.period)]
+
+        with multiprocessing.pool.ThreadPool(args.jobs) as pool:
+            try:
+                results = [r for r in pool.imap_unordered(replay, jobs) if r]
+            except RuntimeError as error:
+                print("error: %s" % error, file=sys.stderr)
+                return 1
+
+    edges = sum(len(trace.edges) for trace in loaded)
+    print("%d traces, %d edges, %d replays on %d workers" % (len(loaded), edges, len(jobs), args.jobs))
+    print("")
+    print("%8s %8s %12s %12s %12s" % ("debounce", "period", "count err %", "latency ms", "gust err %"))
+    for count_error, latency, gust_error, debounce, period in pareto(results):
+        print("%8d %8d %12.2f %12.0f %12.1f" % (debounce, period, count_error, latency, gust_error))
+
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
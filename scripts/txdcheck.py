@@ -0,0 +1,550 @@
+# ------------------------------------------------------------------------------------------------
+# TX20 frame and bit timing checker for VCD captures of TxD.
+#
+# This reads a VCD file, from the simavr harness (scripts/simavr.py) or a logic analyser, finds
+# the TX20 frames on TxD and decodes them the way a reader would, sampling each bit in the
+# middle. Each frame is then compared with the ideal waveform for the values it carries, made by
+# encoding them again and putting every edge exactly on its bit boundary from the start of the
+# frame,
+#
+#    - the frame must decode, and carry the expected values if they are given,
+#    - it must have exactly the edges of the ideal waveform,
+#    - every edge must be inside the tolerance band around its ideal time,
+#    - the drift, the slope of the edge errors across the frame, must be inside its band. This
+#      is how far the bit clock is from the nominal bit length, in parts per million.
+#
+# The latency is checked too, when the capture has the signals for it (the simavr harness writes
+# them, a logic analyser capture may not),
+#
+#    - first frame, from Dtr going low (or the start of the capture if it is low from the start)
+#      to the start of the first frame after it. The wind meter has to count a whole sample
+#      first, so this is a sample period plus the time the firmware takes to start up.
+#    - frame latency, from the end of each sample to the start of its frame. The end of a sample
+#      is taken from the Vane signal, which changes level when the firmware starts reading the
+#      wind vane. The 6410 does that on the pass of the main loop after the sample ends, so the
+#      latency is short by one pass.
+#
+# Each frame is printed with its values, its worst edge, its drift and its latency, followed by a
+# report of the worst case over the whole capture. The error of every edge can also be written to
+# a CSV file. The exit status is 1 if any check fails.
+#
+# The encoder used for the ideal waveforms is checked against the golden frames in
+# src/tx20golden.inc before anything else, so it can't quietly drift from the firmware's.
+#
+# A frame compared with itself can't show a change in what happens between frames, so with
+# --golden the whole capture is also compared with a golden trace, a VCD file made by the host
+# build from a known wind (see test/golden). Both are lined up on Dtr going low (or on the first
+# frame if the capture has no Dtr), and then,
+#
+#    - TxD must be at the same level when Dtr goes low, and have the same edges after it, up to
+#      the last frame the capture holds in full,
+#    - each edge inside a frame must be inside the tolerance band, measured from the start of
+#      its frame,
+#    - every other edge, the starts and ends of the frames and the line going low when the
+#      emulator wakes up, must be inside the cadence band. These are timed by the main loop and
+#      millis() rather than the bit timer, so the band is wider.
+#
+# TxD is inverted, a 1 data bit is a low level. The line is low while the emulator samples and
+# the first bit of a frame is a 0, so a frame starts with a rising edge after the line has been
+# low for a while. The edge at the end of a frame is written by the main loop rather than the bit
+# timer, so it isn't checked.
+#
+#    python scripts/txdcheck.py txd.vcd
+#    python scripts/txdcheck.py --bit-length 1220 --expect 45,8 --speed-tolerance 5 txd.vcd
+#    python scripts/txdcheck.py --tolerance 5 --max-drift 500 --edges edges.csv txd.vcd
+#    python scripts/txdcheck.py --max-first-frame 2400 --max-frame-latency 5 txd.vcd
+#    python scripts/txdcheck.py --golden test/golden/txd_legacy_10mph.vcd txd.vcd
+# ------------------------------------------------------------------------------------------------
+import argparse
+import bisect
+import os
+import re
+import sys
+
+# The number of bits in a frame, including the 10 trailer bits, see src/tx20frame.h.
+FRAME_LENGTH = 51
+FRAME_BITS = 41
+HEADER = 0x04
+
+# The golden frames, shared with the firmware and the host tests.
+GOLDEN_FRAMES_PATH = os.path.join(os.path.dirname(os.path.dirname(os.path.abspath(__file__))),
+                                  "src", "tx20golden.inc")
+
+# A frame only starts after the line has been low for this many bits, which skips the edges made
+# while the firmware starts up.
+MIN_LOW_BITS = 10
+
+# The VCD time units in seconds.
+TIME_UNITS = {"s": 1.0, "ms": 1e-3, "us": 1e-6, "ns": 1e-9, "ps": 1e-12, "fs": 1e-15}
+
+
+# ------------------------------------------------------------------------------------------------
+# Read the changes of one signal from a VCD file.
+# Returns the initial level and a list of (time in us, level) for each change after it, or None
+# if the signal isn't in the file and isn't required.
+# ------------------------------------------------------------------------------------------------
+def read_vcd(path, signal, required=True):
+    with open(path) as f:
+        tokens = f.read().split()
+
+    scale = 1e-9
+    ident = None
+    now = 0.0
+    initial = None
+    changes = []
+    i = 0
+
+    while i < len(tokens):
+        token = tokens[i]
+        i += 1
+
+        if token == "$timescale":
+            end = tokens.index("$end", i)
+            scale = timescale(tokens[i:end])
+            i = end + 1
+        elif token == "$var":
+            end = tokens.index("$end", i)
+            fields = tokens[i:end]
+            i = end + 1
+            if fields[3] == signal:
+                ident = fields[2]
+        elif token in ("$comment", "$date", "$version", "$scope", "$upscope", "$enddefinitions"):
+            i = tokens.index("$end", i) + 1
+        elif token.startswith("$"):
+            continue
+        elif token.startswith("#"):
+            now = int(token[1:]) * scale * 1e6
+        elif token[0] in "bBrR":
+            value, name = token[1:], tokens[i]
+            i += 1
+            if name == ident:
+                initial, changes = record(initial, changes, now, value[-1:] == "1")
+        elif token[0] in "01xXzZ":
+            if token[1:] == ident:
+                initial, changes = record(initial, changes, now, token[0] == "1")
+
+    if ident is None:
+        if not required:
+            return None
+        raise SystemExit("%s has no signal called %s" % (path, signal))
+    return bool(initial), changes
+
+
+# The length of a VCD time unit in seconds, from the tokens of $timescale.
+def timescale(tokens):
+    text = "".join(tokens)
+    digits = text.rstrip("munpfs")
+    return float(digits or 1) * TIME_UNITS[text[len(digits):]]
+
+
+def record(initial, changes, now, level):
+    if initial is None:
+        return level, changes
+    last = changes[-1][1] if changes else initial
+    if level != last:
+        changes.append((now, level))
+    return initial, changes
+
+
+# ------------------------------------------------------------------------------------------------
+# Encode and decode frames as data bits, the same way src/tx20frame.cpp does.
+# decode() returns (speed, direction) or None if the frame is bad.
+# ------------------------------------------------------------------------------------------------
+def checksum(speed, direction):
+    return (direction + (speed & 0xf) + ((speed >> 4) & 0xf) + ((speed >> 8) & 0xf)) & 0xf
+
+
+def encode(speed, direction):
+    bits = []
+    for value, count in ((HEADER, 5), (direction, 4), (speed, 12), (checksum(speed, direction), 4),
+                         (~direction, 4), (~speed, 12), (0, FRAME_LENGTH - FRAME_BITS)):
+        bits += [(value >> n) & 1 for n in range(count)]
+    return bits
+
+
+def decode(bits):
+    def field(first, count):
+        return sum(bits[first + n] << n for n in range(count))
+
+    header = field(0, 5)
+    direction = field(5, 4)
+    speed = field(9, 12)
+    sum_ = field(21, 4)
+    direction_inverted = field(25, 4)
+    speed_inverted = field(29, 12)
+    trailer = field(FRAME_BITS, FRAME_LENGTH - FRAME_BITS)
+
+    if header != HEADER or trailer != 0 or sum_ != checksum(speed, direction):
+        return None
+    if direction ^ direction_inverted != 0xf or speed ^ speed_inverted != 0xfff:
+        return None
+    return speed, direction
+
+
+# ------------------------------------------------------------------------------------------------
+# Read the golden frames, one { speed, direction, { bytes } } a line.
+# Returns a list of (speed, direction, the frame bytes).
+# ------------------------------------------------------------------------------------------------
+def read_golden_frames(path=GOLDEN_FRAMES_PATH):
+    frames = []
+    with open(path) as f:
+        for line in f:
+            found = re.match(r"\s*\{\s*(\w+)\s*,\s*(\w+)\s*,\s*\{([^}]*)\}\s*\}", line)
+            if found:
+                frame = [int(value, 0) for value in found.group(3).split(",")]
+                frames.append((int(found.group(1), 0), int(found.group(2), 0), frame))
+    if not frames:
+        raise SystemExit("%s has no golden frames" % path)
+    return frames
+
+
+def check_encoder():
+    for speed, direction, frame in read_golden_frames():
+        golden = [(frame[n >> 3] >> (n & 7)) & 1 for n in range(FRAME_LENGTH)]
+        if encode(speed, direction) != golden:
+            raise SystemExit("the encoder doesn't match the golden frame for %d %d" % (speed, direction))
+
+
+# ------------------------------------------------------------------------------------------------
+# Return the ideal edges of a frame as the bit numbers they fall on.
+# The line is high for a 0 bit, and the frame starts from low.
+# ------------------------------------------------------------------------------------------------
+def ideal_edges(bits):
+    edges = []
+    level = 0
+    for n, bit in enumerate(bits):
+        if (not bit) != level:
+            level = not bit
+            edges.append(n)
+    return edges
+
+
+# ------------------------------------------------------------------------------------------------
+# Compare a frame with its ideal waveform.
+# Returns the (bit number, error in us) of each edge that matches, a list of problems with the
+# edges, and the drift in parts per million from a least squares fit of the errors.
+# ------------------------------------------------------------------------------------------------
+def compare(start, bits, times, bit_length):
+    ideal = ideal_edges(bits)[1:]
+    actual = [(int(round((t - start) / bit_length)), t - start) for t in times]
+
+    problems = []
+    seen = set(n for n, _ in actual)
+    missing = [n for n in ideal if n not in seen]
+    extra = sorted(seen - set(ideal))
+    if missing:
+        problems.append("no edge at bit %s" % ",".join(map(str, missing)))
+    if extra:
+        problems.append("extra edge at bit %s" % ",".join(map(str, extra)))
+
+    errors = [(n, offset - n * bit_length) for n, offset in actual if n in ideal]
+
+    drift = 0.0
+    if len(errors) >= 2:
+        mean_n = sum(n for n, _ in errors) / len(errors)
+        mean_e = sum(e for _, e in errors) / len(errors)
+        spread = sum((n - mean_n) ** 2 for n, _ in errors)
+        if spread:
+            slope = sum((n - mean_n) * (e - mean_e) for n, e in errors) / spread
+            drift = slope / bit_length * 1e6
+
+    return errors, problems, drift
+
+
+def level_at(initial, changes, times, t):
+    i = bisect.bisect_right(times, t)
+    return changes[i - 1][1] if i else initial
+
+
+# ------------------------------------------------------------------------------------------------
+# Find the frames.
+# Returns a list of (start, data bits, edge times) where the edge times are every edge inside the
+# frame after the first.
+# ------------------------------------------------------------------------------------------------
+def find_frames(initial, changes, bit_length):
+    frames = []
+    times = [when for when, _ in changes]
+    low_since = None
+    i = 0
+
+    while i < len(changes):
+        t, level = changes[i]
+        if not level:
+            low_since = t
+            i += 1
+            continue
+
+        if low_since is None or t - low_since < MIN_LOW_BITS * bit_length:
+            i += 1
+            continue
+
+        end = t + FRAME_LENGTH * bit_length
+        bits = [0 if level_at(initial, changes, times, t + (n + 0.5) * bit_length) else 1
+                for n in range(FRAME_LENGTH)]
+
+        edges = []
+        i += 1
+        while i < len(changes) and changes[i][0] < end - bit_length / 2:
+            edges.append(changes[i][0])
+            i += 1
+
+        frames.append((t, bits, edges))
+        low_since = None
+
+    return frames
+
+
+# ------------------------------------------------------------------------------------------------
+# Return the time Dtr went low, 0 if it was low from the start or None if it never went low.
+# ------------------------------------------------------------------------------------------------
+def dtr_low_time(dtr):
+    initial, changes = dtr
+    if not initial:
+        return 0.0
+    for t, level in changes:
+        if not level:
+            return t
+    return None
+
+
+# ------------------------------------------------------------------------------------------------
+# Return the latency of a frame in us, from the last change of the Vane signal before it, or None
+# if there wasn't one.
+# ------------------------------------------------------------------------------------------------
+def frame_latency(vane_times, start):
+    i = bisect.bisect_left(vane_times, start)
+    return start - vane_times[i - 1] if i else None
+
+
+# ------------------------------------------------------------------------------------------------
+# Return the time of the last change in a VCD file, which is as far as it goes.
+# ------------------------------------------------------------------------------------------------
+def vcd_end(path):
+    with open(path) as f:
+        tokens = f.read().split()
+    scale = 1e-9
+    if "$timescale" in tokens:
+        first = tokens.index("$timescale") + 1
+        scale = timescale(tokens[first:tokens.index("$end", first)])
+    times = [token for token in tokens if token.startswith("#")]
+    return int(times[-1][1:]) * scale * 1e6 if times else 0.0
+
+
+def level_before(initial, changes, t):
+    level = initial
+    for when, changed in changes:
+        if when >= t:
+            break
+        level = changed
+    return level
+
+
+# ------------------------------------------------------------------------------------------------
+# Compare a capture with a golden trace.
+# The capture is (TxD, Dtr or None, its end in the VCD's time scale in us). Returns the number of
+# edges compared, the worst bit edge error and the worst cadence error, as (error, time) in us,
+# and a list of problems.
+# ------------------------------------------------------------------------------------------------
+def compare_golden(path, capture, bit_length, cadence_tolerance):
+    (initial, changes), dtr, end = capture
+    golden_initial, golden_changes = read_vcd(path, "TxD")
+    golden_dtr = read_vcd(path, "Dtr", False)
+    golden_end = vcd_end(path)
+    golden_frames = [t for t, _, _ in find_frames(golden_initial, golden_changes, bit_length)]
+    frames = [t for t, _, _ in find_frames(initial, changes, bit_length)]
+
+    golden_zero = dtr_low_time(golden_dtr) if golden_dtr else None
+    zero = dtr_low_time(dtr) if dtr else None
+    if golden_zero is None:
+        return 0, None, None, ["%s has no Dtr going low" % path]
+    if zero is None:
+        if not frames or not golden_frames:
+            return 0, None, None, ["no frames to line up with the golden trace"]
+        zero = frames[0] - (golden_frames[0] - golden_zero)
+
+    problems = []
+    if level_before(initial, changes, zero) != level_before(golden_initial, golden_changes, golden_zero):
+        problems.append("TxD isn't at the golden level when Dtr goes low")
+
+    # Compare up to halfway between the last golden frame the capture holds in full and the next.
+    length = min(end - zero, golden_end - golden_zero) - cadence_tolerance
+    frame_us = FRAME_LENGTH * bit_length
+    starts = [t - golden_zero for t in golden_frames if t >= golden_zero]
+    whole = [t for t in starts if t + frame_us + bit_length < length]
+    if not whole:
+        return 0, None, None, problems + ["the capture doesn't hold a whole golden frame"]
+    after = [t for t in starts if t > whole[-1]]
+    window = (whole[-1] + frame_us + (after[0] if after else length)) / 2
+
+    golden = [(t - golden_zero, level) for t, level in golden_changes if golden_zero <= t]
+    golden = [(t, level) for t, level in golden if t < window]
+    captured = [(t - zero, level) for t, level in changes if zero <= t and t - zero < window]
+    if len(captured) != len(golden) or any(a[1] != b[1] for a, b in zip(captured, golden)):
+        return 0, None, None, problems + ["%d edges, the golden trace has %d" % (len(captured), len(golden))]
+
+    # Each edge inside a frame is timed from the start of its frame, in both.
+    golden_times = [t for t, _ in golden]
+    frame_index = {t: golden_times.index(t) for t in whole if t in golden_times}
+
+    worst_bit = (0.0, None)
+    worst_cadence = (0.0, None)
+    for (t, _), (golden_t, _) in zip(captured, golden):
+        i = bisect.bisect_left(whole, golden_t) - 1
+        if i >= 0 and whole[i] in frame_index and golden_t < whole[i] + frame_us - bit_length / 2:
+            start = captured[frame_index[whole[i]]][0]
+            error = (t - start) - (golden_t - whole[i])
+            if worst_bit[1] is None or abs(error) > abs(worst_bit[0]):
+                worst_bit = (error, golden_t)
+        else:
+            error = t - golden_t
+            if worst_cadence[1] is None or abs(error) > abs(worst_cadence[0]):
+                worst_cadence = (error, golden_t)
+
+    return len(golden), worst_bit, worst_cadence, problems
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Decode and check the TX20 frames in a VCD capture.")
+    parser.add_argument("vcd", help="the capture")
+    parser.add_argument("--signal", default="TxD", help="the name of the TxD signal in the capture")
+    parser.add_argument("--bit-length", type=float, default=2000.0, help="the bit length in us")
+    parser.add_argument("--tolerance", type=float, default=20.0, help="how far an edge may be out in us")
+    parser.add_argument("--max-drift", type=float, default=1000.0, help="how far the bit clock may be out in ppm")
+    parser.add_argument("--expect", help="the speed and direction every frame must carry, speed,direction")
+    parser.add_argument("--speed-tolerance", type=int, default=0, help="how far the speed may be out")
+    parser.add_argument("--min-frames", type=int, default=1, help="the fewest frames there must be")
+    parser.add_argument("--edges", help="write the error of every edge to this CSV file")
+    parser.add_argument("--dtr-signal", default="Dtr", help="the name of the Dtr signal in the capture")
+    parser.add_argument("--vane-signal", default="Vane", help="the name of the wind vane read signal")
+    parser.add_argument("--max-first-frame", type=float, default=2400.0,
+                        help="the longest from Dtr going low to the first frame in ms")
+    parser.add_argument("--max-frame-latency", type=float, default=10.0,
+                        help="the longest from the end of a sample to its frame in ms")
+    parser.add_argument("--golden", help="a golden trace to compare the whole capture with")
+    parser.add_argument("--cadence-tolerance", type=float, default=5.0,
+                        help="how far the edges between frames may be from the golden trace in ms")
+    args = parser.parse_args()
+
+    check_encoder()
+
+    initial, changes = read_vcd(args.vcd, args.signal)
+    frames = find_frames(initial, changes, args.bit_length)
+    dtr = read_vcd(args.vcd, args.dtr_signal, False)
+    vane = read_vcd(args.vcd, args.vane_signal, False)
+    vane_times = [t for t, _ in vane[1]] if vane else []
+    expect = [int(value) for value in args.expect.split(",")] if args.expect else None
+
+    failures = 0
+    worst_edge = (0.0, None, None)
+    worst_drift = (0.0, None)
+    worst_latency = (None, None)
+    all_errors = []
+    rows = []
+
+    for index, (t, bits, times) in enumerate(frames):
+        values = decode(bits)
+        problems = []
+        edge = 0.0
+        drift = 0.0
+
+        latency = frame_latency(vane_times, t) if vane else None
+        if latency is not None:
+            if worst_latency[0] is None or latency > worst_latency[0]:
+                worst_latency = (latency, index)
+            if latency > args.max_frame_latency * 1000:
+                problems.append("latency %.2f ms" % (latency / 1000))
+
+        if values is None:
+            problems.append("doesn't decode")
+        else:
+            if expect and (abs(values[0] - expect[0]) > args.speed_tolerance or values[1] != expect[1]):
+                problems.append("expected %d %d" % tuple(expect))
+
+            errors, edge_problems, drift = compare(t, encode(*values), times, args.bit_length)
+            problems += edge_problems
+            for n, error in errors:
+                all_errors.append(error)
+                rows.append((index, n, t + n * args.bit_length, t + n * args.bit_length + error, error))
+                if abs(error) > abs(edge):
+                    edge = error
+                if abs(error) > abs(worst_edge[0]):
+                    worst_edge = (error, n, index)
+            if abs(drift) > abs(worst_drift[0]):
+                worst_drift = (drift, index)
+
+            if abs(edge) > args.tolerance:
+                problems.append("edge out by %+.1f us" % edge)
+            if abs(drift) > args.max_drift:
+                problems.append("drift %+.0f ppm" % drift)
+
+        print("%3d %12.6f s  %s  worst edge %+6.1f us  drift %+6.0f ppm  latency %s%s" % (
+            index, t / 1e6, "speed %4d direction %2d" % values if values else "bad frame          ",
+            edge, drift, "%6.2f ms" % (latency / 1000) if latency is not None else "     -   ",
+            "  FAIL " + ", ".join(problems) if problems else ""))
+        failures += bool(problems)
+
+    if args.edges:
+        with open(args.edges, "w") as f:
+            f.write("frame,bit,ideal_us,actual_us,error_us\n")
+            for row in rows:
+                f.write("%d,%d,%.3f,%.3f,%.3f\n" % row)
+
+    if len(frames) < args.min_frames:
+        print("only %d frames, expected at least %d" % (len(frames), args.min_frames))
+        failures += 1
+
+    first_frame = None
+    if dtr:
+        low = dtr_low_time(dtr)
+        after = [t for t, _, _ in frames if low is not None and t >= low]
+        if after:
+            first_frame = after[0] - low
+            if first_frame > args.max_first_frame * 1000:
+                print("the first frame took %.1f ms from Dtr going low" % (first_frame / 1000))
+                failures += 1
+        elif low is not None:
+            print("no frame after Dtr went low")
+            failures += 1
+
+    print("")
+    print("%d frames, %d failed, %d edges checked" % (len(frames), failures, len(all_errors)))
+    if all_errors:
+        all_errors.sort()
+        print("edge error: min %+.1f us, mean %+.1f us, max %+.1f us (band +-%.1f us)" % (
+            all_errors[0], sum(all_errors) / len(all_errors), all_errors[-1], args.tolerance))
+        print("worst edge: %+.1f us at bit %d of frame %d" % worst_edge)
+        if worst_drift[1] is not None:
+            print("worst drift: %+.0f ppm in frame %d (band +-%.0f ppm)" % (
+                worst_drift[0], worst_drift[1], args.max_drift))
+    if first_frame is not None:
+        print("first frame: %.1f ms after Dtr went low (limit %.0f ms)" % (
+            first_frame / 1000, args.max_first_frame))
+    if worst_latency[1] is not None:
+        print("worst frame latency: %.2f ms in frame %d (limit %.1f ms)" % (
+            worst_latency[0] / 1000, worst_latency[1], args.max_frame_latency))
+
+    if args.golden:
+        cadence_tolerance = args.cadence_tolerance * 1000
+        count, worst_bit, worst_cadence, problems = compare_golden(
+            args.golden, ((initial, changes), dtr, vcd_end(args.vcd)), args.bit_length,
+            cadence_tolerance)
+        if worst_bit and abs(worst_bit[0]) > args.tolerance:
+            problems.append("a frame edge is out by %+.1f us" % worst_bit[0])
+        if worst_cadence and abs(worst_cadence[0]) > cadence_tolerance:
+            problems.append("an edge between frames is out by %+.2f ms" % (worst_cadence[0] / 1000))
+
+        print("golden: %d edges compared with %s%s" % (
+            count, args.golden, "  FAIL " + ", ".join(problems) if problems else ""))
+        if worst_bit and worst_bit[1] is not None:
+            print("golden worst frame edge: %+.1f us at %.6f s (band +-%.1f us)" % (
+                worst_bit[0], worst_bit[1] / 1e6, args.tolerance))
+        if worst_cadence and worst_cadence[1] is not None:
+            print("golden worst edge between frames: %+.2f ms at %.6f s (band +-%.1f ms)" % (
+                worst_cadence[0] / 1000, worst_cadence[1] / 1e6, args.cadence_tolerance))
+        failures += bool(problems)
+
+    return 1 if failures else 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,434 @@
+// ------------------------------------------------------------------------------------------------
+// A timer driven scheduler for sending bit streams on several pins at once.
+// ------------------------------------------------------------------------------------------------
+#include "bitscheduler.h"
+
+// The channels attached to the scheduler.
+static bitchannel* channels[k_bitscheduler_channels] = {};
+
+// Will be true once the timer has been set up.
+static bool timer_running = false;
+
+// If the next bit is due in fewer ticks than this, the isr waits for it rather than setting the
+// compare register, which might otherwise be passed before it is set.
+constexpr uint16_t k_min_lead_ticks = 16;
+
+// Every timer runs with a prescaler of 8, so a tick is 8 cpu cycles whatever the clock. The bit
+// lengths are worked out from F_CPU in ticks (see tx20_bit_ticks()), so anything timed in cpu
+// cycles here is worked out from this rather than from microseconds.
+constexpr uint16_t k_tick_cycles = 8;
+
+#if defined(BITSCHEDULER_USART)
+
+// ------------------------------------------------------------------------------------------------
+// The usart runs as an spi master with the least significant bit first, and the transmit data
+// line is the channel's pin. An spi bit is 2 * (UBRR0 + 1) cpu cycles, and UBRR0 is 12 bits,
+// so the longest spi bit is 8192 cycles, or 1024 timer ticks. That is shorter than a TX20 bit
+// (1 ms on an 8 MHz board, less on a faster one), so each bit is sent as enough spi bits to
+// make up its length.
+// ------------------------------------------------------------------------------------------------
+constexpr uint16_t k_usart_cycles_per_ubrr = 2;
+constexpr uint16_t k_usart_ubrr_max = 4095;
+constexpr uint16_t k_usart_ticks_ubrr = k_tick_cycles / k_usart_cycles_per_ubrr;
+constexpr uint16_t k_usart_max_ticks = (k_usart_ubrr_max + 1) / k_usart_ticks_ubrr;
+
+static_assert(k_tick_cycles % k_usart_cycles_per_ubrr == 0,
+              "a timer tick must be a whole number of usart clock steps");
+
+static void timer_setup() {
+  pinMode(k_bitscheduler_xck_pin, OUTPUT);
+}
+
+#elif defined(BITSCHEDULER_OUTPUT_COMPARE)
+
+// ------------------------------------------------------------------------------------------------
+// Timer 1 runs freely with a prescaler of 8. Each channel has its own compare unit, A for pin 9
+// and B for pin 10. The unit's output mode says whether the pin is set or cleared at the next
+// compare match, so the hardware writes every bit edge on the exact tick it is due. The isr for
+// the match only has to set up the edge after it, which it has a whole bit length to do.
+// ------------------------------------------------------------------------------------------------
+static void timer_setup() {
+  TIMSK1 = 0;
+  TCCR1A = 0;
+  TCCR1B = _BV(CS11);
+}
+
+static volatile uint16_t& compare_register(uint8_t unit) { return unit ? OCR1B : OCR1A; }
+
+static uint8_t compare_bit(uint8_t unit) { return unit ? _BV(OCIE1B) : _BV(OCIE1A); }
+
+// Set the level the pin goes to at the next compare match. The output modes are 2 to clear the
+// pin and 3 to set it.
+static void compare_action(uint8_t unit, bool level) {
+  uint8_t shift = unit ? COM1B0 : COM1A0;
+  TCCR1A = (TCCR1A & ~(0x03 << shift)) | ((level ? 0x03 : 0x02) << shift);
+}
+
+// Hand the pin back to the port register.
+static void compare_release(uint8_t unit) {
+  TCCR1A &= ~(0x03 << (unit ? COM1B0 : COM1A0));
+}
+
+#elif !defined(BITSCHEDULER_TIMER2)
+
+// ------------------------------------------------------------------------------------------------
+// Timer 1 runs freely with a prescaler of 8 and the compare register A marks the next bit.
+// ------------------------------------------------------------------------------------------------
+static void timer_setup() {
+  TIMSK1 = 0;
+  TCCR1A = 0;
+  TCCR1B = _BV(CS11);
+}
+
+static void timer_wake() {}
+
+static uint16_t timer_now() { return TCNT1; }
+
+static void timer_compare(uint16_t now, uint16_t lead) {
+  OCR1A = now + lead;
+  TIFR1 = _BV(OCF1A);
+  TIMSK1 |= _BV(OCIE1A);
+}
+
+static void timer_idle() { TIMSK1 &= ~_BV(OCIE1A); }
+
+#else
+
+// ------------------------------------------------------------------------------------------------
+// Timer 2 runs freely with a prescaler of 8, but it is only 8 bits. The overflows are counted to
+// make a 16 bit time, and the compare register A is only set once the next bit is due before
+// the next overflow. Until then the overflow isr runs the scheduler instead. The overflow
+// interrupt is only enabled while bits are being sent.
+// ------------------------------------------------------------------------------------------------
+static volatile uint8_t timer_high = 0;
+
+static void timer_setup() {
+  TIMSK2 = 0;
+  TCCR2A = 0;
+  TCCR2B = _BV(CS21);
+}
+
+static void timer_wake() {
+  if (!(TIMSK2 & _BV(TOIE2))) {
+    TIFR2 = _BV(TOV2);
+    TIMSK2 = _BV(TOIE2);
+  }
+}
+
+// An overflow that hasn't been counted yet shows up as a low count with the flag set.
+static uint16_t timer_now() {
+  uint8_t low = TCNT2;
+  uint8_t high = timer_high;
+  if ((TIFR2 & _BV(TOV2)) && low < 0x80) ++high;
+  return (high << 8) | low;
+}
+
+static void timer_compare(uint16_t now, uint16_t lead) {
+  if (lead < 0x100) {
+    OCR2A = now + lead;
+    TIFR2 = _BV(OCF2A);
+    TIMSK2 |= _BV(OCIE2A);
+  } else {
+    TIMSK2 &= ~_BV(OCIE2A);
+  }
+}
+
+static void timer_idle() { TIMSK2 = 0; }
+
+#endif
+
+#if defined(BITSCHEDULER_USART)
+
+// ------------------------------------------------------------------------------------------------
+// The scheduler.
+// ------------------------------------------------------------------------------------------------
+struct bitschedulerisr {
+
+  // The data register is empty, so load the next 8 spi bits. The last byte is padded with the
+  // level of the last bit. Once everything has been loaded, wait for the shift register to
+  // empty.
+  static void fill() {
+    bitchannel* channel = channels[0];
+
+    if (channel->index_ == channel->count_) {
+      UCSR0A = _BV(TXC0);
+      UCSR0B = (UCSR0B & ~_BV(UDRIE0)) | _BV(TXCIE0);
+      return;
+    }
+
+    uint8_t data = 0;
+    for (uint8_t i = 0; i < 8; ++i) {
+      uint8_t n = channel->index_ < channel->count_ ? channel->index_ : channel->count_ - 1;
+      if (channel->level(n)) data |= 1 << i;
+
+      if (channel->index_ < channel->count_ && ++channel->repeated_ == channel->repeat_) {
+        channel->repeated_ = 0;
+        ++channel->index_;
+      }
+    }
+
+    UDR0 = data;
+  }
+
+  // The last bit has been shifted out. Hand the pin back to the port with the same level.
+  static void done() {
+    bitchannel* channel = channels[0];
+
+    channel->set_port(channel->level(channel->count_ - 1));
+    UCSR0B = 0;
+    channel->busy_ = false;
+  }
+};
+
+ISR(USART_UDRE_vect) { bitschedulerisr::fill(); }
+ISR(USART_TX_vect) { bitschedulerisr::done(); }
+
+#elif defined(BITSCHEDULER_OUTPUT_COMPARE)
+
+// ------------------------------------------------------------------------------------------------
+// The scheduler.
+// ------------------------------------------------------------------------------------------------
+struct bitschedulerisr {
+
+  // The bit that was set up has just been written by the hardware. Set up the next edge, or if
+  // the last bit has now finished, hand the pin back to the port with the same level.
+  static void compare(uint8_t unit) {
+    bitchannel* channel = channels[unit];
+    if (!channel) return;
+
+    if (++channel->index_ == channel->count_) {
+      channel->set_port(channel->level(channel->count_ - 1));
+      compare_release(unit);
+      TIMSK1 &= ~compare_bit(unit);
+      channel->busy_ = false;
+      return;
+    }
+
+    uint8_t next = channel->index_ + 1 < channel->count_ ? channel->index_ + 1 : channel->index_;
+    compare_register(unit) += channel->ticks_;
+    compare_action(unit, channel->level(next));
+  }
+};
+
+ISR(TIMER1_COMPA_vect) { bitschedulerisr::compare(0); }
+ISR(TIMER1_COMPB_vect) { bitschedulerisr::compare(1); }
+
+#else
+
+// ------------------------------------------------------------------------------------------------
+// The scheduler.
+// ------------------------------------------------------------------------------------------------
+struct bitschedulerisr {
+
+  // Write every bit that is due and set the compare register for the next one.
+  // This is called from the isr, or with interrupts disabled.
+  static void run() {
+    for (;;) {
+      uint16_t now = timer_now();
+      uint16_t lead = 0xffff;
+
+      for (bitchannel* channel : channels) {
+        if (!channel || !channel->busy_) continue;
+
+        uint16_t late = now - channel->next_;
+        if (static_cast<int16_t>(late) >= 0) {
+          // The bit that has just finished was the last, so the channel is done.
+          if (channel->index_ == channel->count_) {
+            channel->busy_ = false;
+            continue;
+          }
+
+          channel->write_bit(channel->index_++);
+          if (late > channel->max_late_) channel->max_late_ = late;
+          channel->next_ += channel->ticks_;
+        }
+
+        uint16_t due = channel->next_ - now;
+        if (due < lead) lead = due;
+      }
+
+      // Nothing left to send.
+      if (lead == 0xffff) {
+        timer_idle();
+        return;
+      }
+
+      if (lead >= k_min_lead_ticks) {
+        timer_compare(now, lead);
+        return;
+      }
+    }
+  }
+};
+
+#ifndef BITSCHEDULER_TIMER2
+
+ISR(TIMER1_COMPA_vect) { bitschedulerisr::run(); }
+
+#else
+
+ISR(TIMER2_COMPA_vect) { bitschedulerisr::run(); }
+
+ISR(TIMER2_OVF_vect) {
+  timer_high = timer_high + 1;
+  if (!(TIMSK2 & _BV(OCIE2A))) bitschedulerisr::run();
+}
+
+#endif
+
+#endif
+
+// ------------------------------------------------------------------------------------------------
+// Attach the channel to an output pin.
+// The first channel starts the timer running freely with a prescaler of 8. This takes the timer
+// from the Arduino core, so analogWrite() can't be used on pins 9 and 10 (or 3 and 11 with
+// timer 2). With the usart, the serial port can't be used.
+// ------------------------------------------------------------------------------------------------
+bool bitchannel::initialise(int pin, bool inverted) {
+  bitchannel** slot = nullptr;
+
+#if defined(BITSCHEDULER_USART)
+  // There is only the one usart.
+  if (pin != k_bitscheduler_usart_pin) return false;
+  if (channels[0]) return channels[0] == this;
+  slot = &channels[0];
+#elif defined(BITSCHEDULER_OUTPUT_COMPARE)
+  // The pin decides the compare unit.
+  if (pin != k_bitscheduler_oc1a_pin && pin != k_bitscheduler_oc1b_pin) return false;
+  unit_ = pin == k_bitscheduler_oc1a_pin ? 0 : 1;
+  if (channels[unit_]) return channels[unit_] == this;
+  slot = &channels[unit_];
+#else
+  for (bitchannel*& channel : channels) {
+    if (channel == this) return true;
+    if (!channel && !slot) slot = &channel;
+  }
+  if (!slot) return false;
+#endif
+
+  pinMode(pin, OUTPUT);
+  port_ = portOutputRegister(digitalPinToPort(pin));
+  mask_ = digitalPinToBitMask(pin);
+  inverted_ = inverted;
+
+  noInterrupts();
+  if (!timer_running) {
+    timer_setup();
+    timer_running = true;
+  }
+  *slot = this;
+  interrupts();
+
+  return true;
+}
+
+// ------------------------------------------------------------------------------------------------
+// Start sending bits.
+// ------------------------------------------------------------------------------------------------
+void bitchannel::send(const uint8_t* bits, uint8_t count, uint16_t ticks) {
+  if (!port_ || count == 0) return;
+
+#if defined(BITSCHEDULER_USART)
+  // The usart is set up from scratch for each frame. The spi bit length is rounded to the
+  // nearest 2 cpu cycles, a quarter of a microsecond on an 8 MHz board. Enabling the data
+  // register empty interrupt loads the first byte straight away.
+  uint8_t repeat = (ticks + k_usart_max_ticks - 1) / k_usart_max_ticks;
+  uint16_t ubrr = (static_cast<uint32_t>(k_usart_ticks_ubrr) * ticks + repeat / 2) / repeat - 1;
+
+  noInterrupts();
+  bits_ = bits;
+  count_ = count;
+  ticks_ = ticks;
+  index_ = 0;
+  repeat_ = repeat;
+  repeated_ = 0;
+  busy_ = true;
+
+  set_port(level(0));
+  UCSR0B = 0;
+  UBRR0 = 0;
+  UCSR0C = _BV(UMSEL01) | _BV(UMSEL00) | _BV(UDORD0);
+  UCSR0B = _BV(TXEN0);
+  UBRR0 = ubrr;
+  UCSR0B |= _BV(UDRIE0);
+  interrupts();
+#elif defined(BITSCHEDULER_OUTPUT_COMPARE)
+  // The first bit is forced out straight away, and the second is set up for the next match.
+  noInterrupts();
+  bits_ = bits;
+  count_ = count;
+  ticks_ = ticks;
+  index_ = 0;
+  busy_ = true;
+
+  compare_action(unit_, level(0));
+  TCCR1C = unit_ ? _BV(FOC1B) : _BV(FOC1A);
+
+  compare_register(unit_) = TCNT1 + ticks;
+  compare_action(unit_, level(count > 1 ? 1 : 0));
+  TIFR1 = compare_bit(unit_);
+  TIMSK1 |= compare_bit(unit_);
+  interrupts();
+#else
+  noInterrupts();
+  bits_ = bits;
+  count_ = count;
+  ticks_ = ticks;
+  timer_wake();
+  write_bit(0);
+  index_ = 1;
+  next_ = timer_now() + ticks;
+  busy_ = true;
+  bitschedulerisr::run();
+  interrupts();
+#endif
+}
+
+// ------------------------------------------------------------------------------------------------
+// Set the level of the pin while no bits are being sent.
+// The port register is shared with other pins that the isr may be writing, so interrupts are
+// disabled while it is changed.
+// ------------------------------------------------------------------------------------------------
+void bitchannel::set_level(bool high) {
+  if (!port_ || busy_) return;
+
+  noInterrupts();
+  set_port(high);
+  interrupts();
+}
+
+// ------------------------------------------------------------------------------------------------
+// Return the latest an edge has been written.
+// The isr can change it between the two bytes being read, so interrupts are disabled.
+// ------------------------------------------------------------------------------------------------
+uint16_t bitchannel::max_late() const {
+  noInterrupts();
+  uint16_t late = max_late_;
+  interrupts();
+
+  return late;
+}
+
+// ------------------------------------------------------------------------------------------------
+// Write bit n of the buffer to the pin.
+// ------------------------------------------------------------------------------------------------
+void bitchannel::write_bit(uint8_t n) {
+  set_port(level(n));
+}
+
+// ------------------------------------------------------------------------------------------------
+// Return the pin level for bit n of the buffer.
+// ------------------------------------------------------------------------------------------------
+bool bitchannel::level(uint8_t n) const {
+  return ((bits_[n >> 3] >> (n & 7)) & 0x01) != inverted_;
+}
+
+// ------------------------------------------------------------------------------------------------
+// Set the level of the pin through the port register.
+// ------------------------------------------------------------------------------------------------
+void bitchannel::set_port(bool level) {
+  if (level)
+    *port_ |= mask_;
+  else
+    *port_ &= ~mask_;
+}
@@ -0,0 +1,128 @@
+// ------------------------------------------------------------------------------------------------
+// A timer driven scheduler for sending bit streams on several pins at once.
+//
+// Each pin has a bitchannel. A channel is given a buffer of bits and a bit length, and from
+// then on the bits are written by the timer 1 compare interrupt. Timer 1 runs freely with a
+// 1 us tick (on an 8 MHz board), every channel keeps the tick its next bit is due on, and the
+// compare register is always set to the earliest of them. So any number of channels, each with
+// its own bit length, can share the one timer, and nothing waits while the bits are sent.
+//
+// The bits are written straight to the port registers, so a bit edge is only ever late by the
+// time it takes to get into the isr.
+//
+// If timer 1 is needed for something else, define BITSCHEDULER_TIMER2 and timer 2 is used
+// instead, with the same tick. This is done for the hardware pulse counter in davis6410.h.
+//
+// Define BITSCHEDULER_OUTPUT_COMPARE to have the timer 1 compare units write the bit edges
+// instead of the isr. The edges are then exact to the tick whatever else the cpu is doing, but
+// there are only two channels and they must be on OC1A (pin 9) and OC1B (pin 10).
+//
+// Define BITSCHEDULER_USART to shift the bits out of the usart in spi master mode instead. The
+// cpu then only loads a byte at a time, which is about a dozen interrupts for a TX20 frame.
+// There is only one channel, which must be on the usart's TxD (pin 1). The usart's clock comes
+// out on XCK (pin 4), and the serial port can't be used at all.
+// ------------------------------------------------------------------------------------------------
+#pragma once
+
+#include <Arduino.h>
+
+#if defined(DAVIS6410_HW_COUNTER) && !defined(BITSCHEDULER_TIMER2)
+#define BITSCHEDULER_TIMER2
+#endif
+
+#if defined(BITSCHEDULER_OUTPUT_COMPARE) && defined(BITSCHEDULER_TIMER2)
+#error "the output compare bit scheduler needs timer 1"
+#endif
+
+#if defined(BITSCHEDULER_USART) && defined(BITSCHEDULER_OUTPUT_COMPARE)
+#error "only one of BITSCHEDULER_USART and BITSCHEDULER_OUTPUT_COMPARE can be used"
+#endif
+
+// The pins for the timer 1 compare outputs.
+constexpr int k_bitscheduler_oc1a_pin = 9;
+constexpr int k_bitscheduler_oc1b_pin = 10;
+
+// The pins for the usart's transmit data and clock.
+constexpr int k_bitscheduler_usart_pin = 1;
+constexpr int k_bitscheduler_xck_pin = 4;
+
+// The number of channels that can be attached to the scheduler.
+constexpr uint8_t k_bitscheduler_channels = 2;
+
+class bitchannel {
+
+public:
+
+  // Attach the channel to an output pin.
+  // If inverted is true, a 1 bit is written as a low level. Returns false if all the channels
+  // are in use.
+  bool initialise(int pin, bool inverted);
+
+  // Start sending bits.
+  // Bit n is bit (n % 8) of bits[n / 8]. The first bit is written straight away and each bit
+  // lasts for ticks timer ticks, which must be less than 32768. The buffer must not change
+  // until the channel is no longer busy.
+  void send(const uint8_t* bits, uint8_t count, uint16_t ticks);
+
+  // Return true until the last bit has been sent for its whole length.
+  bool busy() const { return busy_; }
+
+  // Return the most timer ticks any bit edge has been written after it was due.
+  // This is the delay getting into the isr, mostly from other interrupts. It is always 0 when
+  // the edges are written by the hardware.
+  uint16_t max_late() const;
+
+  // Set the level of the pin while no bits are being sent.
+  // This must be used rather than digitalWrite(), which isn't safe against the isr.
+  void set_level(bool high);
+
+private:
+
+  // The interrupt service routine, see bitscheduler.cpp.
+  friend struct bitschedulerisr;
+
+  // Write bit n of the buffer to the pin.
+  void write_bit(uint8_t n);
+
+  // Return the pin level for bit n of the buffer.
+  bool level(uint8_t n) const;
+
+  // Set the level of the pin through the port register.
+  void set_port(bool level);
+
+  // The output register and the bit for the pin.
+  volatile uint8_t* port_ = nullptr;
+  uint8_t mask_ = 0;
+
+  // Will be true if a 1 bit is written as a low level.
+  bool inverted_ = false;
+
+  // The bits being sent.
+  const uint8_t* bits_ = nullptr;
+  uint8_t count_ = 0;
+
+  // The next bit to be written.
+  uint8_t index_ = 0;
+
+  // The length of a bit and the tick the next bit is due on.
+  uint16_t ticks_ = 0;
+  uint16_t next_ = 0;
+
+  // The latest an edge has been written. This is written by the isr, so it is only read with
+  // interrupts off.
+  volatile uint16_t max_late_ = 0;
+
+  // Will be true while the bits are being sent.
+  volatile bool busy_ = false;
+
+#ifdef BITSCHEDULER_OUTPUT_COMPARE
+  // The timer 1 compare unit, 0 for A and 1 for B.
+  uint8_t unit_ = 0;
+#endif
+
+#ifdef BITSCHEDULER_USART
+  // The number of spi bits sent for each bit, and the number sent so far for the current bit.
+  uint8_t repeat_ = 1;
+  uint8_t repeated_ = 0;
+#endif
+};
@@ -0,0 +1,70 @@
+// ------------------------------------------------------------------------------------------------
+// The bridge configuration.
+// ------------------------------------------------------------------------------------------------
+#include "config.h"
+
+#include <avr/eeprom.h>
+#include <util/crc16.h>
+
+#include "davis6410.h"
+#include "patternmeter.h"
+#include "tx20emulator.h"
+#include "windlog.h"
+
+static_assert(k_config_address + sizeof(bridgeconfig) <= k_windlog_start,
+              "the configuration overlaps the wind log");
+
+// ------------------------------------------------------------------------------------------------
+// Calculate the crc of a configuration, not including the crc itself.
+// ------------------------------------------------------------------------------------------------
+static uint16_t config_crc(const bridgeconfig& config) {
+  const uint8_t* data = reinterpret_cast<const uint8_t*>(&config);
+
+  uint16_t crc = 0xffff;
+  for (size_t i = 0; i < offsetof(bridgeconfig, crc); ++i) crc = _crc16_update(crc, data[i]);
+
+  return crc;
+}
+
+// ------------------------------------------------------------------------------------------------
+// Fill in the default configuration.
+// ------------------------------------------------------------------------------------------------
+void config_defaults(bridgeconfig& config) {
+  config.version = k_config_version;
+  config.sample_period = k_wind_speed_sample_t;
+  config.debounce = k_wind_pulse_debounce;
+  config.calibration = k_wind_calibration;
+  config.profile = static_cast<uint8_t>(tx20profile::legacy);
+  config.bit_length = k_frame_bit_length;
+  config.clock_trim = 0;
+  config.nmea = 0;
+#ifdef PATTERNMETER
+  config.pattern = static_cast<uint8_t>(windpattern::speeds);
+#else
+  config.pattern = static_cast<uint8_t>(windpattern::none);
+#endif
+  config.crc = config_crc(config);
+}
+
+// ------------------------------------------------------------------------------------------------
+// Load the configuration from the eeprom.
+// ------------------------------------------------------------------------------------------------
+bool config_load(bridgeconfig& config) {
+  eeprom_read_block(&config, reinterpret_cast<const void*>(k_config_address), sizeof(config));
+
+  if (config.version == k_config_version && config.crc == config_crc(config)) return true;
+
+  config_defaults(config);
+  return false;
+}
+
+// ------------------------------------------------------------------------------------------------
+// Save the configuration to the eeprom.
+// Only the bytes that have changed are written.
+// ------------------------------------------------------------------------------------------------
+void config_save(bridgeconfig& config) {
+  config.version = k_config_version;
+  config.crc = config_crc(config);
+
+  eeprom_update_block(&config, reinterpret_cast<void*>(k_config_address), sizeof(config));
+}
@@ -0,0 +1,60 @@
+// ------------------------------------------------------------------------------------------------
+// The bridge configuration.
+//
+// The tunable settings are kept together in one struct which is stored at the start of the
+// eeprom with a crc. The configuration is loaded into ram once at start up, and if the crc or
+// version doesn't match, the defaults are used instead. Nothing reads the eeprom after that.
+// ------------------------------------------------------------------------------------------------
+#pragma once
+
+#include <Arduino.h>
+
+// The version of the configuration layout. This must be changed whenever bridgeconfig changes,
+// so that an old configuration is not loaded into the new layout.
+constexpr uint8_t k_config_version = 4;
+
+// The eeprom address of the configuration.
+constexpr int k_config_address = 0;
+
+struct bridgeconfig {
+  // The layout version, k_config_version.
+  uint8_t version;
+
+  // The wind speed sample period in milliseconds.
+  uint16_t sample_period;
+
+  // The debounce period for the anemometer pulses in milliseconds.
+  uint8_t debounce;
+
+  // The wind speed calibration in parts per thousand.
+  uint16_t calibration;
+
+  // The TX20 bit rate profile, see tx20profile.
+  uint8_t profile;
+
+  // The length of a TX20 data bit in microseconds for the custom profile.
+  uint16_t bit_length;
+
+  // How fast the board's clock runs compared to a reference, in parts per million.
+  int16_t clock_trim;
+
+  // Non zero to send each sample as an NMEA 0183 sentence on the serial port.
+  uint8_t nmea;
+
+  // The test pattern sent in place of the wind, see windpattern. 0 sends the wind.
+  uint8_t pattern;
+
+  // The crc of everything above.
+  uint16_t crc;
+};
+
+// Fill in the default configuration.
+void config_defaults(bridgeconfig& config);
+
+// Load the configuration from the eeprom.
+// If the stored configuration is missing or corrupt, the defaults are used and false is returned.
+bool config_load(bridgeconfig& config);
+
+// Save the configuration to the eeprom.
+// This waits for each byte to be written, so it takes a few tens of milliseconds.
+void config_save(bridgeconfig& config);
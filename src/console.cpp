@@ -0,0 +1,86 @@
+// ------------------------------------------------------------------------------------------------
+// A simple line based command console.
+// ------------------------------------------------------------------------------------------------
+
+#include "console.h"
+
+// ------------------------------------------------------------------------------------------------
+// Constructor.
+// ------------------------------------------------------------------------------------------------
+console::console(Stream& stream, consolehandler handler)
+  : stream_{stream}, handler_{handler}
+{
+}
+
+// ------------------------------------------------------------------------------------------------
+// Read any waiting characters.
+// Only the characters already received are read, so this never waits. A line can end with
+// either a carriage return or a line feed, and empty lines are ignored.
+// ------------------------------------------------------------------------------------------------
+void console::service()
+{
+  while (stream_.available() > 0)
+  {
+    char c = stream_.read();
+
+    if (c == '\r' || c == '\n')
+    {
+      if (overflow_) stream_.println(F("line too long"));
+      else if (length_ > 0) execute();
+
+      length_ = 0;
+      overflow_ = false;
+    }
+    else if (length_ < k_console_line_length - 1)
+    {
+      line_[length_++] = c;
+    }
+    else
+    {
+      overflow_ = true;
+    }
+  }
+}
+
+// ------------------------------------------------------------------------------------------------
+// Split the next word off a line.
+// The word is terminated in place and args is moved past it.
+// ------------------------------------------------------------------------------------------------
+char* console::next_word(char*& args)
+{
+  while (*args == ' ') ++args;
+  if (*args == '\0') return nullptr;
+
+  char* word = args;
+  while (*args != ' ' && *args != '\0') ++args;
+  if (*args == ' ') *args++ = '\0';
+
+  return word;
+}
+
+// ------------------------------------------------------------------------------------------------
+// Split the next word off a line and convert it to a number.
+// ------------------------------------------------------------------------------------------------
+bool console::next_number(char*& args, long& value)
+{
+  char* word = next_word(args);
+  if (!word) return false;
+
+  char* end;
+  value = strtol(word, &end, 0);
+
+  return *end == '\0';
+}
+
+// ------------------------------------------------------------------------------------------------
+// Split the line into the command and arguments and pass them to the handler.
+// ------------------------------------------------------------------------------------------------
+void console::execute()
+{
+  line_[length_] = '\0';
+
+  char* args = line_;
+  char* command = next_word(args);
+
+  if (command && handler_) handler_(stream_, command, args);
+}
@@ -0,0 +1,58 @@
+// ------------------------------------------------------------------------------------------------
+// A simple line based command console.
+//
+// Characters are read from a stream a few at a time from service(), so the console never waits
+// for input. When a whole line has arrived, it is split into a command word and the rest of the
+// line, and passed to the command handler. The line is held in a fixed buffer so the console
+// doesn't use the heap.
+// ------------------------------------------------------------------------------------------------
+#pragma once
+
+#include <Arduino.h>
+
+// The longest command line that can be entered, including the terminating zero.
+constexpr uint8_t k_console_line_length = 40;
+
+// Signature for the command handler.
+// The command is the first word of the line and args is the rest of the line.
+using consolehandler = void (*)(Print& out, char* command, char* args);
+
+class console
+{
+
+public:
+
+  console(Stream& stream, consolehandler handler);
+
+  // Read any waiting characters and run the command when a line is complete.
+  // Call this from the main loop.
+  void service();
+
+  // Split the next word off a line.
+  // Returns nullptr if there are no more words.
+  static char* next_word(char*& args);
+
+  // Split the next word off a line and convert it to a number.
+  // Returns false if there are no more words or the word isn't a number.
+  static bool next_number(char*& args, long& value);
+
+private:
+
+  // Split the line into the command and arguments and pass them to the handler.
+  void execute();
+
+  // The stream commands are read from and replies are written to.
+  Stream& stream_;
+
+  // The command handler.
+  consolehandler handler_;
+
+  // The line being entered.
+  char line_[k_console_line_length];
+
+  // The number of characters in the line so far.
+  uint8_t length_ = 0;
+
+  // Will be true if the line was too long to fit in the buffer.
+  bool overflow_ = false;
+};
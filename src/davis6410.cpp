@@ -12,26 +12,116 @@
 using microseconds_t = unsigned long;
 using milliseconds_t = unsigned long;
 
-// The counter for the wind pulses.
-// The anenometer spins at 1600 rev/hrs at 1 mph, or 0.444r pulses per second
-// per 1 mph. This means an 8 bit counter should easily suffice for our needs.
-// Using an 8 bit counter has the advantage that we dont need to disable interrutps
-// when reading or clearing the counter.
-static volatile uint8_t wind_speed_pulse_counter = 0;
+// The anenometer spins at 1600 rev/hrs at 1 mph, or 0.444r pulses per second per 1 mph. Each
+// 6410 counts its own pulses, and the interrupts are routed to the right 6410 by a small table
+// of instances. The external interrupts INT0 and INT1 have a slot each. The pin change
+// interrupts fire for any change on any enabled pin of a port, so each pin change slot also
+// holds the pin's input register, its bit and its last level, and a falling edge is found by
+// comparing the levels.
+//
+// The external interrupt vectors are defined here rather than with attachInterrupt(), which
+// saves calling through a function pointer on every pulse. This means attachInterrupt() can't
+// be used anywhere else in the firmware. Only INT0 is taken by default. INT1 and the pin change
+// vectors are only defined with DAVIS6410_INT1 and DAVIS6410_PCINT, so they are free for the rest
+// of the firmware otherwise.
+static davis6410* external_slots[2] = {};
+
+#ifdef DAVIS6410_PCINT
+struct pcintslot {
+  davis6410* instance;
+  volatile uint8_t* input;
+  uint8_t mask;
+  uint8_t group;
+  uint8_t level;
+};
+
+static pcintslot pcint_slots[k_davis6410_pcint_slots] = {};
+#endif
 
-// This variable is needed to debounce the reed switch.
-static volatile milliseconds_t debounce_start_t = 0;
+// --------------------------------------------------------------------------------------------------------------------
+// The trampolines from the interrupt vectors to the 6410s.
+// --------------------------------------------------------------------------------------------------------------------
+struct davis6410isr {
+  static void int0() { external_slots[0]->count_pulse(); }
+  static void int1() { external_slots[1]->count_pulse(); }
+
+#ifdef DAVIS6410_PCINT
+  static void pcint(uint8_t group) {
+    for (pcintslot& slot : pcint_slots) {
+      if (!slot.instance || slot.group != group) continue;
+
+      uint8_t level = *slot.input & slot.mask;
+      if (slot.level && !level) slot.instance->count_pulse();
+      slot.level = level;
+    }
+  }
+#endif
+};
+
+#ifndef DAVIS6410_LEAN_ISR
+
+ISR(INT0_vect) { davis6410isr::int0(); }
+
+#else
+
+// --------------------------------------------------------------------------------------------------------------------
+// The lean isr for INT0.
+// The isr just counts the edge in GPIOR0, which takes a dozen or so cycles and only needs r24.
+// r24 and SREG are kept in GPIOR1 and GPIOR2 rather than on the stack. The general purpose io
+// registers aren't used by anything else, and interrupts don't nest, so nothing else can change
+// them while the isr runs. service() takes the edges from GPIOR0 and debounces them.
+// --------------------------------------------------------------------------------------------------------------------
+ISR(INT0_vect, ISR_NAKED) {
+  asm volatile(
+    "out %[scratch], r24  \n"
+    "in r24, __SREG__     \n"
+    "out %[sreg], r24     \n"
+    "in r24, %[count]     \n"
+    "inc r24              \n"
+    "out %[count], r24    \n"
+    "in r24, %[sreg]      \n"
+    "out __SREG__, r24    \n"
+    "in r24, %[scratch]   \n"
+    "reti                 \n"
+    :
+    : [count] "I"(_SFR_IO_ADDR(GPIOR0)),
+      [scratch] "I"(_SFR_IO_ADDR(GPIOR1)),
+      [sreg] "I"(_SFR_IO_ADDR(GPIOR2)));
+}
+
+#endif
+
+#ifdef DAVIS6410_INT1
+ISR(INT1_vect) { davis6410isr::int1(); }
+#endif
+
+#ifdef DAVIS6410_PCINT
+ISR(PCINT0_vect) { davis6410isr::pcint(0); }
+ISR(PCINT1_vect) { davis6410isr::pcint(1); }
+ISR(PCINT2_vect) { davis6410isr::pcint(2); }
+#endif
 
 // --------------------------------------------------------------------------------------------------------------------
-// The isr for servicing the wind speed reading.
-// The variable debounce_start_t should be cleared before the first interrupt of
-// a sample period.
+// Count a pulse from the anemometer. This is called from the isr.
+// The shared state is only written when a pulse is counted.
 // --------------------------------------------------------------------------------------------------------------------
-static void isr_6410() {
+void davis6410::count_pulse() {
+  if (trace_enabled_) {
+    uint8_t next = (trace_head_ + 1) & (k_davis6410_trace_size - 1);
+    if (next != trace_tail_) {
+      trace_buffer_[trace_head_] = micros();
+      trace_head_ = next;
+    } else {
+      ++trace_overflows_;
+    }
+  }
+
   milliseconds_t now = millis();
-  if (now - debounce_start_t >= k_wind_pulse_debounce) {
-    ++wind_speed_pulse_counter;
-    debounce_start_t = now;
+  if (now - pulse_state_.peek().debounce_start_t >= pulse_debounce_) {
+    pulsestate& state = pulse_state_.write_begin();
+    ++state.count;
+    state.debounce_start_t = now;
+    pulse_state_.write_end();
   }
 }
 
@@ -45,38 +135,121 @@ davis6410::davis6410(int wind_speed_pin, int wind_vane_pin,
       sample_period_{sample_period} {}
 
 // --------------------------------------------------------------------------------------------------------------------
-// The isr for servicing the wind speed reading.
-// The variable debounce_start_t should be cleared before the first interrupt of a sample period.
+// Initialise the hardware and attach the isr for servicing the wind speed reading.
+// The slot is filled in before the interrupt is enabled, so a trampoline never finds an empty
+// slot. Returns false if the pin's interrupt vector isn't built in, see davis6410.h.
 // --------------------------------------------------------------------------------------------------------------------
-void davis6410::initialise() {
+bool davis6410::initialise() {
   pinMode(wind_speed_pin_, INPUT);
-  attachInterrupt(digitalPinToInterrupt(wind_speed_pin_), isr_6410, FALLING);
+
+#ifdef DAVIS6410_HW_COUNTER
+  // Timer 1 counts the falling edges on its clock input. Only one 6410 can use it.
+  if (wind_speed_pin_ == k_davis6410_counter_pin) {
+    static bool counter_in_use = false;
+    if (counter_in_use) return false;
+    counter_in_use = true;
+
+    TIMSK1 = 0;
+    TCCR1A = 0;
+    TCCR1B = 0;
+    TCNT1 = 0;
+    TCCR1B = _BV(CS12) | _BV(CS11);
+
+    hardware_counter_ = true;
+    state_ = davis6410state::idle;
+    initialised_ = true;
+
+    return true;
+  }
+#endif
+
+  int interrupt = digitalPinToInterrupt(wind_speed_pin_);
+
+#ifndef DAVIS6410_INT1
+  if (interrupt == 1) return false;
+#endif
+
+  if (interrupt == 0 || interrupt == 1) {
+    if (external_slots[interrupt]) return false;
+
+#ifdef DAVIS6410_LEAN_ISR
+    if (interrupt == 0) {
+      lean_isr_ = true;
+      GPIOR0 = 0;
+      lean_edges_ = 0;
+    }
+#endif
+
+    // Interrupt on the falling edge.
+    noInterrupts();
+    external_slots[interrupt] = this;
+    EICRA = (EICRA & ~(0x03 << (2 * interrupt))) | (0x02 << (2 * interrupt));
+    EIFR = _BV(interrupt);
+    EIMSK |= _BV(interrupt);
+    interrupts();
+  } else {
+#ifndef DAVIS6410_PCINT
+    return false;
+#else
+    if (!digitalPinToPCICR(wind_speed_pin_)) return false;
+
+    pcintslot* slot = nullptr;
+    for (pcintslot& free_slot : pcint_slots) {
+      if (!free_slot.instance) {
+        slot = &free_slot;
+        break;
+      }
+    }
+    if (!slot) return false;
+
+    uint8_t group = digitalPinToPCICRbit(wind_speed_pin_);
+
+    noInterrupts();
+    slot->input = portInputRegister(digitalPinToPort(wind_speed_pin_));
+    slot->mask = digitalPinToBitMask(wind_speed_pin_);
+    slot->group = group;
+    slot->level = *slot->input & slot->mask;
+    slot->instance = this;
+    *digitalPinToPCMSK(wind_speed_pin_) |= _BV(digitalPinToPCMSKbit(wind_speed_pin_));
+    PCICR |= _BV(group);
+    interrupts();
+#endif
+  }
 
   state_ = davis6410state::idle;
   initialised_ = true;
 
   // Interrupts enabled.
   sei();
+
+  return true;
 }
 
 // --------------------------------------------------------------------------------------------------------------------
 // Start a new sample.
 // The callback will be called when the sample is ready.
+//
+// Once started, the samples run back to back. Each sample period starts the instant the last
+// one ends, so no pulses are missed while the client deals with the last sample. If samples are
+// already running, this just sets the callback for the end of the current sample.
 // --------------------------------------------------------------------------------------------------------------------
 bool davis6410::start_sample(windsamplefn fn, void* context) {
-  // Must be initialised and idle.
-  if (!initialised_ || state_ != davis6410state::idle) return false;
+  // Must be initialised.
+  if (!initialised_) return false;
 
+  // The callback is replaced, even if the sample is just about to be published, so a client that
+  // starts again before the callback still gets the sample.
   sample_fn_ = fn;
   context_ = context;
 
-  state_ = davis6410state::new_sample;
+  if (state_ == davis6410state::idle) state_ = davis6410state::new_sample;
 
   return true;
 }
 
 // --------------------------------------------------------------------------------------------------------------------
 // Abort the current sample if there is one in progress.
+// This also stops the samples running back to back.
 // --------------------------------------------------------------------------------------------------------------------
 void davis6410::abort_sample() {
   // Must be initialised.
@@ -101,6 +274,12 @@ void davis6410::abort_sample() {
 // Service the interface.
 // --------------------------------------------------------------------------------------------------------------------
 void davis6410::service() {
+  if (trace_out_) write_trace();
+
+#ifdef DAVIS6410_LEAN_ISR
+  if (lean_isr_) take_edges();
+#endif
+
   switch (state_) {
     case davis6410state::idle: {
       break;
@@ -108,8 +287,9 @@ void davis6410::service() {
 
     case davis6410state::new_sample: {
       // Start a new sample off.
-      wind_speed_pulse_counter = 0;
+      sample_start_count_ = read_count();
       sample_start_time_ = millis();
+      window_period_ = sample_period_;
 
       state_ = davis6410state::sampling_speed;
 
@@ -118,8 +298,16 @@ void davis6410::service() {
 
     case davis6410state::sampling_speed: {
       // Check if the sample frame has finished.
-      if (millis() - sample_start_time_ >= sample_period_) {
-        sample_pulse_count_ = wind_speed_pulse_counter;
+      if (millis() - sample_start_time_ >= window_period_) {
+        // The next sample starts straight away from the same count, so no pulse can be lost
+        // between the two.
+        uint16_t count = read_count();
+        sample_pulse_count_ = count - sample_start_count_;
+        sample_start_count_ = count;
+
+        sample_start_time_ += window_period_;
+        last_period_ = window_period_;
+        window_period_ = sample_period_;
 
         // Sample the wind direction.
         state_ = davis6410state::sampling_direction;
@@ -132,17 +320,29 @@ void davis6410::service() {
       // Read the wind direction directly.
       sample_direction_ = analogRead(wind_vane_pin_);
 
+      if (trace_out_) {
+        trace_out_->print(F("V "));
+        trace_out_->print(micros());
+        trace_out_->print(' ');
+        trace_out_->println(sample_direction_);
+      }
+
       state_ = davis6410state::send_frame;
 
       break;
     }
 
     case davis6410state::send_frame: {
-      // Ready for another sample.
-      state_ = davis6410state::idle;
+      // The next sample is already being counted.
+      state_ = davis6410state::sampling_speed;
+
+      publish_sample();
 
       // Let the client know the sampled wind speed and direction.
-      if (sample_fn_) sample_fn_(context_);
+      // The callback is only used once, the client calls start_sample() again for the next.
+      windsamplefn fn = sample_fn_;
+      sample_fn_ = nullptr;
+      if (fn) fn(context_);
 
       break;
     }
@@ -150,31 +350,136 @@ void davis6410::service() {
 }
 
 // --------------------------------------------------------------------------------------------------------------------
-// Return the last sampled wind speed.
-// The calcualtion from pulse count to mph uses the formula V=P(2.25/T). If we
-// find that it is not accurate enough we could use calibration tables etc for
-// greateer accuracy.
+// Return the number of pulses counted so far.
+// Timer 1 is a 16 bit counter which wraps just like the isr's count. The hardware latches the
+// high byte when the low byte is read, so the count is read in one go.
+// --------------------------------------------------------------------------------------------------------------------
+uint16_t davis6410::read_count() {
+#ifdef DAVIS6410_HW_COUNTER
+  if (hardware_counter_) return TCNT1;
+#endif
+
+#ifdef DAVIS6410_LEAN_ISR
+  if (lean_isr_) return lean_count_;
+#endif
+
+  return pulse_state_.read().count;
+}
+
+#ifdef DAVIS6410_LEAN_ISR
+
+// --------------------------------------------------------------------------------------------------------------------
+// Take the edges counted by the lean isr and debounce them.
+// GPIOR0 is read with a single instruction, so it doesn't need interrupts disabled. It only
+// holds 8 bits, but service() is called far more often than 256 pulses can arrive. The edges
+// since the last look can't be told apart, so they are debounced as a group, where no more
+// than one pulse is counted for each debounce period since the last counted pulse. A burst of
+// bounces is counted as one pulse.
+// --------------------------------------------------------------------------------------------------------------------
+void davis6410::take_edges() {
+  uint8_t edges = GPIOR0;
+  uint8_t count = edges - lean_edges_;
+  if (!count) return;
+
+  lean_edges_ = edges;
+
+  milliseconds_t now = millis();
+  uint8_t debounce = pulse_debounce_ ? pulse_debounce_ : 1;
+  milliseconds_t allowed = (now - lean_pulse_t_) / debounce;
+  if (allowed == 0) return;
+
+  if (count > allowed) count = allowed;
+  lean_count_ += count;
+  lean_pulse_t_ = now;
+}
+
+#endif
+
+// --------------------------------------------------------------------------------------------------------------------
+// Convert pulses counted over a period to mph.
+// The calcualtion from pulse count to mph uses the formula V=P(2.25/T), scaled by the
+// calibration. If we find that it is not accurate enough we could use calibration tables
+// etc for greateer accuracy.
 // --------------------------------------------------------------------------------------------------------------------
-float davis6410::get_wind_mph() const {
-  return sample_pulse_count_ * 2.25f * 1000.f /
-         static_cast<float>(sample_period_);
+float davis6410::calculate_wind_mph(uint16_t pulses, unsigned long period) const {
+  return pulses * 2.25f * calibration_ / static_cast<float>(period);
+}
+
+// --------------------------------------------------------------------------------------------------------------------
+// Set the debounce period for the wind speed pulses.
+// --------------------------------------------------------------------------------------------------------------------
+void davis6410::set_debounce(uint8_t debounce) {
+  pulse_debounce_ = debounce;
+}
+
+uint8_t davis6410::debounce() const {
+  return pulse_debounce_;
 }
 
 // --------------------------------------------------------------------------------------------------------------------
-// Return the last sampled wind direction.
-// The calcualtio from pulse count to mph uses the formula V=P(2.25/T). If we
-// find that it is not accurate enough we could use calibration tables etc for
-// greateer accuracy.
+// Publish a new sample.
+// The wind vane reading is mapped to 16 directions. Readings near the top of the range are
+// just west of north and wrap round to 0.
 // --------------------------------------------------------------------------------------------------------------------
-int davis6410::get_wind_direction() const {
-  return (sample_direction_ + 31) >> 6;
+void davis6410::publish_sample() {
+  const windsample& last = samples_[published_];
+  windsample& sample = samples_[published_ ^ 1];
+
+  sample.sequence = last.sequence + 1;
+  sample.pulses = sample_pulse_count_;
+  sample.period = last_period_;
+  sample.vane = sample_direction_;
+  sample.mph = calculate_wind_mph(sample_pulse_count_, last_period_);
+  sample.direction = ((sample_direction_ + 31) >> 6) & 0x0f;
+
+  published_ ^= 1;
 }
 
 // --------------------------------------------------------------------------------------------------------------------
-// Return the last sampled anenometer pulse count.
-// Each pulse is one revolution of the wind cups.
+// Start or stop recording a pulse trace.
+// A trace starts with a header giving the settings in use, so that it can be replayed later.
+// The edges can't be recorded when they are counted by timer 1, so the trace only holds the
+// wind vane readings.
 // --------------------------------------------------------------------------------------------------------------------
-uint8_t davis6410::get_pulses() const {
-  return sample_pulse_count_;
+void davis6410::set_trace(Print* out) {
+  trace_enabled_ = false;
+  trace_head_ = trace_tail_ = 0;
+  trace_overflows_ = 0;
+
+  trace_out_ = out;
+
+  if (trace_out_) {
+    trace_out_->print(F("# trace sample_period="));
+    trace_out_->print(sample_period_);
+    trace_out_->print(F(" debounce="));
+    trace_out_->println(pulse_debounce_);
+    if (hardware_counter_) trace_out_->println(F("# hardware counter, no edges"));
+#ifdef DAVIS6410_LEAN_ISR
+    if (lean_isr_) trace_out_->println(F("# lean isr, no edges"));
+#endif
+
+    trace_enabled_ = true;
+  }
 }
 
+// --------------------------------------------------------------------------------------------------------------------
+// Write any recorded edges to the trace output.
+// Lost edges are reported so that a replay knows the trace is incomplete.
+// --------------------------------------------------------------------------------------------------------------------
+void davis6410::write_trace() {
+  while (trace_tail_ != trace_head_) {
+    trace_out_->print(F("E "));
+    trace_out_->println(trace_buffer_[trace_tail_]);
+    trace_tail_ = (trace_tail_ + 1) & (k_davis6410_trace_size - 1);
+  }
+
+  if (trace_overflows_) {
+    noInterrupts();
+    uint8_t lost = trace_overflows_;
+    trace_overflows_ = 0;
+    interrupts();
+
+    trace_out_->print(F("# lost "));
+    trace_out_->println(lost);
+  }
+}
@@ -9,6 +9,7 @@
 
 #include <Arduino.h>
 
+#include "seqlock.h"
 #include "windmeterintf.h"
 
 // This is the default duration over which the wind speed is calculated.
@@ -24,10 +25,47 @@ constexpr unsigned long k_wind_speed_sample_t = 2250;
 // period), hece something in the range 1 to 20 ms will do.
 constexpr unsigned long k_wind_pulse_debounce = 18;
 
+// The default calibration for the wind speed, in parts per thousand.
+// A value of 1000 means the wind speed is given by the formula in the 6410's spec.
+constexpr uint16_t k_wind_calibration = 1000;
+
+// With DAVIS6410_HW_COUNTER defined, a 6410 on the timer 1 clock input (pin 5) has its pulses
+// counted by timer 1 rather than an isr. The reed switch can't be debounced in software, so it
+// needs an RC filter in front of the pin, eg 10K and 100 nF which is about 1 ms, and the
+// debounce setting has no effect. The bit scheduler moves to timer 2, see bitscheduler.h.
+constexpr int k_davis6410_counter_pin = 5;
+
+// With DAVIS6410_LEAN_ISR defined, a 6410 on INT0 (pin 2) uses a hand written isr which only
+// counts the edge in a general purpose io register. This keeps the pulses from holding up the
+// bit scheduler. The edges are debounced by service() instead, and can't be traced.
+
+// A 6410 on INT0 (pin 2) is always supported. With DAVIS6410_INT1 defined a 6410 can also use
+// INT1 (pin 3), and with DAVIS6410_PCINT defined any other pin can be used with a pin change
+// interrupt. The vectors are only defined when they are wanted, so the rest of the firmware can
+// use them otherwise. Without the option, initialise() returns false for those pins.
+
+// The number of 6410s that can use pin change interrupts, as opposed to the external
+// interrupts on pins 2 and 3. Each one uses a few bytes of ram for its slot.
+constexpr uint8_t k_davis6410_pcint_slots = 2;
+
+// The size of the pulse trace buffer for each 6410. This must be a power of 2.
+constexpr uint8_t k_davis6410_trace_size = 8;
+
+// The state shared with the isr, see pulse_state_.
+struct pulsestate {
+  // The number of debounced pulses so far.
+  uint16_t count;
+
+  // The time of the last counted pulse, which is needed to debounce the reed switch.
+  unsigned long debounce_start_t;
+};
+
 // The state for the 6410.
 //    idle - the 6410 is doing nothing
 //    new_sample - a new sample has been requested
-//    sampling_speed -
+//    sampling_speed - counting the anemometer pulses
+//    sampling_direction - the sample period is over and the wind vane is read
+//    send_frame - the sample is reported, while the next sample is counted
 enum class davis6410state {
   idle,
   new_sample,
@@ -47,37 +85,86 @@ class davis6410 : public windmeterintf {
             unsigned long sample_period = 2250);
 
   // Initialise the hardware resources and set up the isr.
-  // This must be done once before the 6410 can be used.
-  void initialise();
+  // This must be done once before the 6410 can be used. Pins 2 and 3 use the external
+  // interrupts, any other pin uses a pin change interrupt. Returns false if the pin can't
+  // interrupt, its interrupt is already in use, or all the pin change slots are taken. With
+  // the hardware counter, pin 5 is counted by timer 1 instead.
+  bool initialise();
 
   // Service the interface.
   void service();
 
   // Start a new sample.
-  // The callback will be called when the sample is ready.
+  // The callback will be called when the sample is ready. Samples then run back to back until
+  // abort_sample() is called, and calling start_sample() again sets the callback for the next.
   // Returns true if the sample was started, false otherwise.
   bool start_sample(windsamplefn fn, void* context) override;
 
   // Abort the current sample if there is one in progress.
   void abort_sample() override;
 
-  // Return the last sampled wind speed.
-  float get_wind_mph() const override;
-
-  // Return the last sampled wind direction.
-  // Returns the direction as 0=N, E=4 etc.
-  int get_wind_direction() const override;
-
-  // Return the last sampled anenometer pulse count.
-  uint8_t get_pulses() const;
+  // Return the last sample.
+  const windsample& get_sample() const override { return samples_[published_]; }
 
   // Return the state of the Davis 6410.
   davis6410state state() const { return state_; }
 
+  // Set the duration in milliseconds of the sample period.
+  // A change takes effect from the next sample.
+  void set_sample_period(unsigned long sample_period) { sample_period_ = sample_period; }
+  unsigned long sample_period() const { return sample_period_; }
+
+  // Set the debounce period in milliseconds for the wind speed pulses.
+  void set_debounce(uint8_t debounce);
+  uint8_t debounce() const;
+
+  // Set the wind speed calibration in parts per thousand.
+  // The wind speed from the 6410's formula is scaled by this.
+  void set_calibration(uint16_t calibration) { calibration_ = calibration; }
+  uint16_t calibration() const { return calibration_; }
+
+  // Start or stop recording a pulse trace.
+  // While recording, the time of every anemometer edge (before debouncing) and every wind vane
+  // reading is written to the output, one per line,
+  //    E <micros>
+  //    V <micros> <adc>
+  // Lines starting with # are comments, and any other lines on the output should be ignored.
+  // Pass nullptr to stop recording.
+  void set_trace(Print* out);
+
  private:
-  // Convert pulses to mph.
-  // Note, this may in the future apply calibration data to the result.
-  float calculate_wind_mph(uint8_t pulses) const;
+  // The interrupt trampolines, see davis6410.cpp.
+  friend struct davis6410isr;
+
+  // Count a pulse from the anemometer. This is called from the isr.
+  void count_pulse();
+
+  // Return the number of pulses counted so far.
+  uint16_t read_count();
+
+#ifdef DAVIS6410_LEAN_ISR
+  // Take the edges counted by the lean isr and debounce them.
+  void take_edges();
+
+  // Will be true if the pulses are counted by the lean isr.
+  bool lean_isr_ = false;
+
+  // The edge count from the lean isr when it was last taken.
+  uint8_t lean_edges_ = 0;
+
+  // The number of debounced pulses and the time of the last one.
+  uint16_t lean_count_ = 0;
+  unsigned long lean_pulse_t_ = 0;
+#endif
+
+  // Write any recorded edges to the trace output.
+  void write_trace();
+
+  // Convert pulses counted over a period to mph.
+  float calculate_wind_mph(uint16_t pulses, unsigned long period) const;
+
+  // Publish a new sample.
+  void publish_sample();
 
   // A digital pin is used to counting the anenometer pulses.
   const int wind_speed_pin_;
@@ -88,24 +175,67 @@ class davis6410 : public windmeterintf {
   // The duration in milliseconds of the sample period.
   unsigned long sample_period_;
 
+  // The wind speed calibration in parts per thousand.
+  uint16_t calibration_ = k_wind_calibration;
+
+  // The sample period in use for the current sample, and the one used for the last sample.
+  // These only change at the end of a sample, so a new sample period can be set at any time.
+  unsigned long window_period_ = 0;
+  unsigned long last_period_ = 0;
+
   // The resources must be initialised before the 6410 can be read.
   bool initialised_ = false;
 
+  // Will be true if the pulses are counted by timer 1.
+  bool hardware_counter_ = false;
+
   // The state of the interface.
   davis6410state state_ = davis6410state::idle;
 
   // This is the start time in milliseconds of the current sample frame.
   unsigned long sample_start_time_;
 
+  // This is the pulse counter value at the start of the current sample frame.
+  uint16_t sample_start_count_ = 0;
+
   // This is the pulse count for the last sample frame.
-  uint8_t sample_pulse_count_;
+  uint16_t sample_pulse_count_;
 
   // This is the last analogue reading for the wind direction.
   int sample_direction_;
 
+  // The published samples.
+  // A new sample is built in the slot that isn't published and then published by switching
+  // slots, so a reference to the last sample stays valid for a whole sample period.
+  windsample samples_[2] = {};
+  uint8_t published_ = 0;
+
   // The wind sample callback function.
   windsamplefn sample_fn_ = nullptr;
 
   // A context that is passed to the callback function.
   void* context_ = nullptr;
+
+  // The output for the pulse trace, or nullptr if a trace is not being recorded.
+  Print* trace_out_ = nullptr;
+
+  // The pulse count and the time of the last pulse, shared with the isr.
+  // The count is never cleared, instead service() remembers the count at the start of each
+  // sample and takes the difference, so the isr is the only thing that writes to it. It is read
+  // with a sequence lock so that interrupts don't need to be disabled.
+  seqlock<pulsestate> pulse_state_;
+
+  // The debounce period in milliseconds. This is a single byte so it can be changed without
+  // disabling interrupts.
+  volatile uint8_t pulse_debounce_ = k_wind_pulse_debounce;
+
+  // When a pulse trace is being recorded, the isr puts the time of each edge in this buffer
+  // and service() writes them out.
+  volatile unsigned long trace_buffer_[k_davis6410_trace_size];
+  volatile uint8_t trace_head_ = 0;
+  volatile uint8_t trace_tail_ = 0;
+  volatile bool trace_enabled_ = false;
+
+  // The number of edges lost because the trace buffer was full.
+  volatile uint8_t trace_overflows_ = 0;
 };
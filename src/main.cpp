@@ -1,16 +1,30 @@
 
 #include <Arduino.h>
 
+#include "config.h"
+#include "console.h"
 #include "davis6410.h"
 #include "tx20emulator.h"
+#include "tx20frame.h"
 #include "led.h"
+#include "nmeaencoder.h"
+#include "nullstream.h"
+#include "patternmeter.h"
+#include "stackmonitor.h"
+#include "windlog.h"
+#include "windmeterhub.h"
 
 // ------------------------------------------------------------------------------------------------
 // ------------------------------------------------------------------------------------------------
 
 // The pin the front panel led is attached to.
-// The led is flashed to show when a wind sample has been taken.
+// The led is flashed to show when a wind sample has been taken. Pin 9 is a TxD pin when the
+// timer compare outputs send the frames, so the led moves to pin 6.
+#ifdef BITSCHEDULER_OUTPUT_COMPARE
+constexpr int k_front_panel_ped_pin = 6;
+#else
 constexpr int k_front_panel_ped_pin = 9;
+#endif
 
 // The front panel led is flashed for this number of milliseconds when a sample has been taken.
 constexpr uint16_t k_led_sample_flash_ms = 333;
@@ -19,37 +33,104 @@ constexpr uint16_t k_led_sample_flash_ms = 333;
 // The wind sensor pin is used to count pulses from the anenometer using interrupts. We muse us
 // a pin that supports interrupts. The wind direction is measured by sampling the wind vane
 // potentiometer in the 6410. An analoue pin is used to do this.
+// With the hardware counter (see davis6410.h), the pulses are counted on pin 5 instead.
+#ifdef DAVIS6410_HW_COUNTER
+constexpr int k_wind_sensor_pin = k_davis6410_counter_pin;
+#else
 constexpr int k_wind_sensor_pin = 2;
+#endif
 constexpr int k_wind_direction_pin = A0;
 
 // The TX20  emulator uses two digital pins for Dtr and Txd which are defined here.
 // Dtr is an input and controls whether the TX20 should sample and send wind data.
 // Txd is an output and is used to send the sampled wind speed and direction.
+// When the timer compare outputs send the frames (see bitscheduler.h), TxD must be on pin 9 or
+// pin 10. When the usart sends them, TxD must be on pin 1.
 constexpr int k_dtr_pin = 3;
+#if defined(BITSCHEDULER_OUTPUT_COMPARE)
+constexpr int k_txd_pin = k_bitscheduler_oc1a_pin;
+#elif defined(BITSCHEDULER_USART)
+constexpr int k_txd_pin = k_bitscheduler_usart_pin;
+#else
 constexpr int k_txd_pin = 4;
+#endif
+
+// The second TX20 emulator sends the same wind samples to a second reader. Its Dtr is pulled
+// up, so it stays disabled unless something is attached. When the usart sends the frames there
+// is only one TxD, so the second emulator can't be initialised and does nothing.
+constexpr int k_second_dtr_pin = 7;
+#ifdef BITSCHEDULER_OUTPUT_COMPARE
+constexpr int k_second_txd_pin = k_bitscheduler_oc1b_pin;
+#else
+constexpr int k_second_txd_pin = 8;
+#endif
 
 // ------------------------------------------------------------------------------------------------
 // ------------------------------------------------------------------------------------------------
 
+// The bridge configuration.
+// This is loaded from the eeprom in setup() and is used to set the timing of the 6410 interface
+// and the tx20 emulator.
+bridgeconfig config;
+
 // Create the interface for reading the 6410.
 // We'll use the default sampling period which is 2250 milliseconds. This is a convenient
 // duration because it means that the wind speed in mph is simply the number of pulses in the sample.
 davis6410 wind_meter(k_wind_sensor_pin, k_wind_direction_pin);
 
-// Create the tx20 emulator for sending tx20 formatted wind data.
+// Create the test pattern meter.
+// When a pattern is chosen with 'set pattern', the emulators send the pattern in place of the
+// wind so that whatever reads the frames can be checked against known values.
+patternmeter pattern_meter;
+
+// Share the wind meter between the tx20 emulators.
+windmeterhub wind_meter_hub(wind_meter);
+
+// Create the tx20 emulators for sending tx20 formatted wind data.
+// The first emulator's events drive the led, the log and the console. The second one just
+// sends frames.
 tx20emulator tx20_emulator(k_dtr_pin, k_txd_pin);
+tx20emulator second_tx20_emulator(k_second_dtr_pin, k_second_txd_pin);
 
 // Create the controller for the front panel led.
 led panel_led(k_front_panel_ped_pin);
 
+// Create the wind history log.
+// Every sample sent on Txd is also added to the log, which keeps a day or so of 10 minute
+// records in the eeprom. The console command 'history' prints the log.
+windlog wind_log;
+
+// Create the monitor for the free ram between the heap and the stack.
+// The smallest gap seen so far is included in the console log.
+stackmonitor stack_monitor;
+
+// The serial port for the console, the logging and the NMEA sentences.
+// When the usart sends the TX20 frames there is no serial port, and everything written to it is
+// thrown away.
+#ifdef BITSCHEDULER_USART
+nullstream serial_port;
+#else
+HardwareSerial& serial_port = Serial;
+#endif
+
+// Create the NMEA 0183 encoder.
+// When it is turned on with 'set nmea 1', every sample sent on Txd is also sent as a $WIMWV
+// sentence on the serial port for a marine display or logger, in place of the sample log line.
+nmeaencoder nmea_encoder(serial_port);
+
+// Create the command console on the serial port.
+// See console_command() for the commands.
+void console_command(Print& out, char* command, char* args);
+console serial_console(serial_port, console_command);
+
 // ------------------------------------------------------------------------------------------------
 // This is the event handler for the tx20 emulator events.
 // What we do is flash the led when a wind sample has been taken and the data
 // is being sent out on the Txd line.
 // ------------------------------------------------------------------------------------------------
-void tx20_event_handler(tx20event event) {
+void tx20_event_handler(const tx20eventinfo& event) {
 
-  switch (event) {
+  switch (event.event) {
 
     case tx20event::start_data_frame: {
         // Flash the led when data is being sent out on Txd.
@@ -59,14 +140,32 @@ void tx20_event_handler(tx20event event) {
 
     case tx20event::end_sample: {
         // At this point, the wind has been sampled and the data sent on Txd.
-        // As an example, the wind sample is logged to the console.
-        uint8_t pulses = wind_meter.get_pulses();
-        float mph = wind_meter.get_wind_mph();
-        int direction = wind_meter.get_wind_direction();
+        // The same sample is logged and either sent as an NMEA sentence or, as an example,
+        // printed on the console.
+        // The event says which sample was sent. The wind meter publishes a new sample once a
+        // sample period, so it is still the current sample when the event is dispatched.
+        // A test pattern isn't wind, so it is kept out of the log and the NMEA sentences, and
+        // is only printed.
+        const windsample& sample = wind_meter_hub.port(0)->get_sample();
+        bool wind = static_cast<windpattern>(config.pattern) == windpattern::none;
+
+        if (wind) wind_log.add_sample(mph_to_tx20_units(sample.mph), sample.direction);
 
-        Serial.print(String(F("pulses=")) + String(pulses));
-        Serial.print(String(F(", mph=")) + String(mph));
-        Serial.println(String(F(", direction=")) + String(direction));
+        if (wind && config.nmea) {
+          nmea_encoder.write(sample);
+          break;
+        }
+
+        serial_port.print(F("sample="));
+        serial_port.print(sample.sequence);
+        serial_port.print(F(", pulses="));
+        serial_port.print(sample.pulses);
+        serial_port.print(F(", mph="));
+        serial_port.print(sample.mph);
+        serial_port.print(F(", direction="));
+        serial_port.print(sample.direction);
+        serial_port.print(F(", free="));
+        serial_port.println(stack_monitor.min_free());
 
         break;
       }
@@ -80,36 +179,377 @@ void tx20_event_handler(tx20event event) {
   }
 }
 
+// ------------------------------------------------------------------------------------------------
+// Console commands that take too long to run in one go are run a step at a time from the main
+// loop, so they don't hold up the emulators. Only one runs at a time, and the console carries on
+// taking commands while it does.
+// ------------------------------------------------------------------------------------------------
+enum class consolejob : uint8_t {
+  none,
+  selftest,
+  history
+};
+
+// The room a history record needs in the serial port's buffer, "4095,170,409.5,409.5,15\r\n".
+constexpr int k_history_line_length = 25;
+
+static consolejob console_job = consolejob::none;
+static Print* console_job_out = nullptr;
+static tx20selftest frame_selftest;
+static int history_record = 0;
+
+static void start_console_job(Print& out, consolejob job) {
+  console_job = job;
+  console_job_out = &out;
+}
+
+// ------------------------------------------------------------------------------------------------
+// Run the next step of the console job.
+// The self test runs a small batch of checks per pass, and the bit timing checks, which are
+// quick, once it has finished. The history prints one record per pass, and only when it fits in
+// the serial port's buffer, so printing never waits for the uart.
+// ------------------------------------------------------------------------------------------------
+static void service_console_job() {
+  Print& out = *console_job_out;
+
+  switch (console_job) {
+    case consolejob::none:
+      break;
+
+    case consolejob::selftest:
+      if (tx20_selftest_step(frame_selftest)) break;
+
+      out.print(F("tx20 self test failures="));
+      out.print(frame_selftest.failures);
+      out.print(F(", timing failures="));
+      out.println(tx20_timing_selftest());
+      console_job = consolejob::none;
+      break;
+
+    case consolejob::history:
+      if (history_record >= wind_log.count()) {
+        console_job = consolejob::none;
+      } else if (out.availableForWrite() >= k_history_line_length) {
+        wind_log.dump_record(out, history_record++);
+      }
+      break;
+  }
+}
+
+// ------------------------------------------------------------------------------------------------
+// These are the parameters that can be read and changed from the console.
+// The table lives in flash to save ram, and each entry gives the name, the allowed range and the
+// functions to get and set the value. The values are held in the configuration.
+// ------------------------------------------------------------------------------------------------
+struct parameter {
+  const char* name;
+  long min;
+  long max;
+  long (*get)();
+  void (*set)(long value);
+};
+
+static void apply_config();
+
+static long get_period() { return config.sample_period; }
+static void set_period(long value) { config.sample_period = value; }
+static long get_debounce() { return config.debounce; }
+static void set_debounce(long value) { config.debounce = value; }
+static long get_bit_length() { return config.bit_length; }
+static void set_bit_length(long value) { config.bit_length = value; }
+static long get_calibration() { return config.calibration; }
+static void set_calibration(long value) { config.calibration = value; }
+static long get_profile() { return config.profile; }
+static void set_profile(long value) { config.profile = value; }
+static long get_clock_trim() { return config.clock_trim; }
+static void set_clock_trim(long value) { config.clock_trim = value; }
+static long get_nmea() { return config.nmea; }
+static void set_nmea(long value) { config.nmea = value; }
+static long get_pattern() { return config.pattern; }
+static void set_pattern(long value) { config.pattern = value; }
+
+static const char k_period_name[] PROGMEM = "period";
+static const char k_debounce_name[] PROGMEM = "debounce";
+static const char k_bit_length_name[] PROGMEM = "bitlength";
+static const char k_calibration_name[] PROGMEM = "calibration";
+static const char k_profile_name[] PROGMEM = "profile";
+static const char k_clock_trim_name[] PROGMEM = "trim";
+static const char k_nmea_name[] PROGMEM = "nmea";
+static const char k_pattern_name[] PROGMEM = "pattern";
+
+static const parameter k_parameters[] PROGMEM = {
+  { k_period_name, 500, 60000, get_period, set_period },
+  { k_debounce_name, 1, 100, get_debounce, set_debounce },
+  { k_bit_length_name, 500, 10000, get_bit_length, set_bit_length },
+  { k_calibration_name, 500, 2000, get_calibration, set_calibration },
+  { k_profile_name, 0, 2, get_profile, set_profile },
+  { k_clock_trim_name, -k_max_clock_trim, k_max_clock_trim, get_clock_trim, set_clock_trim },
+  { k_nmea_name, 0, 1, get_nmea, set_nmea },
+  { k_pattern_name, 0, 5, get_pattern, set_pattern },
+};
+
+// ------------------------------------------------------------------------------------------------
+// Find a parameter by name and copy its table entry out of flash.
+// ------------------------------------------------------------------------------------------------
+static bool find_parameter(const char* name, parameter& param) {
+  for (const parameter& entry : k_parameters) {
+    memcpy_P(&param, &entry, sizeof(param));
+    if (strcmp_P(name, param.name) == 0) return true;
+  }
+
+  return false;
+}
+
+// ------------------------------------------------------------------------------------------------
+// Print a parameter as name=value.
+// ------------------------------------------------------------------------------------------------
+static void print_parameter(Print& out, const parameter& param) {
+  out.print(reinterpret_cast<const __FlashStringHelper*>(param.name));
+  out.print('=');
+  out.println(param.get());
+}
+
+// ------------------------------------------------------------------------------------------------
+// Print the counters for an emulator.
+// ------------------------------------------------------------------------------------------------
+static void print_stats(Print& out, const tx20emulator& emulator) {
+  const tx20stats& stats = emulator.stats();
+
+  out.print(F("frames="));
+  out.print(stats.frames);
+  out.print(F(", aborts="));
+  out.print(stats.aborts);
+  out.print(F(", max latency="));
+  out.print(stats.max_latency);
+  out.print(F(" us, max bit late="));
+  out.print(emulator.max_bit_late());
+  out.print(F(" us, max first frame="));
+  out.print(stats.max_first_frame / 1000);
+  out.print(F(" ms, max stop="));
+  out.print(stats.max_abort / 1000);
+  out.print(F(" ms, wasted samples="));
+  out.print(stats.wasted_samples);
+}
+
+// ------------------------------------------------------------------------------------------------
+// Handle a command from the console.
+//
+//    help                 - list the commands
+//    get [name]           - print one or all of the parameters
+//    set <name> <value>   - change a parameter
+//    stats                - print the counters
+//    selftest             - run the tx20 frame encoder and bit timing self tests
+//    history              - print the history log
+//    trace on|off         - start or stop recording a pulse trace
+//    mem                  - print the free ram
+//    calibrate <us>       - set the clock trim from the measured length of a frame
+//    save                 - save the parameters to the eeprom
+//    defaults             - go back to the default parameters (use save to keep them)
+//
+// The parameters are the sample period (ms), the pulse debounce (ms), the wind speed calibration
+// (parts per thousand), the TX20 bit rate profile (0=genuine 1.22 ms, 1=legacy 2 ms, 2=custom),
+// the custom bit length (us), the clock trim (parts per million), whether NMEA sentences are
+// sent (0=off, 1=on) and the test pattern sent in place of the wind (0=off, 1=speeds,
+// 2=directions, 3=ramp, 4=checksums, 5=simulated wind).
+// ------------------------------------------------------------------------------------------------
+void console_command(Print& out, char* command, char* args) {
+  parameter param;
+
+  if (strcmp_P(command, PSTR("help")) == 0) {
+    out.println(F("get [name], set <name> <value>, calibrate <us>, save, defaults"));
+    out.println(F("stats, selftest, history, trace on|off, mem"));
+    out.println(F("parameters: period, debounce, calibration, profile, bitlength, trim, nmea,"));
+    out.println(F("  pattern"));
+  }
+
+  else if (strcmp_P(command, PSTR("get")) == 0) {
+    char* name = console::next_word(args);
+
+    if (!name) {
+      for (const parameter& entry : k_parameters) {
+        memcpy_P(&param, &entry, sizeof(param));
+        print_parameter(out, param);
+      }
+    } else if (find_parameter(name, param)) {
+      print_parameter(out, param);
+    } else {
+      out.println(F("unknown parameter"));
+    }
+  }
+
+  else if (strcmp_P(command, PSTR("set")) == 0) {
+    char* name = console::next_word(args);
+    long value;
+
+    if (!name || !find_parameter(name, param)) {
+      out.println(F("unknown parameter"));
+    } else if (!console::next_number(args, value) || value < param.min || value > param.max) {
+      out.print(F("value must be "));
+      out.print(param.min);
+      out.print(F(" to "));
+      out.println(param.max);
+    } else {
+      param.set(value);
+      apply_config();
+      print_parameter(out, param);
+    }
+  }
+
+  else if (strcmp_P(command, PSTR("stats")) == 0) {
+    print_stats(out, tx20_emulator);
+    out.print(F(", event overflows="));
+    out.println(tx20_emulator.event_overflows());
+    out.print(F("second "));
+    print_stats(out, second_tx20_emulator);
+    out.println();
+
+    out.print(F("sample="));
+    out.print(wind_meter_hub.port(0)->get_sample().sequence);
+    out.print(F(", log records="));
+    out.print(wind_log.count());
+    out.print(F(", nmea dropped="));
+    out.print(nmea_encoder.dropped());
+    out.print(F(", min free="));
+    out.println(stack_monitor.min_free());
+  }
+
+  else if (strcmp_P(command, PSTR("selftest")) == 0) {
+    frame_selftest = tx20selftest();
+    start_console_job(out, consolejob::selftest);
+  }
+
+  else if (strcmp_P(command, PSTR("history")) == 0) {
+    wind_log.dump_header(out);
+    history_record = 0;
+    start_console_job(out, consolejob::history);
+  }
+
+  else if (strcmp_P(command, PSTR("trace")) == 0) {
+    char* mode = console::next_word(args);
+    wind_meter.set_trace(mode && strcmp_P(mode, PSTR("on")) == 0 ? &out : nullptr);
+  }
+
+  else if (strcmp_P(command, PSTR("mem")) == 0) {
+    out.print(F("free ram="));
+    out.print(stack_monitor.free_now());
+    out.print(F(", min="));
+    out.println(stack_monitor.min_free());
+  }
+
+  else if (strcmp_P(command, PSTR("calibrate")) == 0) {
+    long measured;
+
+    if (console::next_number(args, measured) && measured > 0) {
+      config.clock_trim = tx20_emulator.calibrate_clock(measured);
+      apply_config();
+      out.print(F("trim="));
+      out.println(config.clock_trim);
+    } else {
+      out.println(F("give the measured frame length in us"));
+    }
+  }
+
+  else if (strcmp_P(command, PSTR("save")) == 0) {
+    config_save(config);
+    out.println(F("saved"));
+  }
+
+  else if (strcmp_P(command, PSTR("defaults")) == 0) {
+    config_defaults(config);
+    apply_config();
+    out.println(F("defaults set"));
+  }
+
+  else {
+    out.println(F("unknown command, try help"));
+  }
+}
+
+// ------------------------------------------------------------------------------------------------
+// Pass the configuration to the 6410 interface, the pattern meter and the tx20 emulators.
+// A pattern starts from the beginning when it is chosen.
+// ------------------------------------------------------------------------------------------------
+static void apply_config() {
+  wind_meter.set_sample_period(config.sample_period);
+  wind_meter.set_debounce(config.debounce);
+  wind_meter.set_calibration(config.calibration);
+
+  windpattern pattern = static_cast<windpattern>(config.pattern);
+  pattern_meter.set_sample_period(config.sample_period);
+  if (pattern != pattern_meter.pattern()) pattern_meter.set_pattern(pattern);
+  if (pattern == windpattern::none)
+    wind_meter_hub.set_meter(wind_meter);
+  else
+    wind_meter_hub.set_meter(pattern_meter);
+
+  duration bit_length =
+    tx20_profile_bit_length(static_cast<tx20profile>(config.profile), config.bit_length);
+  tx20_emulator.set_bit_length(bit_length);
+  tx20_emulator.set_clock_trim(config.clock_trim);
+  second_tx20_emulator.set_bit_length(bit_length);
+  second_tx20_emulator.set_clock_trim(config.clock_trim);
+}
+
 // ------------------------------------------------------------------------------------------------
 // Set up initaialse the 6410 interface and tx20 emulator.
 // ------------------------------------------------------------------------------------------------
 void setup() {
 
+  // Paint the free ram before anything else uses the stack or heap.
+  stack_monitor.initialise();
+
+#ifndef BITSCHEDULER_USART
   Serial.begin(115200);
+#endif
 
-  Serial.println(F(""));
-  Serial.println(F("Davis 6410 ==> TX20 Bridge v1.0.1"));
-  Serial.println(F(""));
-  Serial.println(String(F("speed sample T is ")) + String(k_wind_speed_sample_t)+ F(" ms"));
-  Serial.println(String(F("debounce set to ")) + String(k_wind_pulse_debounce)+ F(" ms"));
-  Serial.println(F(""));
+  serial_port.println(F(""));
+  serial_port.println(F("Davis 6410 ==> TX20 Bridge v1.0.1"));
+  serial_port.println(F(""));
+
+  // Load the configuration once. If it isn't valid the defaults are used.
+  if (!config_load(config)) serial_port.println(F("no saved config, using defaults"));
+  apply_config();
+
+  serial_port.print(F("speed sample T is "));
+  serial_port.print(config.sample_period);
+  serial_port.println(F(" ms"));
+  serial_port.print(F("debounce set to "));
+  serial_port.print(config.debounce);
+  serial_port.println(F(" ms"));
+  serial_port.println(F(""));
 
   // panel_led.on();
   // delay(3000);
   // panel_led.off();
 
   // The 6410 interface  and tx20 emulator must be initialised before use.
-  wind_meter.initialise();
-  tx20_emulator.initialise(&wind_meter, tx20_event_handler);
+  if (!wind_meter.initialise()) serial_port.println(F("the wind sensor pin can't interrupt"));
+  tx20_emulator.initialise(wind_meter_hub.port(0), tx20_event_handler);
+  if (!second_tx20_emulator.initialise(wind_meter_hub.port(1)))
+    serial_port.println(F("the second tx20 emulator can't send on its TxD pin"));
+
+  wind_log.initialise();
+  serial_port.print(F("history log holds "));
+  serial_port.print(wind_log.count());
+  serial_port.println(F(" records"));
+  serial_port.println(F("type help for the console commands"));
 }
 
 // ------------------------------------------------------------------------------------------------
-// The main loop simply services the  6410 interface, the tx20 emulator and the led.
+// The main loop simply services the  6410 interface, the pattern meter, the tx20 emulators, the
+// led, the log, the console and any console command that is still running.
 // These need to be done periodically and as often as possible.
 // ------------------------------------------------------------------------------------------------
 void loop() {
-  // Service the 6410 interface and tx20 emulator.
+  // Service the 6410 interface and tx20 emulators.
   wind_meter.service();
+  pattern_meter.service();
   tx20_emulator.service();
+  tx20_emulator.dispatch_events();
+  second_tx20_emulator.service();
   panel_led.service();
+  wind_log.service();
+  stack_monitor.service();
+  serial_console.service();
+  service_console_job();
 }
@@ -0,0 +1,96 @@
+// ------------------------------------------------------------------------------------------------
+// An encoder for NMEA 0183 wind sentences.
+// ------------------------------------------------------------------------------------------------
+#include "nmeaencoder.h"
+
+#include "tx20emulator.h"
+#include "tx20frame.h"
+
+char nmeaencoder::sentence_[k_nmea_sentence_length];
+
+// ------------------------------------------------------------------------------------------------
+// Append a string from flash.
+// ------------------------------------------------------------------------------------------------
+static char* append_P(char* p, PGM_P s) {
+  while (char c = pgm_read_byte(s++)) *p++ = c;
+  return p;
+}
+
+// ------------------------------------------------------------------------------------------------
+// Append a number of tenths as a decimal with one decimal place, eg 225 is 22.5.
+// ------------------------------------------------------------------------------------------------
+static char* append_tenths(char* p, uint16_t tenths) {
+  char digits[5];
+  uint8_t n = 0;
+
+  uint16_t whole = tenths / 10;
+  do {
+    digits[n++] = '0' + whole % 10;
+    whole /= 10;
+  } while (whole);
+
+  while (n) *p++ = digits[--n];
+  *p++ = '.';
+  *p++ = '0' + tenths % 10;
+
+  return p;
+}
+
+// ------------------------------------------------------------------------------------------------
+// Append a byte as two upper case hex digits.
+// ------------------------------------------------------------------------------------------------
+static char* append_hex(char* p, uint8_t value) {
+  static const char hex[] = "0123456789ABCDEF";
+  *p++ = hex[value >> 4];
+  *p++ = hex[value & 0x0f];
+  return p;
+}
+
+// ------------------------------------------------------------------------------------------------
+// Constructor.
+// ------------------------------------------------------------------------------------------------
+nmeaencoder::nmeaencoder(Print& serial) : serial_{serial} {}
+
+// ------------------------------------------------------------------------------------------------
+// Format a sample as a sentence.
+// The speed is the same 0.1 m/s value that goes in the TX20 frame, including the saturation.
+// The checksum is the exclusive or of everything between the $ and the *.
+// ------------------------------------------------------------------------------------------------
+uint8_t nmeaencoder::format(const windsample& sample, char* sentence) {
+  int speed = mph_to_tx20_units(sample.mph);
+  if (speed > k_tx20_max_speed) speed = k_tx20_max_speed;
+  if (speed < 0) speed = 0;
+
+  char* p = sentence;
+  p = append_P(p, PSTR("$WIMWV,"));
+  p = append_tenths(p, (sample.direction & 0x0f) * 225);
+  p = append_P(p, PSTR(",R,"));
+  p = append_tenths(p, speed);
+  p = append_P(p, PSTR(",M,A"));
+
+  uint8_t checksum = 0;
+  for (char* c = sentence + 1; c < p; ++c) checksum ^= *c;
+
+  *p++ = '*';
+  p = append_hex(p, checksum);
+  *p++ = '\r';
+  *p++ = '\n';
+  *p = '\0';
+
+  return p - sentence;
+}
+
+// ------------------------------------------------------------------------------------------------
+// Format a sample and queue it on the serial port.
+// ------------------------------------------------------------------------------------------------
+bool nmeaencoder::write(const windsample& sample) {
+  uint8_t length = format(sample, sentence_);
+
+  if (serial_.availableForWrite() < length) {
+    ++dropped_;
+    return false;
+  }
+
+  serial_.write(reinterpret_cast<const uint8_t*>(sentence_), length);
+  return true;
+}
@@ -0,0 +1,48 @@
+// ------------------------------------------------------------------------------------------------
+// An encoder for NMEA 0183 wind sentences.
+//
+// Each wind sample is formatted as a $WIMWV sentence, which gives the wind angle and speed,
+//
+//    $WIMWV,<angle>,R,<speed>,M,A*<checksum>
+//
+// The angle is in degrees from the front of the sensor (north) and the speed is in m/s. The
+// sentence is formatted into a static buffer and handed to the serial port, whose transmit
+// buffer is emptied by interrupts, so nothing waits for the uart.
+// ------------------------------------------------------------------------------------------------
+#pragma once
+
+#include <Arduino.h>
+
+#include "windmeterintf.h"
+
+// The longest sentence that can be formatted, including the terminating zero.
+constexpr uint8_t k_nmea_sentence_length = 40;
+
+class nmeaencoder {
+
+public:
+  nmeaencoder(Print& serial);
+
+  // Format a sample as a sentence and queue it on the serial port.
+  // If there isn't room in the serial port's transmit buffer the sentence is dropped rather
+  // than waiting. Returns true if the sentence was queued.
+  bool write(const windsample& sample);
+
+  // Format a sample as a sentence.
+  // Returns the length of the sentence.
+  static uint8_t format(const windsample& sample, char* sentence);
+
+  // Return the number of sentences dropped because the serial port was busy.
+  uint16_t dropped() const { return dropped_; }
+
+private:
+
+  // The serial port the sentences are sent on.
+  Print& serial_;
+
+  // The number of sentences dropped.
+  uint16_t dropped_ = 0;
+
+  // The sentence being sent.
+  static char sentence_[k_nmea_sentence_length];
+};
@@ -0,0 +1,19 @@
+// ------------------------------------------------------------------------------------------------
+// A stream that throws away everything written to it and never has anything to read.
+//
+// This stands in for the serial port when the usart is used for something else, so that the
+// console and the logging don't need to know.
+// ------------------------------------------------------------------------------------------------
+#pragma once
+
+#include <Arduino.h>
+
+class nullstream : public Stream {
+
+public:
+  int available() override { return 0; }
+  int read() override { return -1; }
+  int peek() override { return -1; }
+  size_t write(uint8_t) override { return 1; }
+  int availableForWrite() override { return 0; }
+};
@@ -0,0 +1,180 @@
+// ------------------------------------------------------------------------------------------------
+// A wind meter that sends test patterns instead of real wind.
+// ------------------------------------------------------------------------------------------------
+#include "patternmeter.h"
+
+#include "tx20frame.h"
+
+// ------------------------------------------------------------------------------------------------
+// The checksums pattern.
+// The checksum is the sum of the direction and the 3 nibbles of the speed, so these cover a
+// checksum of 0 and of 15, sums that wrap round once or more, and speeds and directions with
+// every bit set, no bit set and alternating bits.
+// ------------------------------------------------------------------------------------------------
+struct patternentry {
+  uint16_t units;
+  uint8_t direction;
+};
+
+static const patternentry k_checksum_pattern[] PROGMEM = {
+  { 0x000, 0 },
+  { 0x00f, 0 },
+  { 0x001, 14 },
+  { 0xf00, 1 },
+  { 0x800, 8 },
+  { 0x0ff, 2 },
+  { 0xfff, 3 },
+  { 0xfff, 15 },
+  { 0x555, 10 },
+  { 0xaaa, 5 },
+};
+
+constexpr uint16_t k_checksum_pattern_length =
+  sizeof(k_checksum_pattern) / sizeof(k_checksum_pattern[0]);
+
+// The number of steps it takes the ramp pattern to reach the maximum speed.
+constexpr uint16_t k_ramp_steps = (k_tx20_max_speed + 1) / k_patternmeter_ramp_step;
+
+// ------------------------------------------------------------------------------------------------
+// Constructor.
+// ------------------------------------------------------------------------------------------------
+patternmeter::patternmeter(unsigned long sample_period) : sample_period_{sample_period} {
+}
+
+// ------------------------------------------------------------------------------------------------
+// Set the pattern to send.
+// The pattern starts from the beginning.
+// ------------------------------------------------------------------------------------------------
+void patternmeter::set_pattern(windpattern pattern) {
+  pattern_ = pattern;
+  step_ = 0;
+  wind_model_.reset();
+}
+
+// ------------------------------------------------------------------------------------------------
+// Return the number of samples in one pass of the pattern.
+// ------------------------------------------------------------------------------------------------
+uint16_t patternmeter::pattern_length() const {
+  switch (pattern_) {
+    case windpattern::none:
+    case windpattern::wind: break;
+    case windpattern::speeds: return k_tx20_max_speed + 1;
+    case windpattern::directions: return 16;
+    case windpattern::ramp: return 2 * k_ramp_steps;
+    case windpattern::checksums: return k_checksum_pattern_length;
+  }
+
+  return 1;
+}
+
+// ------------------------------------------------------------------------------------------------
+// Start a new sample.
+// Like the Davis 6410, the samples run back to back once started, and starting again while they
+// are running just sets the callback for the end of the current sample.
+// ------------------------------------------------------------------------------------------------
+bool patternmeter::start_sample(windsamplefn fn, void* context) {
+  sample_fn_ = fn;
+  context_ = context;
+
+  if (!running_) {
+    running_ = true;
+    sample_start_time_ = millis();
+  }
+
+  return true;
+}
+
+// ------------------------------------------------------------------------------------------------
+// Abort the current sample if there is one in progress.
+// ------------------------------------------------------------------------------------------------
+void patternmeter::abort_sample() {
+  sample_fn_ = nullptr;
+  running_ = false;
+}
+
+// ------------------------------------------------------------------------------------------------
+// Service the meter.
+// When the sample period is over, the next step of the pattern is published as the sample.
+// ------------------------------------------------------------------------------------------------
+void patternmeter::service() {
+  if (!running_ || millis() - sample_start_time_ < sample_period_) return;
+
+  sample_start_time_ += sample_period_;
+
+  uint16_t units;
+  int direction;
+  pattern_step(step_, units, direction);
+  if (++step_ >= pattern_length()) step_ = 0;
+
+  // There are no pulses or vane readings, so they are given as they would be for a 6410.
+  // 1 TX20 unit is 0.1 m/s which is 1 / 4.4704 mph.
+  ++sample_.sequence;
+  sample_.period = sample_period_;
+  sample_.mph = units / 4.4704f;
+  sample_.pulses = round(sample_.mph * sample_period_ / 2250.f);
+  sample_.vane = direction << 6;
+  sample_.direction = direction;
+
+  // The callback is only used once, the client calls start_sample() again for the next.
+  windsamplefn fn = sample_fn_;
+  sample_fn_ = nullptr;
+  if (fn) fn(context_);
+}
+
+// ------------------------------------------------------------------------------------------------
+// Work out the speed in TX20 units and the direction for a step of the pattern.
+// ------------------------------------------------------------------------------------------------
+void patternmeter::pattern_step(uint16_t step, uint16_t& units, int& direction) {
+  units = 0;
+  direction = 0;
+
+  switch (pattern_) {
+    case windpattern::none: break;
+
+    case windpattern::wind: {
+      simulate_wind(units, direction);
+      break;
+    }
+
+    case windpattern::speeds: {
+      units = step;
+      direction = step & 0x0f;
+      break;
+    }
+
+    case windpattern::directions: {
+      units = k_patternmeter_direction_speed;
+      direction = step;
+      break;
+    }
+
+    case windpattern::ramp: {
+      uint16_t n = step < k_ramp_steps ? step : 2 * k_ramp_steps - step;
+      units = n * k_patternmeter_ramp_step;
+      if (units > k_tx20_max_speed) units = k_tx20_max_speed;
+      direction = (step >> 3) & 0x0f;
+      break;
+    }
+
+    case windpattern::checksums: {
+      patternentry entry;
+      memcpy_P(&entry, &k_checksum_pattern[step], sizeof(entry));
+      units = entry.units;
+      direction = entry.direction;
+      break;
+    }
+  }
+}
+
+// ------------------------------------------------------------------------------------------------
+// Move the simulated wind on by one sample period.
+// ------------------------------------------------------------------------------------------------
+void patternmeter::simulate_wind(uint16_t& units, int& direction) {
+  wind_model_.step(sample_period_ / 1000.f);
+
+  float speed = wind_model_.speed() * 10.f + 0.5f;
+  units = speed > k_tx20_max_speed ? k_tx20_max_speed : static_cast<uint16_t>(speed);
+
+  // The direction is rounded to the nearest of the 16 points.
+  direction = static_cast<int>(wind_model_.direction() / 22.5f + 0.5f) & 0x0f;
+}
@@ -0,0 +1,107 @@
+// ------------------------------------------------------------------------------------------------
+// A wind meter that sends test patterns instead of real wind.
+//
+// The pattern meter looks just like a Davis 6410 to the tx20 emulator, but each sample comes from
+// a fixed sequence rather than the anemometer and wind vane, so whatever reads the TX20 frames
+// can be checked against known values. The patterns are,
+//
+//    speeds      every speed from 0 to 409.5 m/s in turn, with the direction going round
+//    directions  all 16 directions at 10 m/s
+//    ramp        the speed ramping up to the maximum and back down, the direction turning slowly
+//    checksums   speeds and directions that give the extreme checksums and bit patterns
+//    wind        a simulated wind, see below
+//
+// A pattern starts from the beginning when the meter is started, and repeats once it is done.
+// The speeds are given in mph, which converts back to exactly the same TX20 units in
+// mph_to_tx20_units().
+//
+// The simulated wind comes from the model in windmodel.h, moved on by one sample period for each
+// sample. It starts from the same seed every time the pattern is chosen, so a run can be
+// repeated exactly.
+// ------------------------------------------------------------------------------------------------
+#pragma once
+
+#include <Arduino.h>
+
+#include "windmeterintf.h"
+#include "windmodel.h"
+
+// The test patterns. none means the pattern meter isn't used.
+enum class windpattern : uint8_t {
+  none,
+  speeds,
+  directions,
+  ramp,
+  checksums,
+  wind,
+};
+
+// The speed sent by the directions pattern, in TX20 units (0.1 m/s).
+constexpr uint16_t k_patternmeter_direction_speed = 100;
+
+// The amount the ramp pattern changes the speed by for each sample, in TX20 units.
+constexpr uint16_t k_patternmeter_ramp_step = 64;
+
+class patternmeter : public windmeterintf {
+
+public:
+  patternmeter(unsigned long sample_period = 2250);
+
+  // Set the pattern to send. This takes effect from the next sample.
+  void set_pattern(windpattern pattern);
+  windpattern pattern() const { return pattern_; }
+
+  // Set the sample period in milliseconds.
+  void set_sample_period(unsigned long sample_period) { sample_period_ = sample_period; }
+  unsigned long sample_period() const { return sample_period_; }
+
+  // Return the number of samples in one pass of the pattern.
+  uint16_t pattern_length() const;
+
+  // Start a new sample.
+  // The callback will be called when the sample is ready.
+  bool start_sample(windsamplefn fn, void* context) override;
+
+  // Abort the current sample if there is one in progress.
+  void abort_sample() override;
+
+  // Return the last sample.
+  const windsample& get_sample() const override { return sample_; }
+
+  // Service the meter.
+  // This must be called as often as possible from the main loop.
+  void service();
+
+private:
+
+  // Work out the speed in TX20 units and the direction for a step of the pattern.
+  void pattern_step(uint16_t step, uint16_t& units, int& direction);
+
+  // Move the simulated wind on by one sample period.
+  void simulate_wind(uint16_t& units, int& direction);
+
+  // The pattern being sent.
+  windpattern pattern_ = windpattern::speeds;
+
+  // The sample period in milliseconds.
+  unsigned long sample_period_;
+
+  // Will be true while samples are being taken.
+  bool running_ = false;
+
+  // The time in milliseconds the current sample started.
+  unsigned long sample_start_time_ = 0;
+
+  // The step of the pattern the next sample will send.
+  uint16_t step_ = 0;
+
+  // The callback for the end of the current sample.
+  windsamplefn sample_fn_ = nullptr;
+  void* context_ = nullptr;
+
+  // The last sample.
+  windsample sample_ = {};
+
+  // The simulated wind.
+  windmodel wind_model_;
+};
@@ -0,0 +1,60 @@
+// ------------------------------------------------------------------------------------------------
+// A fixed size ring buffer for passing items from one producer to one consumer.
+//
+// The producer only writes the head and the consumer only writes the tail, so no locking is
+// needed even if one side is an isr. An item is copied in before the head moves, and copied out
+// before the tail moves. The size must be a power of 2, and the buffer holds one less item than
+// its size.
+// ------------------------------------------------------------------------------------------------
+#pragma once
+
+#include <stdint.h>
+
+template <typename T, uint8_t N>
+class ringbuffer {
+
+  static_assert(N >= 2 && (N & (N - 1)) == 0, "ringbuffer size must be a power of 2");
+
+public:
+
+  // Add an item. Returns false if the buffer is full.
+  bool push(const T& item) {
+    uint8_t head = head_;
+    uint8_t next = (head + 1) & (N - 1);
+    if (next == tail_) return false;
+
+    items_[head] = item;
+    barrier();
+    head_ = next;
+
+    return true;
+  }
+
+  // Remove the oldest item. Returns false if the buffer is empty.
+  bool pop(T& item) {
+    uint8_t tail = tail_;
+    if (tail == head_) return false;
+
+    item = items_[tail];
+    barrier();
+    tail_ = (tail + 1) & (N - 1);
+
+    return true;
+  }
+
+  // Return true if there is nothing in the buffer.
+  bool empty() const { return head_ == tail_; }
+
+private:
+
+  // Stop the compiler moving memory accesses across this point.
+  static void barrier() { __asm__ __volatile__("" ::: "memory"); }
+
+  T items_[N];
+
+  // The next slot to write, only changed by the producer.
+  volatile uint8_t head_ = 0;
+
+  // The next slot to read, only changed by the consumer.
+  volatile uint8_t tail_ = 0;
+};
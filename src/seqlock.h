@@ -0,0 +1,63 @@
+// ------------------------------------------------------------------------------------------------
+// A sequence lock for sharing multi-byte state between an isr and the main loop.
+//
+// The isr is the only writer. It bumps the sequence number before and after it changes the
+// state. A reader copies the state and checks the sequence number is the same before and after
+// the copy. If it isn't, the isr ran part way through the copy and the copy is simply taken
+// again. The isr always runs to completion before the reader carries on, so the reader never
+// waits for long and interrupts never have to be disabled.
+//
+// The barriers only stop the compiler reordering memory accesses, which is all that is needed on
+// a single core whether the writer is an isr on the avr or a signal handler on a host.
+// ------------------------------------------------------------------------------------------------
+#pragma once
+
+#include <stdint.h>
+
+template <typename T>
+class seqlock {
+
+public:
+
+  // Start changing the state. Only call this from the writer.
+  T& write_begin() {
+    sequence_ = sequence_ + 1;
+    barrier();
+    return value_;
+  }
+
+  // Finish changing the state. Only call this from the writer.
+  void write_end() {
+    barrier();
+    sequence_ = sequence_ + 1;
+  }
+
+  // The writer can look at the state without a copy as nothing else changes it.
+  const T& peek() const { return value_; }
+
+  // Take a consistent copy of the state. This can be called from anywhere.
+  T read() const {
+    uint8_t before;
+    T copy;
+
+    do {
+      before = sequence_;
+      barrier();
+      copy = value_;
+      barrier();
+    } while (before != sequence_);
+
+    return copy;
+  }
+
+private:
+
+  // Stop the compiler moving memory accesses across this point.
+  static void barrier() { __asm__ __volatile__("" ::: "memory"); }
+
+  // Bumped twice by every write.
+  volatile uint8_t sequence_ = 0;
+
+  // The shared state.
+  T value_ = {};
+};
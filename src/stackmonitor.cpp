@@ -0,0 +1,141 @@
+// ------------------------------------------------------------------------------------------------
+// A monitor for the free ram between the heap and the stack.
+// ------------------------------------------------------------------------------------------------
+
+#include "stackmonitor.h"
+
+// These are provided by the avr-libc malloc. __brkval is the top of the heap, and is zero until
+// the first allocation.
+extern char __heap_start;
+extern char* __brkval;
+
+// Leave a few bytes below the stack pointer unpainted when painting.
+constexpr uint8_t k_stack_guard = 4;
+
+// The highest the top of the heap has been, kept by the malloc and realloc wrappers.
+static char* heap_peak = nullptr;
+
+// ------------------------------------------------------------------------------------------------
+// The malloc and realloc wrappers.
+// The build links with -Wl,--wrap=malloc and -Wl,--wrap=realloc, so every allocation comes
+// through here, calloc and new included. free() lowers __brkval when it frees the top block, so
+// a String that is made and freed between two calls to service() would otherwise leave its bytes
+// above the heap top where the scan would take them for the stack.
+// ------------------------------------------------------------------------------------------------
+extern "C"
+{
+void* __real_malloc(size_t size);
+void* __real_realloc(void* block, size_t size);
+
+static void note_heap_top()
+{
+  if (__brkval > heap_peak) heap_peak = __brkval;
+}
+
+void* __wrap_malloc(size_t size)
+{
+  void* block = __real_malloc(size);
+  note_heap_top();
+  return block;
+}
+
+void* __wrap_realloc(void* block, size_t size)
+{
+  block = __real_realloc(block, size);
+  note_heap_top();
+  return block;
+}
+}
+
+// ------------------------------------------------------------------------------------------------
+// Return the current top of the heap.
+// ------------------------------------------------------------------------------------------------
+static uint8_t* heap_top()
+{
+  return reinterpret_cast<uint8_t*>(__brkval ? __brkval : &__heap_start);
+}
+
+// ------------------------------------------------------------------------------------------------
+// Return the highest the top of the heap has been.
+// ------------------------------------------------------------------------------------------------
+static uint8_t* heap_highest()
+{
+  uint8_t* heap = heap_top();
+  uint8_t* peak = reinterpret_cast<uint8_t*>(heap_peak);
+  return peak > heap ? peak : heap;
+}
+
+// ------------------------------------------------------------------------------------------------
+// Return the current stack pointer.
+// ------------------------------------------------------------------------------------------------
+static uint8_t* stack_pointer()
+{
+  return reinterpret_cast<uint8_t*>(SP);
+}
+
+// ------------------------------------------------------------------------------------------------
+// Paint the free ram with the canary.
+// ------------------------------------------------------------------------------------------------
+void stackmonitor::initialise()
+{
+  heap_high_ = heap_highest();
+  stack_low_ = stack_pointer() - k_stack_guard;
+
+  for (uint8_t* p = heap_high_; p < stack_low_; ++p) *p = k_stack_canary;
+
+  scan_ = heap_high_;
+  initialised_ = true;
+}
+
+// ------------------------------------------------------------------------------------------------
+// Check the next few bytes of the painted area.
+// The scan runs up from the top of the heap. The first byte that doesn't hold the canary must
+// have been written by the stack, so it becomes the new low point and the scan starts again.
+// ------------------------------------------------------------------------------------------------
+void stackmonitor::service()
+{
+  if (!initialised_) return;
+
+  uint8_t* heap = heap_highest();
+  if (heap > heap_high_) heap_high_ = heap;
+  if (scan_ < heap_high_) scan_ = heap_high_;
+
+  uint8_t* sp = stack_pointer();
+  if (sp < stack_low_) stack_low_ = sp;
+
+  for (uint8_t i = 0; i < k_stack_scan_bytes; ++i)
+  {
+    if (scan_ >= stack_low_)
+    {
+      scan_ = heap_high_;
+      break;
+    }
+
+    if (*scan_ != k_stack_canary)
+    {
+      stack_low_ = scan_;
+      scan_ = heap_high_;
+      break;
+    }
+
+    ++scan_;
+  }
+}
+
+// ------------------------------------------------------------------------------------------------
+// Return the smallest gap there has been between the heap and the stack.
+// ------------------------------------------------------------------------------------------------
+uint16_t stackmonitor::min_free() const
+{
+  return stack_low_ > heap_high_ ? stack_low_ - heap_high_ : 0;
+}
+
+// ------------------------------------------------------------------------------------------------
+// Return the gap between the heap and the stack right now.
+// ------------------------------------------------------------------------------------------------
+uint16_t stackmonitor::free_now() const
+{
+  uint8_t* heap = heap_top();
+  uint8_t* sp = stack_pointer();
+  return sp > heap ? sp - heap : 0;
+}
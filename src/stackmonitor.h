@@ -0,0 +1,58 @@
+// ------------------------------------------------------------------------------------------------
+// A monitor for the free ram between the heap and the stack.
+//
+// At start up the free ram is painted with a canary value. The stack grows down into the
+// painted area and the heap grows up into it, so the lowest byte that no longer holds the canary
+// marks the deepest the stack has been. The painted area is scanned a few bytes at a time from
+// service(), so checking never takes more than a few microseconds.
+//
+// The heap can grow and shrink again between two calls to service(), leaving bytes above the
+// heap top that no longer hold the canary. So that they aren't taken for the stack, the build
+// wraps malloc() and realloc() (see platformio.ini) and the highest the heap has ever been is
+// kept on every allocation.
+// ------------------------------------------------------------------------------------------------
+#pragma once
+
+#include <Arduino.h>
+
+// The value the free ram is painted with.
+constexpr uint8_t k_stack_canary = 0xc5;
+
+// The number of bytes checked each time service() is called.
+constexpr uint8_t k_stack_scan_bytes = 8;
+
+class stackmonitor
+{
+
+public:
+
+  // Paint the free ram with the canary.
+  // This should be done as early as possible in setup().
+  void initialise();
+
+  // Check the next few bytes of the painted area.
+  // Call this from the main loop.
+  void service();
+
+  // Return the smallest gap in bytes there has been between the top of the heap and the stack.
+  // The highest the heap has been and the lowest the stack has been are used, so this is
+  // never more than the real gap.
+  uint16_t min_free() const;
+
+  // Return the gap in bytes between the top of the heap and the stack right now.
+  uint16_t free_now() const;
+
+private:
+
+  // Will be true once the free ram has been painted.
+  bool initialised_ = false;
+
+  // The highest the top of the heap has been.
+  uint8_t* heap_high_ = nullptr;
+
+  // The lowest address the stack is known to have reached.
+  uint8_t* stack_low_ = nullptr;
+
+  // The next byte to check.
+  uint8_t* scan_ = nullptr;
+};
@@ -2,6 +2,7 @@
 #include "tx20emulator.h"
 
 #include "Arduino.h"
+#include "tx20frame.h"
 #include "windmeterintf.h"
 
 // ------------------------------------------------------------------------------------------------
@@ -20,43 +21,46 @@ const char* winddrn_to_string(int drn) {
 // ------------------------------------------------------------------------------------------------
 // ------------------------------------------------------------------------------------------------
 
-// Conversion factor from seconds to microsecondss.
-constexpr float k_microseconds = 1e6;
-
-using duration = unsigned long;
-
-// This is the minimum time after Dtr is taken low for the emulator to 'wake' up
-// and start transmitting data frames.
-constexpr duration k_dtr_wakeup_interval = 1.0 * k_microseconds;
+int mph_to_tx20_units(float mph) {
+  // 1 mph is 1609.344 metres per hour.
+  return round(mph * 1.609344 * 1000.f * 10.f / 3600.f);
+}
 
-// Expected duration between sequential frames.
-constexpr duration k_frame_interval = 2.5 * k_microseconds;
+// ------------------------------------------------------------------------------------------------
+// ------------------------------------------------------------------------------------------------
 
-// Minimum time between successive frames.
-constexpr duration k_frame_min_interval =
-k_frame_interval - 0.5 * k_microseconds;
+duration tx20_profile_bit_length(tx20profile profile, duration custom_bit_length) {
+  switch (profile) {
+    case tx20profile::genuine: return k_genuine_bit_length;
+    case tx20profile::legacy: return k_legacy_bit_length;
+    case tx20profile::custom: break;
+  }
 
-// The number of bits in a frame.
-constexpr int k_frame_bit_count = 41;
+  return custom_bit_length;
+}
 
-// The length of a data bit in microseconds.
-constexpr duration k_frame_bit_length = 0.002 * k_microseconds;
-// constexpr duration k_frame_bit_length = 0.00122 * k_microseconds;
+// ------------------------------------------------------------------------------------------------
+// ------------------------------------------------------------------------------------------------
 
-// Frame duration in microseconds.
-constexpr duration k_frame_duration = k_frame_bit_count * k_frame_bit_length;
+// The bit scheduler times the data bits with timer 1. It runs with a prescaler of 8, which gives
+// a tick of 1 us on an 8 MHz board.
+constexpr uint8_t k_bit_timer_prescale = 8;
+constexpr uint32_t k_bit_timer_ticks_per_ms = F_CPU / k_bit_timer_prescale / 1000;
 
 // ------------------------------------------------------------------------------------------------
 // Constructor.
 // ------------------------------------------------------------------------------------------------
 tx20emulator::tx20emulator(int dtr_pin, int txd_pin)
-  : dtr_pin_{ dtr_pin }, txd_pin_{ txd_pin } {
+  : dtr_pin_{ dtr_pin }, txd_pin_{ txd_pin }, bit_length_{ k_frame_bit_length } {
 }
 
 // ------------------------------------------------------------------------------------------------
 // Initialise the emulator.
 // ------------------------------------------------------------------------------------------------
-void tx20emulator::initialise(windmeterintf* wind_meter, tx20eventhandler event_fn) {
+bool tx20emulator::initialise(windmeterintf* wind_meter, tx20eventhandler event_fn) {
+
+  // The frame bits are transmitted on txd by the bit scheduler. A 1 data bit is a low level.
+  if (!txd_channel_.initialise(txd_pin_, true)) return false;
 
   // The led is used to show the state of dtr.
   pinMode(LED_BUILTIN, OUTPUT);
@@ -66,9 +70,7 @@ void tx20emulator::initialise(windmeterintf* wind_meter, tx20eventhandler event_
   // dtr is sinked low to enable the tx20.
   pinMode(dtr_pin_, INPUT_PULLUP);
 
-  // The frame bits are transmitted on txd.
-  pinMode(txd_pin_, OUTPUT);
-  digitalWrite(txd_pin_, HIGH);
+  txd_channel_.set_level(HIGH);
 
   wind_meter_ = wind_meter;
   event_fn_ = event_fn;
@@ -76,6 +78,8 @@ void tx20emulator::initialise(windmeterintf* wind_meter, tx20eventhandler event_
   initialised_ = true;
 
   set_state(tx20state::disabled);
+
+  return true;
 }
 
 // ------------------------------------------------------------------------------------------------
@@ -88,6 +92,12 @@ void tx20emulator::initialise(windmeterintf* wind_meter, tx20eventhandler event_
 // end of the sending phase, the emulator loops back to the wake up phase and so
 // on. If Dtr goes high, the emulator enters the inactive phase.
 //
+// The wind meter samples back to back, so while a frame is being sent the next
+// sample is already being counted. A frame is sent at the end of every sample
+// period, so the frames go out once per sample period rather than at a fixed
+// interval, and there is no wake up delay beyond the first sample. The frame is
+// sent by the bit scheduler, so service() never waits for it.
+//
 // The built in led is lit while the tx20 emulator is sampling and sending.
 // ------------------------------------------------------------------------------------------------
 void tx20emulator::service() {
@@ -103,6 +113,9 @@ void tx20emulator::service() {
         // Check if Dtr has gone low.
         // If it has then the tx20 enters the enabled state and starts sampling.
         if (!read_dtr()) {
+          dtr_enabled_t_ = dtr_low_t_ = micros();
+          first_frame_pending_ = true;
+
           // Start a new wind sample and when complete set the state to sending.
           set_state(tx20state::start_sample);
         }
@@ -112,19 +125,28 @@ void tx20emulator::service() {
 
     case tx20state::start_sample: {
 
-        // Raise the start sample event.
-        raise_event(tx20event::start_sample);
-
         set_state(tx20state::sampling);
 
         // Start a new wind sample and when complete set the state to sending.
-        wind_meter_->start_sample(
+        // The sample is encoded into the frame buffer straight away. The wind meter is already
+        // counting the next sample, and the frame is sent from this frozen copy.
+        bool started = wind_meter_->start_sample(
           [](void* context) {
             tx20emulator* self = static_cast<tx20emulator*>(context);
+            self->load_frame();
             self->set_state(tx20state::sending);
           },
           static_cast<void*>(this));
 
+        // If the wind meter can't start, try again on the next pass unless Dtr has gone high.
+        if (!started) {
+          set_state(read_dtr() ? tx20state::disabled : tx20state::start_sample);
+          break;
+        }
+
+        // Raise the start sample event.
+        raise_event(tx20event::start_sample);
+
         break;
       }
 
@@ -132,9 +154,11 @@ void tx20emulator::service() {
         // While sampling, monitor the dtr line.
         // If it goes high then abort the sample and enter the disabled state.
         if (read_dtr()) {
-          wind_meter_->abort_sample();
-          set_state(tx20state::disabled);
+          stop();
           raise_event(tx20event::abort_sample);
+          ++stats_.aborts;
+        } else {
+          dtr_low_t_ = micros();
         }
 
         break;
@@ -142,26 +166,47 @@ void tx20emulator::service() {
 
     case tx20state::sending: {
 
-        // The sending state is atomic, ie it starts and finishes in the same service call.
-
         // Raise the start event.
         raise_event(tx20event::start_data_frame);
 
-        // Send the tx20 data frame and then continue.
-        float mph = wind_meter_->get_wind_mph();
-        int direction = wind_meter_->get_wind_direction();
+        duration now = micros();
+        duration latency = now - t_;
+        if (latency > stats_.max_latency) stats_.max_latency = latency;
+        ++stats_.frames;
+
+        if (first_frame_pending_) {
+          latency = now - dtr_enabled_t_;
+          if (latency > stats_.max_first_frame) stats_.max_first_frame = latency;
+          first_frame_pending_ = false;
+        }
+
+        // Start sending the tx20 data frame.
+        write_frame();
+        set_state(tx20state::transmitting);
 
-        write_frame(mph, direction);
+        break;
+      }
+
+    case tx20state::transmitting: {
+
+        // Wait for the last bit of the frame to be sent.
+        // Dtr isn't acted on until the frame has been sent, but it is watched so that the time
+        // taken to stop can be measured.
+        if (txd_channel_.busy()) {
+          if (!read_dtr()) dtr_low_t_ = micros();
+          break;
+        }
 
         // Raise the end event.
         raise_event(tx20event::end_data_frame);
 
-        // Check if dtr is still low, and if not disable the tx20.
-        // Otherwise continue with another sample.
-        if (read_dtr())
-          set_state(tx20state::disabled);
-        else
+        // Check if dtr is still low, and if not stop sampling and disable the tx20.
+        // Otherwise continue with the sample which is already being taken.
+        if (read_dtr()) {
+          stop();
+        } else {
           set_state(tx20state::start_sample);
+        }
 
         // Raise the sample end event.
         raise_event(tx20event::end_sample);
@@ -186,126 +231,187 @@ void tx20emulator::set_state(tx20state state) {
 
     case tx20state::disabled: {
         // Txd is set high when the tx20 is disabled.
-        digitalWrite(txd_pin_, HIGH);
+        txd_channel_.set_level(HIGH);
         break;
       }
 
     case tx20state::start_sample: {
         // Txd is set low.
-        digitalWrite(txd_pin_, LOW);
+        txd_channel_.set_level(LOW);
         break;
       }
 
     case tx20state::sampling: {
         // Txd is set low while sampling.
-        digitalWrite(txd_pin_, LOW);
+        txd_channel_.set_level(LOW);
         break;
       }
 
     case tx20state::sending: {
         // Txd is set low at the start of the frame..
-        digitalWrite(txd_pin_, LOW);
+        txd_channel_.set_level(LOW);
+        break;
       }
+
+    // Txd belongs to the bit scheduler until the frame has been sent.
+    case tx20state::transmitting:
+      break;
   }
 
   state_ = state;
 }
 
 // ------------------------------------------------------------------------------------------------
-  // Send an event only if there is an event listener attached.
+// Stop sampling because Dtr has gone high.
+// The sample being counted is thrown away. The time taken to stop is measured from the last time
+// Dtr was seen low, so it is never less than the real time.
 // ------------------------------------------------------------------------------------------------
-void tx20emulator::raise_event(tx20event event) const {
-  if (event_fn_) event_fn_(event);
+void tx20emulator::stop() {
+  wind_meter_->abort_sample();
+  set_state(tx20state::disabled);
+
+  duration latency = micros() - dtr_low_t_;
+  if (latency > stats_.max_abort) stats_.max_abort = latency;
+  ++stats_.wasted_samples;
+  first_frame_pending_ = false;
 }
 
 // ------------------------------------------------------------------------------------------------
-// Write a data frame to txd.
+// Queue an event only if there is an event listener attached.
+// The event is stamped with the time and the current sample so the handler knows exactly when
+// it happened, however late it is dispatched.
+// ------------------------------------------------------------------------------------------------
+void tx20emulator::raise_event(tx20event event) {
+  if (!event_fn_) return;
+
+  tx20eventinfo info;
+  info.event = event;
+  info.t = micros();
+  info.sequence = wind_meter_->get_sample().sequence;
+
+  if (!events_.push(info)) ++event_overflows_;
+}
+
+// ------------------------------------------------------------------------------------------------
+// Pass any waiting events to the event handler.
+// ------------------------------------------------------------------------------------------------
+void tx20emulator::dispatch_events() {
+  tx20eventinfo info;
+  while (events_.pop(info))
+    if (event_fn_) event_fn_(info);
+}
+
+// ------------------------------------------------------------------------------------------------
+// Encode the last wind sample into the frame buffer.
 //
-// Given a wind direction and speed, a tx20 frame is written to the txd pin.
 // The frame consists of 41 bits which include  crc check on the data.
 // The wind speed uses units of 0.1 metres per second.
 // ------------------------------------------------------------------------------------------------
-void tx20emulator::write_frame(float mph, int direction) const {
+void tx20emulator::load_frame() {
 
   // Need to convert the wind speed from mph to units of  0.1 meters per second.
-  int units = round(mph * 1.609344 * 1000.f * 10.f / 3600.f);
-
-  // The first half of the frame uses normal bits and the second uses inverted
-  // bits.
-  int windspeed1 = units;
-  int winddrn1 = direction;
-  int winddrn2 = ~winddrn1;
-  int windspeed2 = ~windspeed1;
-
-  // Calculate the checksum.
-  int checksum = winddrn1 + (windspeed1 & 0xf) + ((windspeed1 & 0xf0) >> 4) +
-    ((windspeed1 & 0xf00) >> 8);
-
-  checksum &= 0xf;
-
-  // Write the header which is 00100.
-  // Optionally, insert a bit errorin the header.
-  write_txd(LOW);
-  write_txd(LOW);
-  write_txd(HIGH);
-  write_txd(LOW);
-  write_txd(LOW);
-
-  // Write the 4 bit wind direction.
-  int data = winddrn1;
-  for (int i = 0; i < 4; ++i) {
-    write_txd(data & 0x01);
-    data = data >> 1;
-  }
+  // The encoder saturates speeds that don't fit in the frame.
+  const windsample& sample = wind_meter_->get_sample();
 
-  // Write the 12 bit wind speed.
-  data = windspeed1;
-  for (int i = 0; i < 12; ++i) {
-    write_txd(data & 0x01);
-    data = data >> 1;
-  }
+  t_ = micros();
+  tx20_encode(mph_to_tx20_units(sample.mph), sample.direction, frame_);
+}
 
-  for (int i = 0; i < 4; ++i) {
-    write_txd(checksum & 0x01);
-    checksum = checksum >> 1;
-  }
+// ------------------------------------------------------------------------------------------------
+// Start sending the frame buffer on txd.
+//
+// The frame is followed by a few more end bits to give whatever is reading Txd some time to
+// decide what to do with Dtr. If Dtr is left low then another capture phase will be entered,
+// but on the other hand if Dtr is allowed to float high then a the sampling is disabled and Txd
+// will go high.
+//
+// The bits are timed by timer 1, so the bit edges don't drift with the time taken by the rest
+// of the main loop. This also avoids the 8 us resolution of micros() on an 8 MHz board.
+// ------------------------------------------------------------------------------------------------
+void tx20emulator::write_frame() {
+  txd_channel_.send(frame_.bits, k_tx20_frame_length, bit_ticks());
+}
 
-  // Write the 4 bit wind direction.
-  data = winddrn2;
-  for (int i = 0; i < 4; ++i) {
-    write_txd(data & 0x01);
-    data = data >> 1;
-  }
+// ------------------------------------------------------------------------------------------------
+// Read the level on the Dtr pin.
+// A low enables the tx20 and a float/high disables it.
+// ------------------------------------------------------------------------------------------------
+bool tx20emulator::read_dtr() const { return digitalRead(dtr_pin_); }
+
+// ------------------------------------------------------------------------------------------------
+// Return the number of timer ticks in a data bit.
+// ------------------------------------------------------------------------------------------------
+uint16_t tx20emulator::bit_ticks() const {
+  return tx20_bit_ticks(bit_length_, clock_trim_);
+}
 
-  // Write the 12 bit wind speed.
-  data = windspeed2;
-  for (int i = 0; i < 12; ++i) {
-    write_txd(data & 0x01);
-    data = data >> 1;
+// ------------------------------------------------------------------------------------------------
+// Return the number of bit timer ticks in a data bit.
+// If the board's clock is fast, each tick is short and more ticks are needed.
+// ------------------------------------------------------------------------------------------------
+uint16_t tx20_bit_ticks(duration bit_length, int16_t clock_trim) {
+  int32_t ticks = bit_length * k_bit_timer_ticks_per_ms / 1000;
+  ticks += ticks * clock_trim / 1000000;
+
+  return ticks;
+}
+
+// ------------------------------------------------------------------------------------------------
+// Check the bit timing against known good values.
+// The values are for a 1 us tick and are scaled for faster boards. If a change to the emulator
+// changes the length of a bit on TxD, this will fail. The waveform itself can't be seen from
+// here, it is compared with the ideal one by scripts/txdcheck.py on a simavr capture.
+// ------------------------------------------------------------------------------------------------
+struct goldentiming {
+  uint16_t bit_length;
+  int16_t clock_trim;
+  uint16_t ticks;
+};
+
+static const goldentiming k_golden_timings[] PROGMEM = {
+  { k_genuine_bit_length, 0, 1220 },
+  { k_legacy_bit_length, 0, 2000 },
+  { k_legacy_bit_length, 10000, 2020 },
+  { k_legacy_bit_length, -10000, 1980 },
+  { 10000, k_max_clock_trim, 10300 },
+  { 500, -k_max_clock_trim, 485 },
+};
+
+uint16_t tx20_timing_selftest() {
+  uint16_t failures = 0;
+
+  for (const goldentiming& entry : k_golden_timings) {
+    goldentiming golden;
+    memcpy_P(&golden, &entry, sizeof(golden));
+
+    uint16_t expected = golden.ticks * (k_bit_timer_ticks_per_ms / 1000);
+    if (tx20_bit_ticks(golden.bit_length, golden.clock_trim) != expected) ++failures;
   }
 
-  // That's the end of the data frame.
-  // What we do here is write a few more end bits to give whatever is reading Txd some
-  // time to decide what to do with Dtr. If Dtr is left low then another capture phase
-  // will be entered, but on the other hand if Dtr is allowed to float high then a
-  // the sampling is disabled and Txd will go high.
-  for (int i = 0; i < 10; ++i) write_txd(LOW);
+  return failures;
 }
 
 // ------------------------------------------------------------------------------------------------
-// Read the level on the Dtr pin.
-// A low enables the tx20 and a float/high disables it.
+// Return the most microseconds a TxD bit edge has been late.
 // ------------------------------------------------------------------------------------------------
-bool tx20emulator::read_dtr() const { return digitalRead(dtr_pin_); }
+duration tx20emulator::max_bit_late() const {
+  return static_cast<uint32_t>(txd_channel_.max_late()) * 1000 / k_bit_timer_ticks_per_ms;
+}
 
 // ------------------------------------------------------------------------------------------------
-// Write a data bit to the TxD line.
-// The data pulse lasts k_frame_bit_length microseconds... approx 1.22 ms.
+// Work out the clock trim from a measured frame length.
+// With the clock trim t, a frame measured as m when it should be e means the clock is fast by
+// (1 + t) * e / m - 1, which is close to t + (e - m) / m.
 // ------------------------------------------------------------------------------------------------
-void tx20emulator::write_txd(bool data) const {
-  const duration t = micros();
-  digitalWrite(txd_pin_, !data);
+int16_t tx20emulator::calibrate_clock(duration measured_frame_length) {
+  if (measured_frame_length == 0) return clock_trim_;
+
+  float expected = static_cast<float>(bit_length_) * k_tx20_frame_length;
+  float trim = clock_trim_ + (expected - measured_frame_length) * 1e6f / measured_frame_length;
+
+  if (trim > k_max_clock_trim) trim = k_max_clock_trim;
+  if (trim < -k_max_clock_trim) trim = -k_max_clock_trim;
 
-  while (micros() - t < k_frame_bit_length)
-    ;
+  clock_trim_ = round(trim);
+  return clock_trim_;
 }
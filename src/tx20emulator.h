@@ -5,11 +5,18 @@
 // k_data_dtr should be taken low to make the emulator active, just like a real
 // tx20. When k_data_dtr is low, the emulator starts sending data frames on
 // k_data_txd_out every few seconds.
+//
+// The frames are sent by the shared bit scheduler, so several emulators can run at once, each
+// with its own Dtr and TxD pins.
 // ------------------------------------------------------------------------------------------------
 #pragma once
 
 #include <Arduino.h>
 
+#include "bitscheduler.h"
+#include "ringbuffer.h"
+#include "tx20frame.h"
+
 // These are the events emitted by the tx20 emulator.
 enum class tx20event {
   start_sample,
@@ -20,19 +27,79 @@ enum class tx20event {
 };
 
 // These are the states the tx20 emulator can be in.
+//    sending - the frame is handed to the bit scheduler
+//    transmitting - the bit scheduler is sending the frame
 enum class tx20state {
   nothing,
   disabled,
   start_sample,
   sampling,
-  sending
+  sending,
+  transmitting
 };
 
 // Durations are measured in microseconds.
 using duration = uint32_t;
 
+// The bit rate profiles.
+//    genuine - the 1.22 ms bit length used by a real TX20
+//    legacy - the 2 ms bit length used by earlier versions of the bridge
+//    custom - a bit length set by the user
+enum class tx20profile : uint8_t {
+  genuine,
+  legacy,
+  custom
+};
+
+// The bit lengths for the genuine and legacy profiles in microseconds.
+constexpr duration k_genuine_bit_length = 1220;
+constexpr duration k_legacy_bit_length = 2000;
+
+// The default length of a data bit in microseconds.
+constexpr duration k_frame_bit_length = k_legacy_bit_length;
+
+// The largest clock trim in parts per million.
+constexpr int16_t k_max_clock_trim = 30000;
+
+// An event as it is passed to the event handler.
+struct tx20eventinfo {
+  // The event.
+  tx20event event;
+
+  // The time the event happened in microseconds.
+  duration t;
+
+  // The sequence number of the last sample published by the wind meter when the event happened.
+  uint16_t sequence;
+};
+
+// The number of events that can be waiting to be dispatched. Must be a power of 2.
+constexpr uint8_t k_tx20_event_queue_size = 8;
+
+// Counters kept by the emulator.
+struct tx20stats {
+  // The number of frames sent.
+  uint16_t frames;
+
+  // The number of samples aborted because Dtr went high.
+  uint16_t aborts;
+
+  // The longest time in microseconds between a sample being ready and its frame starting.
+  duration max_latency;
+
+  // The longest time in microseconds from Dtr being seen low to the first frame starting.
+  duration max_first_frame;
+
+  // The longest time in microseconds from Dtr last being seen low to the emulator stopping
+  // after Dtr has gone high.
+  duration max_abort;
+
+  // The number of samples thrown away because Dtr went high.
+  uint16_t wasted_samples;
+};
+
 // Signature for the tx20 events callback function.
-using tx20eventhandler = void (*)(tx20event event);
+using tx20eventhandler = void (*)(const tx20eventinfo& event);
 
 // windmeterintf is an interface class  for wind meters.
 class windmeterintf;
@@ -40,19 +107,64 @@ class windmeterintf;
 // Utility function to convert a wind direction value to a name string.
 const char* winddrn_to_string(int drn);
 
+// Utility function to convert a wind speed in mph to TX20 units of 0.1 m/s.
+int mph_to_tx20_units(float mph);
+
+// Utility function to return the bit length for a profile.
+// The custom bit length is returned for the custom profile.
+duration tx20_profile_bit_length(tx20profile profile, duration custom_bit_length);
+
+// Utility function to return the number of bit timer ticks in a data bit, corrected by the
+// clock trim in parts per million.
+uint16_t tx20_bit_ticks(duration bit_length, int16_t clock_trim);
+
+// Check the bit timing against known good values.
+// Returns the number of failures, so 0 is a pass.
+uint16_t tx20_timing_selftest();
+
 class tx20emulator {
 
 public:
   tx20emulator(int dtr_pin, int txt_pin);
 
   // Initialise the resources used by the emulator and set the event handler.
-  // Must be done before the eumlator can be used.
-  void initialise(windmeterintf* wind_meter, tx20eventhandler fn = nullptr);
+  // Must be done before the eumlator can be used. Returns false if the bit scheduler can't send
+  // on the TxD pin.
+  bool initialise(windmeterintf* wind_meter, tx20eventhandler fn = nullptr);
 
   // Service the tx20 emulator.
   // This should be called periodically,
   void service();
 
+  // Pass any waiting events to the event handler.
+  // Events are queued by service() so that the time taken by the handler can't hold up the
+  // emulator. This should be called periodically, after service().
+  void dispatch_events();
+
+  // Set the length of a data bit in microseconds.
+  void set_bit_length(duration bit_length) { bit_length_ = bit_length; }
+  duration bit_length() const { return bit_length_; }
+
+  // Set the clock trim in parts per million.
+  // This is how fast the board's clock runs compared to a reference, and is used to correct
+  // the bit length. See calibrate_clock().
+  void set_clock_trim(int16_t trim) { clock_trim_ = trim; }
+  int16_t clock_trim() const { return clock_trim_; }
+
+  // Work out the clock trim from the length of a frame measured against a reference.
+  // The length is from the start of the header to the end of the trailer in microseconds.
+  // Returns the new trim, which is also set.
+  int16_t calibrate_clock(duration measured_frame_length);
+
+  // Return the emulator's counters.
+  const tx20stats& stats() const { return stats_; }
+
+  // Return the most microseconds a TxD bit edge has been late.
+  duration max_bit_late() const;
+
+  // Return the number of events lost because the queue was full.
+  uint16_t event_overflows() const { return event_overflows_; }
+
   // Return the state of the tx20 emulator.
   tx20state state() const { return state_; }
 
@@ -62,19 +174,25 @@ private:
   // This may send commands to the attached wind meter and set the state of any leds.
   void set_state(tx20state state);
 
-  // Send an event only if there is an event listener attached.
-  void raise_event(tx20event event) const;
+  // Stop sampling because Dtr has gone high.
+  void stop();
+
+  // Queue an event only if there is an event listener attached.
+  void raise_event(tx20event event);
 
-  // Write a data frame to Txd.
-  // See above for details on the bit layout of the frame.
-  void write_frame(float mph, int direction) const;
+  // Encode the last wind sample into the frame buffer.
+  void load_frame();
+
+  // Start sending the frame buffer on Txd.
+  // See tx20frame.h for details on the bit layout of the frame.
+  void write_frame();
 
   // Read the input level of Dtr.
   // A low enables the tx20 and high disables it.
   bool read_dtr() const;
 
-  // Writes a value to TxD.
-  void write_txd(bool value) const;
+  // Return the number of timer ticks in a data bit, corrected by the clock trim.
+  uint16_t bit_ticks() const;
 
   // If the dtr pin is held low, the tx20 emulator starts sampling and sending frames.
   const int dtr_pin_;
@@ -94,9 +212,39 @@ private:
   // Events are emitted by the tx20eulator for the start of each sample etc.
   tx20eventhandler event_fn_ = nullptr;
 
+  // The events waiting to be dispatched.
+  ringbuffer<tx20eventinfo, k_tx20_event_queue_size> events_;
+
+  // The number of events lost because the queue was full.
+  uint16_t event_overflows_ = 0;
+
   // The emulator is implemented as a state machine.
   tx20state state_ = tx20state::nothing;
 
+  // The frame being sent.
+  // It holds a copy of the sample so that it isn't changed by the next sample.
+  tx20frame frame_;
+
+  // The bit scheduler channel for Txd.
+  bitchannel txd_channel_;
+
+  // The length of a data bit in microseconds.
+  duration bit_length_;
+
+  // The clock trim in parts per million.
+  int16_t clock_trim_ = 0;
+
+  // The emulator's counters.
+  tx20stats stats_ = {};
+
   // General purpose timer value.
+  // This holds the time the last sample was ready.
   duration t_;
+
+  // The time Dtr was seen to go low, and whether the first frame since then has been sent.
+  duration dtr_enabled_t_ = 0;
+  bool first_frame_pending_ = false;
+
+  // The last time Dtr was seen low while sampling or sending.
+  duration dtr_low_t_ = 0;
 };
@@ -0,0 +1,210 @@
+// ------------------------------------------------------------------------------------------------
+// Encoding and decoding of TX20 data frames.
+// See the header file for the layout of a frame.
+// ------------------------------------------------------------------------------------------------
+#include "tx20frame.h"
+
+#include <string.h>
+
+#ifdef __AVR__
+#include <avr/pgmspace.h>
+#else
+#define PROGMEM
+#define memcpy_P memcpy
+#endif
+
+// The 5 header bits, 00100 in the order they are sent.
+constexpr uint16_t k_header = 0x04;
+
+// ------------------------------------------------------------------------------------------------
+// Append count bits of a value to a frame, least significant bit first.
+// ------------------------------------------------------------------------------------------------
+static void put_bits(tx20frame& frame, int& n, uint16_t value, int count) {
+  for (int i = 0; i < count; ++i, ++n) {
+    if (value & 0x01) frame.bits[n >> 3] |= 1 << (n & 7);
+    value >>= 1;
+  }
+}
+
+// ------------------------------------------------------------------------------------------------
+// Read count bits from a frame, least significant bit first.
+// ------------------------------------------------------------------------------------------------
+static uint16_t get_bits(const tx20frame& frame, int& n, int count) {
+  uint16_t value = 0;
+  for (int i = 0; i < count; ++i, ++n)
+    if (tx20_frame_bit(frame, n)) value |= 1 << i;
+  return value;
+}
+
+// ------------------------------------------------------------------------------------------------
+// Calculate the 4 bit checksum for a direction and speed.
+// ------------------------------------------------------------------------------------------------
+static uint16_t checksum(uint16_t speed, uint16_t direction) {
+  return (direction + (speed & 0xf) + ((speed >> 4) & 0xf) + ((speed >> 8) & 0xf)) & 0xf;
+}
+
+// ------------------------------------------------------------------------------------------------
+// Encode a wind speed and direction into a frame.
+// ------------------------------------------------------------------------------------------------
+void tx20_encode(int speed, int direction, tx20frame& frame) {
+  if (speed < 0) speed = 0;
+  if (speed > k_tx20_max_speed) speed = k_tx20_max_speed;
+
+  // Masking the low 4 bits is the same as modulo 16 for negative numbers too.
+  uint16_t drn = direction & 0xf;
+  uint16_t units = speed;
+
+  memset(frame.bits, 0, sizeof(frame.bits));
+
+  // The trailer bits are left as 0.
+  int n = 0;
+  put_bits(frame, n, k_header, 5);
+  put_bits(frame, n, drn, 4);
+  put_bits(frame, n, units, 12);
+  put_bits(frame, n, checksum(units, drn), 4);
+  put_bits(frame, n, ~drn, 4);
+  put_bits(frame, n, ~units, 12);
+}
+
+// ------------------------------------------------------------------------------------------------
+// Decode a frame.
+// This is written the way a receiver would decode the frame and shares nothing with the encoder
+// apart from the checksum calculation.
+// ------------------------------------------------------------------------------------------------
+bool tx20_decode(const tx20frame& frame, int& speed, int& direction) {
+  int n = 0;
+  uint16_t header = get_bits(frame, n, 5);
+  uint16_t drn = get_bits(frame, n, 4);
+  uint16_t units = get_bits(frame, n, 12);
+  uint16_t sum = get_bits(frame, n, 4);
+  uint16_t drn_inverted = get_bits(frame, n, 4);
+  uint16_t units_inverted = get_bits(frame, n, 12);
+  uint16_t trailer = get_bits(frame, n, k_tx20_trailer_bits);
+
+  if (header != k_header || trailer != 0) return false;
+  if (sum != checksum(units, drn)) return false;
+  if ((drn ^ drn_inverted) != 0xf || (units ^ units_inverted) != 0xfff) return false;
+
+  speed = units;
+  direction = drn;
+
+  return true;
+}
+
+// ------------------------------------------------------------------------------------------------
+// Encode a speed and direction, decode the frame and check the result is what was expected.
+// ------------------------------------------------------------------------------------------------
+static bool check(int speed, int direction, int expected_speed, int expected_direction) {
+  tx20frame frame;
+  tx20_encode(speed, direction, frame);
+
+  int decoded_speed;
+  int decoded_direction;
+  return tx20_decode(frame, decoded_speed, decoded_direction) &&
+         decoded_speed == expected_speed && decoded_direction == expected_direction;
+}
+
+// ------------------------------------------------------------------------------------------------
+// Frames that are known to be right, as they go out on TxD, see tx20golden.inc.
+// The decoder shares the encoder's idea of the layout, so these catch a change that both would
+// agree on.
+// ------------------------------------------------------------------------------------------------
+struct goldenframe {
+  int speed;
+  int direction;
+  uint8_t bits[sizeof(tx20frame::bits)];
+};
+
+static const goldenframe k_golden_frames[] PROGMEM = {
+#include "tx20golden.inc"
+};
+
+// ------------------------------------------------------------------------------------------------
+// Out of range values and what they must be encoded as.
+// ------------------------------------------------------------------------------------------------
+struct rangecheck {
+  int16_t speed;
+  int16_t direction;
+  int16_t expected_speed;
+  int16_t expected_direction;
+};
+
+static const rangecheck k_range_checks[] PROGMEM = {
+  { k_tx20_max_speed + 1, 0, k_tx20_max_speed, 0 },
+  { 32767, 0, k_tx20_max_speed, 0 },
+  { -1, 0, 0, 0 },
+  { -32768, 0, 0, 0 },
+  { 100, -1, 100, 15 },
+  { 100, -16, 100, 0 },
+  { 100, 16, 100, 0 },
+};
+
+// The checks, in the order they are run. Every speed is tried once with the direction cycling
+// through all 16 values, which covers every value of each field. Every direction is then tried
+// with the extreme speeds. The out of range cases must saturate the speed and wrap the
+// direction, and a frame with any one bit flipped must not decode. Finally the encoder must
+// match the golden frames bit for bit.
+constexpr uint16_t k_speed_checks = k_tx20_max_speed + 1;
+constexpr uint16_t k_direction_checks = 2 * 16;
+constexpr uint16_t k_range_check_count = sizeof(k_range_checks) / sizeof(k_range_checks[0]);
+constexpr uint16_t k_corruption_checks = k_tx20_frame_length;
+constexpr uint16_t k_golden_checks = sizeof(k_golden_frames) / sizeof(k_golden_frames[0]);
+
+// ------------------------------------------------------------------------------------------------
+// Run one check. Returns true if it passes.
+// ------------------------------------------------------------------------------------------------
+static bool run_check(uint16_t index) {
+  if (index < k_speed_checks) return check(index, index & 0xf, index, index & 0xf);
+  index -= k_speed_checks;
+
+  if (index < k_direction_checks) {
+    int speed = index & 0x01 ? k_tx20_max_speed : 0;
+    return check(speed, index >> 1, speed, index >> 1);
+  }
+  index -= k_direction_checks;
+
+  if (index < k_range_check_count) {
+    rangecheck range;
+    memcpy_P(&range, &k_range_checks[index], sizeof(range));
+    return check(range.speed, range.direction, range.expected_speed, range.expected_direction);
+  }
+  index -= k_range_check_count;
+
+  tx20frame frame;
+  if (index < k_corruption_checks) {
+    int speed;
+    int direction;
+    tx20_encode(1234, 5, frame);
+    frame.bits[index >> 3] ^= 1 << (index & 7);
+    return !tx20_decode(frame, speed, direction);
+  }
+  index -= k_corruption_checks;
+
+  goldenframe golden;
+  memcpy_P(&golden, &k_golden_frames[index], sizeof(golden));
+  tx20_encode(golden.speed, golden.direction, frame);
+  return memcmp(frame.bits, golden.bits, sizeof(frame.bits)) == 0;
+}
+
+// ------------------------------------------------------------------------------------------------
+// Run the next few checks of the self test.
+// ------------------------------------------------------------------------------------------------
+bool tx20_selftest_step(tx20selftest& test) {
+  constexpr uint16_t checks = k_speed_checks + k_direction_checks + k_range_check_count +
+                              k_corruption_checks + k_golden_checks;
+
+  for (uint8_t n = 0; n < k_tx20_selftest_batch && test.next < checks; ++n, ++test.next)
+    if (!run_check(test.next)) ++test.failures;
+
+  return test.next < checks;
+}
+
+// ------------------------------------------------------------------------------------------------
+// Check the encoder against the decoder in one go.
+// ------------------------------------------------------------------------------------------------
+uint16_t tx20_selftest() {
+  tx20selftest test;
+  while (tx20_selftest_step(test)) continue;
+
+  return test.failures;
+}
@@ -0,0 +1,73 @@
+// ------------------------------------------------------------------------------------------------
+// Encoding and decoding of TX20 data frames.
+//
+// A frame is 41 bits followed by 10 trailer bits, sent least significant bit first,
+//
+//    header     5 bits   00100
+//    direction  4 bits   0=N, 4=E etc.
+//    speed     12 bits   units of 0.1 m/s
+//    checksum   4 bits   direction + the 3 nibbles of the speed, modulo 16
+//    direction  4 bits   inverted
+//    speed     12 bits   inverted
+//    trailer   10 bits   0
+//
+// The frame is held as data bits. Note that a 0 data bit is sent as a high level on TxD.
+// Nothing in here depends on the Arduino libraries.
+// ------------------------------------------------------------------------------------------------
+#pragma once
+
+#include <stdint.h>
+
+// The number of bits in a frame, not counting the trailer.
+constexpr int k_tx20_frame_bits = 41;
+
+// The number of bits sent after the frame to give the reader time to decide what to do with Dtr.
+constexpr int k_tx20_trailer_bits = 10;
+
+// The total number of bits sent for one frame.
+constexpr int k_tx20_frame_length = k_tx20_frame_bits + k_tx20_trailer_bits;
+
+// The highest speed a frame can carry, which is 409.5 m/s.
+constexpr int k_tx20_max_speed = 0xfff;
+
+// A frame ready to be sent. Bit n of the frame is bit (n % 8) of bits[n / 8].
+struct tx20frame {
+  uint8_t bits[(k_tx20_frame_length + 7) / 8];
+};
+
+// Encode a wind speed (0.1 m/s) and direction into a frame.
+// The speed is saturated to the range 0 to k_tx20_max_speed, and the direction is taken
+// modulo 16 so that -1 is NNW and 16 is N.
+void tx20_encode(int speed, int direction, tx20frame& frame);
+
+// Decode a frame.
+// Returns false if the header, checksum, inverted fields or trailer are wrong.
+bool tx20_decode(const tx20frame& frame, int& speed, int& direction);
+
+// Return bit n of a frame.
+inline bool tx20_frame_bit(const tx20frame& frame, int n) {
+  return (frame.bits[n >> 3] >> (n & 7)) & 0x01;
+}
+
+// The number of checks run by each call to tx20_selftest_step().
+constexpr uint8_t k_tx20_selftest_batch = 8;
+
+// A self test that is run a few checks at a time.
+struct tx20selftest {
+  // The next check to run.
+  uint16_t next = 0;
+
+  // The number of checks that have failed so far.
+  uint16_t failures = 0;
+};
+
+// Check the encoder against the decoder.
+// Every speed and direction is encoded and decoded, along with out of range values which must
+// saturate, corrupted frames which must not decode, and a few frames are checked against known
+// good frames. Returns the number of failures, so 0 is a pass.
+uint16_t tx20_selftest();
+
+// Run the next k_tx20_selftest_batch checks of the self test.
+// Returns false when every check has been run, and the failures are then the result. Stepping
+// the test from the main loop keeps each pass short.
+bool tx20_selftest_step(tx20selftest& test);
@@ -0,0 +1,237 @@
+// ------------------------------------------------------------------------------------------------
+// A wind history log kept in the eeprom.
+//
+// Each record is packed into 6 bytes as follows,
+//
+//    byte 0 - sequence number bits 0-7
+//    byte 1 - sequence number bits 8-11 (low nibble), direction (high nibble)
+//    byte 2 - average speed bits 0-7
+//    byte 3 - average speed bits 8-11 (low nibble), gust bits 8-11 (high nibble)
+//    byte 4 - gust bits 0-7
+//    byte 5 - crc8 of bytes 0 to 4
+//
+// The crc means that an erased slot (all 0xff) or a record that was only partly written when
+// the power went is never mistaken for a valid record. It starts from 0xff rather than 0, as the
+// crc of all 0s would otherwise be 0 and a cleared slot would pass as a record of no wind.
+// ------------------------------------------------------------------------------------------------
+#include "windlog.h"
+
+#include <avr/eeprom.h>
+#include <util/crc16.h>
+
+// Sequence numbers are 12 bits and wrap around.
+constexpr uint16_t k_sequence_mask = 0xfff;
+
+// ------------------------------------------------------------------------------------------------
+// Return the eeprom address of a byte in a slot.
+// ------------------------------------------------------------------------------------------------
+static uint8_t* slot_address(int slot, int offset) {
+  return reinterpret_cast<uint8_t*>(k_windlog_start + slot * k_windlog_record_size + offset);
+}
+
+// ------------------------------------------------------------------------------------------------
+// Calculate the crc for the first 5 bytes of a packed record.
+// ------------------------------------------------------------------------------------------------
+static uint8_t record_crc(const uint8_t* data) {
+  uint8_t crc = 0xff;
+  for (int i = 0; i < k_windlog_record_size - 1; ++i) crc = _crc8_ccitt_update(crc, data[i]);
+  return crc;
+}
+
+// ------------------------------------------------------------------------------------------------
+// Constructor does not touch the eeprom.
+// ------------------------------------------------------------------------------------------------
+windlog::windlog(unsigned long interval) : interval_{interval} {}
+
+// ------------------------------------------------------------------------------------------------
+// Initialise the log.
+// The newest record is the valid record with the highest sequence number. The records before it
+// are counted back until the sequence is broken.
+// ------------------------------------------------------------------------------------------------
+void windlog::initialise() {
+  int newest = -1;
+  windrecord newest_record = {};
+
+  for (int slot = 0; slot < k_windlog_slots; ++slot) {
+    windrecord record;
+    if (!read_slot(slot, record)) continue;
+
+    uint16_t ahead = (record.sequence - newest_record.sequence) & k_sequence_mask;
+    if (newest < 0 || (ahead != 0 && ahead < (k_sequence_mask + 1) / 2)) {
+      newest = slot;
+      newest_record = record;
+    }
+  }
+
+  head_ = 0;
+  count_ = 0;
+  sequence_ = 0;
+
+  if (newest >= 0) {
+    head_ = (newest + 1) % k_windlog_slots;
+    sequence_ = (newest_record.sequence + 1) & k_sequence_mask;
+
+    // Count back through the contiguous run of records ending at the newest.
+    uint16_t expected = newest_record.sequence;
+    int slot = newest;
+    windrecord record;
+    while (count_ < k_windlog_slots && read_slot(slot, record) && record.sequence == expected) {
+      ++count_;
+      expected = (expected - 1) & k_sequence_mask;
+      slot = slot == 0 ? k_windlog_slots - 1 : slot - 1;
+    }
+  }
+
+  interval_start_t_ = millis();
+  initialised_ = true;
+}
+
+// ------------------------------------------------------------------------------------------------
+// Add a wind sample to the current interval.
+// ------------------------------------------------------------------------------------------------
+void windlog::add_sample(uint16_t speed, int direction) {
+  if (!initialised_) return;
+
+  // Keep clear of the value used to mark an interval with no samples.
+  if (speed >= k_windlog_no_data) speed = k_windlog_no_data - 1;
+
+  speed_total_ += speed;
+  if (speed > gust_) gust_ = speed;
+  ++directions_[direction & 0x0f];
+  ++sample_count_;
+}
+
+// ------------------------------------------------------------------------------------------------
+// Service the log.
+// At most one byte is written per call, and only if the eeprom has finished the last write.
+// This means service() never waits for the eeprom.
+// ------------------------------------------------------------------------------------------------
+void windlog::service() {
+  if (!initialised_) return;
+
+  if (millis() - interval_start_t_ >= interval_) close_interval();
+
+  if (pending_written_ < k_windlog_record_size && eeprom_is_ready()) {
+    eeprom_update_byte(slot_address(head_, pending_written_), pending_[pending_written_]);
+
+    if (++pending_written_ == k_windlog_record_size) {
+      head_ = (head_ + 1) % k_windlog_slots;
+      ++count_;
+    }
+  }
+}
+
+// ------------------------------------------------------------------------------------------------
+// Read a record, where 0 is the oldest record.
+// ------------------------------------------------------------------------------------------------
+bool windlog::read(int index, windrecord& record) const {
+  if (!initialised_ || index < 0 || index >= count_) return false;
+
+  int slot = (head_ - count_ + index + k_windlog_slots) % k_windlog_slots;
+  return read_slot(slot, record);
+}
+
+// ------------------------------------------------------------------------------------------------
+// Print the whole log, oldest record first.
+// ------------------------------------------------------------------------------------------------
+void windlog::dump(Print& out) const {
+  dump_header(out);
+
+  for (int i = 0; i < count_; ++i) dump_record(out, i);
+}
+
+// ------------------------------------------------------------------------------------------------
+// Print the column headings.
+// ------------------------------------------------------------------------------------------------
+void windlog::dump_header(Print& out) const {
+  out.println(F("seq,age,average,gust,direction"));
+}
+
+// ------------------------------------------------------------------------------------------------
+// Print one record, where 0 is the oldest. Nothing is printed if it can't be read.
+// The age is the number of intervals before the current one, so the newest record has age 1.
+// Speeds are printed in m/s.
+// ------------------------------------------------------------------------------------------------
+void windlog::dump_record(Print& out, int index) const {
+  windrecord record;
+  if (!read(index, record)) return;
+
+  out.print(record.sequence);
+  out.print(',');
+  out.print(count_ - index);
+  out.print(',');
+
+  if (record.average == k_windlog_no_data) {
+    out.println(F("-,-,-"));
+    return;
+  }
+
+  out.print(record.average / 10);
+  out.print('.');
+  out.print(record.average % 10);
+  out.print(',');
+  out.print(record.gust / 10);
+  out.print('.');
+  out.print(record.gust % 10);
+  out.print(',');
+  out.println(record.direction);
+}
+
+// ------------------------------------------------------------------------------------------------
+// Finish the current interval and pack its record ready for writing.
+// An interval with no samples is still logged so that the records stay one interval apart.
+// ------------------------------------------------------------------------------------------------
+void windlog::close_interval() {
+  interval_start_t_ += interval_;
+
+  // The last record is still being written. This can only happen with very short intervals.
+  if (pending_written_ < k_windlog_record_size) return;
+
+  uint16_t average = k_windlog_no_data;
+  uint16_t gust = k_windlog_no_data;
+  uint8_t direction = 0;
+
+  if (sample_count_ > 0) {
+    average = (speed_total_ + sample_count_ / 2) / sample_count_;
+    gust = gust_;
+
+    for (uint8_t i = 1; i < 16; ++i)
+      if (directions_[i] > directions_[direction]) direction = i;
+  }
+
+  pending_[0] = sequence_ & 0xff;
+  pending_[1] = ((sequence_ >> 8) & 0x0f) | (direction << 4);
+  pending_[2] = average & 0xff;
+  pending_[3] = ((average >> 8) & 0x0f) | ((gust >> 4) & 0xf0);
+  pending_[4] = gust & 0xff;
+  pending_[5] = record_crc(pending_);
+  pending_written_ = 0;
+
+  sequence_ = (sequence_ + 1) & k_sequence_mask;
+
+  // If the log is full, the oldest record is about to be overwritten.
+  if (count_ == k_windlog_slots) --count_;
+
+  // Start a fresh interval.
+  speed_total_ = 0;
+  gust_ = 0;
+  sample_count_ = 0;
+  memset(directions_, 0, sizeof(directions_));
+}
+
+// ------------------------------------------------------------------------------------------------
+// Read and unpack the record in a slot.
+// ------------------------------------------------------------------------------------------------
+bool windlog::read_slot(int slot, windrecord& record) {
+  uint8_t data[k_windlog_record_size];
+  eeprom_read_block(data, slot_address(slot, 0), k_windlog_record_size);
+
+  if (record_crc(data) != data[5]) return false;
+
+  record.sequence = data[0] | ((data[1] & 0x0f) << 8);
+  record.direction = data[1] >> 4;
+  record.average = data[2] | ((data[3] & 0x0f) << 8);
+  record.gust = data[4] | ((data[3] & 0xf0) << 4);
+
+  return true;
+}
@@ -0,0 +1,121 @@
+// ------------------------------------------------------------------------------------------------
+// A wind history log kept in the eeprom.
+//
+// The log is a circular buffer of compact records, one for each logging interval (10 minutes by
+// default). A record holds the average wind speed, the strongest gust and the prevailing wind
+// direction for the interval along with a sequence number. Records are written round the buffer
+// so that every slot is worn evenly, and the sequence numbers are used at start up to find the
+// newest record again.
+//
+// An eeprom write takes around 3.4 ms. To stop this holding up the tx20 emulator, a finished
+// record is written one byte at a time from service(), and only when the eeprom is ready.
+// ------------------------------------------------------------------------------------------------
+#pragma once
+
+#include <Arduino.h>
+
+// The default logging interval in milliseconds.
+constexpr unsigned long k_windlog_interval = 600000;
+
+// The log occupies the eeprom from this address to the end. The bytes below it hold the
+// configuration, see config.h.
+constexpr int k_windlog_start = 64;
+
+// Each record is packed into 6 bytes. See the .cpp file for the layout.
+constexpr int k_windlog_record_size = 6;
+
+// The number of records the log can hold. With 10 minute intervals this is a little over a day.
+constexpr int k_windlog_slots = (E2END + 1 - k_windlog_start) / k_windlog_record_size;
+
+// Speeds are logged in TX20 units (0.1 m/s). This value marks an interval with no samples.
+constexpr uint16_t k_windlog_no_data = 0xfff;
+
+// A single record from the log.
+struct windrecord {
+  // The sequence number of the record (12 bits).
+  uint16_t sequence;
+
+  // The average wind speed over the interval in 0.1 m/s.
+  uint16_t average;
+
+  // The highest sampled wind speed in the interval in 0.1 m/s.
+  uint16_t gust;
+
+  // The most frequently sampled direction, 0=N, 4=E etc.
+  uint8_t direction;
+};
+
+class windlog {
+
+public:
+  windlog(unsigned long interval = k_windlog_interval);
+
+  // Scan the eeprom for the newest record.
+  // This must be done once before the log can be used.
+  void initialise();
+
+  // Add a wind sample to the current interval.
+  // The speed is in 0.1 m/s and the direction is 0=N, 4=E etc.
+  void add_sample(uint16_t speed, int direction);
+
+  // Service the log.
+  // This closes the interval when it is over and writes any pending record to the eeprom.
+  void service();
+
+  // Return the number of records in the log.
+  int count() const { return count_; }
+
+  // Read a record, where 0 is the oldest record.
+  // Returns false if the record doesn't exist or is corrupt.
+  bool read(int index, windrecord& record) const;
+
+  // Print the whole log, oldest record first.
+  void dump(Print& out) const;
+
+  // Print the column headings, or one record, as dump() does.
+  // These let the log be printed a record at a time so the caller isn't held up.
+  void dump_header(Print& out) const;
+  void dump_record(Print& out, int index) const;
+
+private:
+
+  // Finish the current interval and queue its record for writing.
+  void close_interval();
+
+  // Read and unpack the record in a slot.
+  // Returns false if the slot doesn't hold a valid record.
+  static bool read_slot(int slot, windrecord& record);
+
+  // The logging interval in milliseconds.
+  const unsigned long interval_;
+
+  // Will be true once the log has been initialised.
+  bool initialised_ = false;
+
+  // The slot the next record will be written to.
+  int head_ = 0;
+
+  // The number of valid records in the log.
+  int count_ = 0;
+
+  // The sequence number for the next record.
+  uint16_t sequence_ = 0;
+
+  // The start time in milliseconds of the current interval.
+  unsigned long interval_start_t_ = 0;
+
+  // The accumulated speed, the gust and the sample count for the current interval.
+  uint32_t speed_total_ = 0;
+  uint16_t gust_ = 0;
+  uint16_t sample_count_ = 0;
+
+  // A histogram of the directions sampled in the current interval.
+  uint16_t directions_[16] = {};
+
+  // The packed record waiting to be written to the eeprom.
+  uint8_t pending_[k_windlog_record_size];
+
+  // The number of bytes of the pending record already written. A value of
+  // k_windlog_record_size means there is nothing left to write.
+  uint8_t pending_written_ = k_windlog_record_size;
+};
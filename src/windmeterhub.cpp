@@ -0,0 +1,95 @@
+// ------------------------------------------------------------------------------------------------
+// A hub for sharing one wind meter between several clients.
+// ------------------------------------------------------------------------------------------------
+#include "windmeterhub.h"
+
+// ------------------------------------------------------------------------------------------------
+// Constructor.
+// ------------------------------------------------------------------------------------------------
+windmeterhub::windmeterhub(windmeterintf& meter) : meter_{&meter} {
+  for (hubport& port : ports_) port.hub_ = this;
+}
+
+// ------------------------------------------------------------------------------------------------
+// Start a new sample on a port.
+// The meter samples back to back, so a port that starts while the meter is already running
+// gets the end of the sample that is being counted.
+// ------------------------------------------------------------------------------------------------
+bool windmeterhub::hubport::start_sample(windsamplefn fn, void* context) {
+  fn_ = fn;
+  context_ = context;
+  running_ = true;
+
+  hub_->start();
+  return hub_->running_;
+}
+
+// ------------------------------------------------------------------------------------------------
+// Abort the sample on a port.
+// ------------------------------------------------------------------------------------------------
+void windmeterhub::hubport::abort_sample() {
+  fn_ = nullptr;
+  running_ = false;
+
+  hub_->stop();
+}
+
+// ------------------------------------------------------------------------------------------------
+// Start the meter sampling if it isn't already.
+// ------------------------------------------------------------------------------------------------
+void windmeterhub::start() {
+  if (!running_) running_ = meter_->start_sample(sample_ready, this);
+}
+
+// ------------------------------------------------------------------------------------------------
+// Stop the meter if no port is sampling.
+// ------------------------------------------------------------------------------------------------
+void windmeterhub::stop() {
+  for (const hubport& port : ports_)
+    if (port.running_) return;
+
+  if (running_) meter_->abort_sample();
+  running_ = false;
+}
+
+// ------------------------------------------------------------------------------------------------
+// Change the wind meter the ports are connected to.
+// ------------------------------------------------------------------------------------------------
+void windmeterhub::set_meter(windmeterintf& meter) {
+  if (meter_ == &meter) return;
+
+  if (running_) meter_->abort_sample();
+  running_ = false;
+  meter_ = &meter;
+
+  for (const hubport& port : ports_) {
+    if (port.running_) {
+      start();
+      break;
+    }
+  }
+}
+
+// ------------------------------------------------------------------------------------------------
+// Called by the meter when a sample is ready.
+// The meter's callback is only used once, so it is set again for the next sample while any
+// port is still sampling. A port's callback is cleared before it is called, so the client can
+// start its next sample from inside the callback.
+// ------------------------------------------------------------------------------------------------
+void windmeterhub::sample_ready(void* context) {
+  windmeterhub* self = static_cast<windmeterhub*>(context);
+
+  self->running_ = false;
+  for (hubport& port : self->ports_) {
+    windsamplefn fn = port.fn_;
+    port.fn_ = nullptr;
+    if (fn) fn(port.context_);
+  }
+
+  for (const hubport& port : self->ports_) {
+    if (port.running_) {
+      self->start();
+      break;
+    }
+  }
+}
@@ -0,0 +1,72 @@
+// ------------------------------------------------------------------------------------------------
+// A hub for sharing one wind meter between several clients.
+//
+// A wind meter only has one sample callback, so two tx20 emulators can't use the same meter
+// directly. Instead each emulator is given one of the hub's ports, which looks just like a wind
+// meter. The hub keeps the meter sampling while any port is in use, and when a sample is ready
+// it calls back every port that asked for it. Every client sees the same sample, and one client
+// aborting doesn't disturb the others.
+// ------------------------------------------------------------------------------------------------
+#pragma once
+
+#include <stdint.h>
+
+#include "windmeterintf.h"
+
+// The number of ports on a hub.
+constexpr uint8_t k_windmeterhub_ports = 2;
+
+class windmeterhub {
+
+public:
+  windmeterhub(windmeterintf& meter);
+
+  // Return a port, which is used in place of the wind meter.
+  windmeterintf* port(uint8_t n) { return &ports_[n]; }
+
+  // Change the wind meter the ports are connected to.
+  // The sample being counted by the old meter is thrown away, and the ports that are sampling
+  // carry on with the new meter.
+  void set_meter(windmeterintf& meter);
+
+private:
+
+  class hubport : public windmeterintf {
+
+  public:
+    bool start_sample(windsamplefn fn, void* context) override;
+    void abort_sample() override;
+    const windsample& get_sample() const override { return hub_->meter_->get_sample(); }
+
+  private:
+    friend class windmeterhub;
+
+    // The hub the port belongs to.
+    windmeterhub* hub_ = nullptr;
+
+    // The callback for the end of the current sample, or nullptr if it isn't wanted.
+    windsamplefn fn_ = nullptr;
+    void* context_ = nullptr;
+
+    // Will be true while the client is sampling.
+    bool running_ = false;
+  };
+
+  // Start the meter sampling if it isn't already.
+  void start();
+
+  // Stop the meter if no port is sampling.
+  void stop();
+
+  // Called by the meter when a sample is ready.
+  static void sample_ready(void* context);
+
+  // The shared wind meter.
+  windmeterintf* meter_;
+
+  // Will be true while the meter is sampling for the hub.
+  bool running_ = false;
+
+  // The ports.
+  hubport ports_[k_windmeterhub_ports];
+};
@@ -6,10 +6,35 @@
 // the tx20 emulator can work with different wind meters other than the Davis 6410.
 //
 // If you want to use a different wind meter with the emulator, then your class needs
-// to implement start_sample(), abort_sample(), get_wid_mph() and get_wind_direction().
+// to implement start_sample(), abort_sample() and get_sample().
 // ------------------------------------------------------------------------------------------------
 #pragma once
 
+#include <stdint.h>
+
+// A wind sample.
+// The wind meter publishes a whole sample at the end of each sample period and never changes it
+// afterwards, so every value in it comes from the same sample.
+struct windsample {
+  // The sample number, which goes up by one for every sample.
+  uint16_t sequence;
+
+  // The number of anemometer pulses counted.
+  uint16_t pulses;
+
+  // The duration of the sample in milliseconds.
+  unsigned long period;
+
+  // The raw reading of the wind vane.
+  int vane;
+
+  // The wind speed in mph.
+  float mph;
+
+  // The wind direction as 0=N, E=4 etc.
+  int direction;
+};
+
 // This is the callback function signature for when a sample has been taken.
 using windsamplefn = void (*)(void* context);
 
@@ -26,12 +51,9 @@ public:
   // Abort the current sample if there is one in progress.
   virtual void abort_sample() = 0;
 
-  // Return the last sampled wind speed.
-  virtual float get_wind_mph() const = 0;
-
-  // Return the last sampled wind direction.
-  // Returns the direction as 0=N, E=4 etc.
-  virtual int get_wind_direction() const = 0;
+  // Return the last sample.
+  // The reference stays valid, and the sample unchanged, until the next sample is published.
+  virtual const windsample& get_sample() const = 0;
 
 };
 
@@ -0,0 +1,77 @@
+// ------------------------------------------------------------------------------------------------
+// A model of the wind as a 6410's cups see it.
+// ------------------------------------------------------------------------------------------------
+#include "windmodel.h"
+
+#include <math.h>
+
+// The seed for the pseudo random sequence. Any value but 0 will do.
+constexpr uint16_t k_random_seed = 0xace1;
+
+// ------------------------------------------------------------------------------------------------
+// Set the wind.
+// ------------------------------------------------------------------------------------------------
+void windmodel::set_wind(float mean_speed, float mean_direction, float gust_factor,
+                         float direction_spread) {
+  mean_speed_ = mean_speed;
+  mean_direction_ = mean_direction;
+  gust_factor_ = gust_factor;
+  direction_spread_ = direction_spread;
+}
+
+// ------------------------------------------------------------------------------------------------
+// Start again from the seed.
+// ------------------------------------------------------------------------------------------------
+void windmodel::reset() {
+  speed_turbulence_ = 0;
+  direction_turbulence_ = 0;
+  rotor_speed_ = mean_speed_;
+  random_ = k_random_seed;
+}
+
+// ------------------------------------------------------------------------------------------------
+// Move the wind on by t seconds.
+// Each turbulence series keeps a fraction a of its last value and adds fresh noise scaled so
+// that its standard deviation stays the same whatever the step. The rotor closes the gap to the
+// wind by a fraction that depends on how far the wind has travelled in the step.
+// ------------------------------------------------------------------------------------------------
+void windmodel::step(float t) {
+  float a = exp(-t / k_windmodel_turbulence_t);
+  float b = sqrt(1.f - a * a);
+
+  float speed_sigma = (gust_factor_ - 1.f) * mean_speed_ / 3.f;
+  speed_turbulence_ = a * speed_turbulence_ + b * speed_sigma * random_normal();
+  direction_turbulence_ = a * direction_turbulence_ + b * direction_spread_ * random_normal();
+
+  float wind = mean_speed_ + speed_turbulence_;
+  if (wind < 0) wind = 0;
+
+  // The rotor still turns a little in no wind, so the distance travelled is never quite 0.
+  float travelled = (wind > rotor_speed_ ? wind : rotor_speed_) * t + 0.01f;
+  rotor_speed_ += (wind - rotor_speed_) * (1.f - exp(-travelled / k_windmodel_distance_constant));
+}
+
+// ------------------------------------------------------------------------------------------------
+// Return the direction in degrees.
+// ------------------------------------------------------------------------------------------------
+float windmodel::direction() const {
+  float angle = fmod(mean_direction_ + direction_turbulence_, 360.f);
+  return angle < 0 ? angle + 360.f : angle;
+}
+
+// ------------------------------------------------------------------------------------------------
+// Return a pseudo random number with a mean of 0 and a standard deviation of 1.
+// The numbers come from a 16 bit xorshift sequence. Adding 4 of them together gives something
+// close enough to a normal distribution, with a variance of 4/12 that is scaled back to 1.
+// ------------------------------------------------------------------------------------------------
+float windmodel::random_normal() {
+  uint32_t sum = 0;
+  for (uint8_t i = 0; i < 4; ++i) {
+    random_ ^= random_ << 7;
+    random_ ^= random_ >> 9;
+    random_ ^= random_ << 8;
+    sum += random_;
+  }
+
+  return (sum / 65536.f - 2.f) * 1.7320508f;
+}
@@ -0,0 +1,77 @@
+// ------------------------------------------------------------------------------------------------
+// A model of the wind as a 6410's cups see it.
+//
+// The wind has a mean speed and direction, with turbulence added to both. The turbulence is a
+// first order autoregressive series driven by a pseudo random sequence, with a correlation time
+// of k_windmodel_turbulence_t, and its size is set by the gust factor, the ratio of the strongest
+// gust to the mean, which is taken as the mean plus 3 standard deviations. The speed is then
+// passed through a model of the cup rotor, which lags behind the wind by a distance constant
+// (k_windmodel_distance_constant), so it follows a gust faster at high speed than at low speed.
+// The sequence starts from the same seed every time the model is reset, so a run can be repeated
+// exactly.
+//
+// The pattern meter sends it as pattern 5, a sample period at a time. The host build plays it
+// into the 6410 interface as anemometer pulses and wind vane readings, see host/replay.cpp.
+// Nothing in here depends on the Arduino libraries.
+// ------------------------------------------------------------------------------------------------
+#pragma once
+
+#include <stdint.h>
+
+// The default wind, 5 m/s from the west with gusts 50% above the mean and the direction
+// wandering by 20 degrees.
+constexpr float k_windmodel_mean_speed = 5.f;
+constexpr float k_windmodel_mean_direction = 270.f;
+constexpr float k_windmodel_gust_factor = 1.5f;
+constexpr float k_windmodel_direction_spread = 20.f;
+
+// The correlation time of the turbulence in seconds.
+constexpr float k_windmodel_turbulence_t = 10.f;
+
+// The distance constant of the cup rotor in metres, the distance the wind travels while the rotor
+// makes up 63% of a step change in speed.
+constexpr float k_windmodel_distance_constant = 3.f;
+
+class windmodel {
+
+public:
+  windmodel() { reset(); }
+
+  // Set the wind.
+  // The mean speed is in m/s, the direction and its spread (standard deviation) are in degrees,
+  // and the gust factor is the ratio of the strongest gust to the mean speed. It takes effect
+  // from the next step, and reset() starts the rotor at the new mean.
+  void set_wind(float mean_speed, float mean_direction, float gust_factor, float direction_spread);
+
+  // Start again from the seed, with the rotor turning at the mean speed.
+  void reset();
+
+  // Move the wind on by t seconds.
+  void step(float t);
+
+  // Return the speed of the cup rotor in m/s.
+  float speed() const { return rotor_speed_; }
+
+  // Return the direction in degrees, 0 to 360.
+  float direction() const;
+
+private:
+
+  // Return a pseudo random number with a mean of 0 and a standard deviation of 1.
+  float random_normal();
+
+  // The settings.
+  float mean_speed_ = k_windmodel_mean_speed;
+  float mean_direction_ = k_windmodel_mean_direction;
+  float gust_factor_ = k_windmodel_gust_factor;
+  float direction_spread_ = k_windmodel_direction_spread;
+
+  // The turbulence is the difference from the mean speed in m/s and from the mean direction in
+  // degrees, and the rotor speed is in m/s.
+  float speed_turbulence_ = 0;
+  float direction_turbulence_ = 0;
+  float rotor_speed_ = 0;
+
+  // The state of the pseudo random sequence.
+  uint16_t random_ = 1;
+};
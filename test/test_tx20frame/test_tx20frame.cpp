@@ -0,0 +1,156 @@
+// ------------------------------------------------------------------------------------------------
+// Host tests for the TX20 frame encoder and decoder.
+//
+//    pio test -e native
+//
+// These cover more than the self test on the bridge can in the time it has, every speed with
+// every direction, a wide range of out of range values, every single bit error in a spread of
+// frames and random frames.
+// ------------------------------------------------------------------------------------------------
+#include <stdlib.h>
+#include <string.h>
+#include <unity.h>
+
+#include "tx20frame.h"
+
+// ------------------------------------------------------------------------------------------------
+// Encode and decode, returning false if the frame doesn't decode.
+// ------------------------------------------------------------------------------------------------
+static bool round_trip(int speed, int direction, int& decoded_speed, int& decoded_direction) {
+  tx20frame frame;
+  tx20_encode(speed, direction, frame);
+  return tx20_decode(frame, decoded_speed, decoded_direction);
+}
+
+// ------------------------------------------------------------------------------------------------
+// Every speed with every direction must come back as it went in.
+// ------------------------------------------------------------------------------------------------
+static void test_every_speed_and_direction() {
+  for (int speed = 0; speed <= k_tx20_max_speed; ++speed) {
+    for (int direction = 0; direction < 16; ++direction) {
+      int decoded_speed = -1;
+      int decoded_direction = -1;
+      TEST_ASSERT_TRUE(round_trip(speed, direction, decoded_speed, decoded_direction));
+      TEST_ASSERT_EQUAL_INT(speed, decoded_speed);
+      TEST_ASSERT_EQUAL_INT(direction, decoded_direction);
+    }
+  }
+}
+
+// ------------------------------------------------------------------------------------------------
+// Speeds out of range must saturate and directions out of range must wrap.
+// ------------------------------------------------------------------------------------------------
+static void test_out_of_range() {
+  int speed;
+  int direction;
+
+  for (long value = -70000; value <= 70000; value += 7) {
+    int clamped = value < 0 ? 0 : value > k_tx20_max_speed ? k_tx20_max_speed : value;
+    TEST_ASSERT_TRUE(round_trip(value, 3, speed, direction));
+    TEST_ASSERT_EQUAL_INT(clamped, speed);
+    TEST_ASSERT_EQUAL_INT(3, direction);
+  }
+
+  for (int value = -1000; value <= 1000; ++value) {
+    TEST_ASSERT_TRUE(round_trip(100, value, speed, direction));
+    TEST_ASSERT_EQUAL_INT(100, speed);
+    TEST_ASSERT_EQUAL_INT(value & 0xf, direction);
+  }
+}
+
+// ------------------------------------------------------------------------------------------------
+// A frame with any one bit flipped must not decode.
+// ------------------------------------------------------------------------------------------------
+static void test_single_bit_errors() {
+  for (int speed = 0; speed <= k_tx20_max_speed; speed += 13) {
+    for (int direction = 0; direction < 16; ++direction) {
+      for (int n = 0; n < k_tx20_frame_length; ++n) {
+        tx20frame frame;
+        int decoded_speed;
+        int decoded_direction;
+        tx20_encode(speed, direction, frame);
+        frame.bits[n >> 3] ^= 1 << (n & 7);
+        TEST_ASSERT_FALSE(tx20_decode(frame, decoded_speed, decoded_direction));
+      }
+    }
+  }
+}
+
+// ------------------------------------------------------------------------------------------------
+// A random frame that decodes must be exactly the frame the encoder makes for its values.
+// The random frames start from a good frame with a few bits flipped, so some of them decode.
+// ------------------------------------------------------------------------------------------------
+static void test_random_frames() {
+  srand(6410);
+
+  for (int n = 0; n < 200000; ++n) {
+    tx20frame frame;
+    tx20_encode(rand() % (k_tx20_max_speed + 1), rand() % 16, frame);
+    for (int flips = rand() % 4; flips > 0; --flips) {
+      int bit = rand() % k_tx20_frame_length;
+      frame.bits[bit >> 3] ^= 1 << (bit & 7);
+    }
+
+    int speed;
+    int direction;
+    if (!tx20_decode(frame, speed, direction)) continue;
+
+    tx20frame encoded;
+    tx20_encode(speed, direction, encoded);
+    TEST_ASSERT_EQUAL_UINT8_ARRAY(encoded.bits, frame.bits, sizeof(frame.bits));
+  }
+}
+
+// ------------------------------------------------------------------------------------------------
+// The encoder must match frames that are known to be right, as they go out on TxD. They are the
+// same frames the self test uses, from tx20golden.inc.
+// ------------------------------------------------------------------------------------------------
+static void test_golden_frames() {
+  static const struct {
+    int speed;
+    int direction;
+    uint8_t bits[sizeof(tx20frame::bits)];
+  } golden[] = {
+#include "tx20golden.inc"
+  };
+
+  for (const auto& entry : golden) {
+    tx20frame frame;
+    tx20_encode(entry.speed, entry.direction, frame);
+    TEST_ASSERT_EQUAL_UINT8_ARRAY(entry.bits, frame.bits, sizeof(frame.bits));
+  }
+}
+
+// ------------------------------------------------------------------------------------------------
+// The self test on the bridge must pass, and each step must run no more than a batch of checks.
+// ------------------------------------------------------------------------------------------------
+static void test_selftest() {
+  TEST_ASSERT_EQUAL_UINT16(0, tx20_selftest());
+
+  tx20selftest test;
+  uint16_t steps = 0;
+  uint16_t last = 0;
+  while (tx20_selftest_step(test)) {
+    TEST_ASSERT_EQUAL_UINT16(last + k_tx20_selftest_batch, test.next);
+    last = test.next;
+    ++steps;
+  }
+
+  TEST_ASSERT_EQUAL_UINT16(0, test.failures);
+  TEST_ASSERT_TRUE(steps > (k_tx20_max_speed + 1) / k_tx20_selftest_batch);
+}
+
+void setUp() {}
+
+void tearDown() {}
+
+int main() {
+  UNITY_BEGIN();
+  RUN_TEST(test_every_speed_and_direction);
+  RUN_TEST(test_out_of_range);
+  RUN_TEST(test_single_bit_errors);
+  RUN_TEST(test_random_frames);
+  RUN_TEST(test_golden_frames);
+  RUN_TEST(test_selftest);
+  return UNITY_END();
+}